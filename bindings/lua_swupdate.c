@@ -14,6 +14,7 @@
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -61,6 +62,7 @@ static int ctrl_connect(lua_State *L);
 static int ctrl_write(lua_State *L);
 static int ctrl_close(lua_State *L);
 static int ctrl_close_socket(lua_State *L);
+static int ctrl_install(lua_State *L);
 
 int luaopen_lua_swupdate(lua_State *L);
 
@@ -118,6 +120,7 @@ static luaL_Reg ctrl_methods[] = {
 	{"connect",    ctrl_connect},
 	{"write",      ctrl_write},
 	{"close",      ctrl_close},
+	{"install",    ctrl_install},
 	{NULL,         NULL}
 };
 
@@ -214,6 +217,32 @@ static int ipc_wait_get_msg(ipc_message *msg)
 	return 0;
 }
 
+/*
+ * Wait for the end of the update and run the post-update
+ * action, the results are pushed for the Lua caller.
+ */
+static int ctrl_wait_complete(lua_State *L) {
+	if ((RECOVERY_STATUS)ipc_wait_for_complete(ipc_wait_get_msg) == FAILURE) {
+		lua_pushnil(L);
+		lua_pushstring(L, ipc_wait_error_msg);
+		free(ipc_wait_error_msg);
+		ipc_wait_error_msg = NULL;
+		return 2;
+	}
+
+	ipc_message msg;
+	msg.data.procmsg.len = 0;
+	if (ipc_postupdate(&msg) != 0 || msg.type != ACK) {
+		lua_pushnil(L);
+		lua_pushstring(L, "SWUpdate succeeded but post-update action failed.");
+		return 2;
+	}
+
+	lua_pushboolean(L, true);
+	lua_pushnil(L);
+	return 2;
+}
+
 /**
  * @brief Close connection to SWUpdate control socket.
  *
@@ -231,25 +260,54 @@ static int ctrl_close(lua_State *L) {
 
 	(void)ctrl_close_socket(L);
 
-	if ((RECOVERY_STATUS)ipc_wait_for_complete(ipc_wait_get_msg) == FAILURE) {
+	return ctrl_wait_complete(L);
+}
+
+/**
+ * @brief Install a local SWU file.
+ *
+ * The file is passed to SWUpdate as file descriptor and read
+ * directly by SWUpdate, the call waits for SWUpdate to complete
+ * the update transaction like close().
+ *
+ * @param  [Lua] The swupdate_control class instance.
+ * @param  [Lua] Path to the SWU file.
+ * @return [Lua] True, or, in case of errors, nil plus an error message.
+ */
+static int ctrl_install(lua_State *L) {
+	struct ctrl_obj *p = (struct ctrl_obj *) auxiliar_checkclass(L, "swupdate_control", 1);
+	const char *path = luaL_checkstring(L, 2);
+	struct swupdate_request req;
+	int fd, ret;
+
+	if (p->socket != -1) {
+		lua_settop(L, 0);
 		lua_pushnil(L);
-		lua_pushstring(L, ipc_wait_error_msg);
-		free(ipc_wait_error_msg);
-		ipc_wait_error_msg = NULL;
+		lua_pushstring(L, "Already connected to SWUpdate control socket.");
 		return 2;
 	}
 
-	ipc_message msg;
-	msg.data.procmsg.len = 0;
-	if (ipc_postupdate(&msg) != 0 || msg.type != ACK) {
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		lua_settop(L, 0);
 		lua_pushnil(L);
-		lua_pushstring(L, "SWUpdate succeeded but post-update action failed.");
+		lua_pushstring(L, "Cannot open SWU file.");
 		return 2;
 	}
 
-	lua_pushboolean(L, true);
-	lua_pushnil(L);
-	return 2;
+	swupdate_prepare_req(&req);
+	req.source = SOURCE_LOCAL;
+	ret = ipc_inst_start_fd(fd, &req, sizeof(req));
+	close(fd);
+
+	lua_settop(L, 0);
+	if (ret < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, "SWUpdate rejected the install request.");
+		return 2;
+	}
+
+	return ctrl_wait_complete(L);
 }
 
 static int ctrl(lua_State *L) {
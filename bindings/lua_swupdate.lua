@@ -131,6 +131,17 @@ lua_swupdate.control = function()
         --- @return boolean | nil  # true or nil in case of error
         --- @return nil | string   # nil or an error message in case of error
         close = function(self) end,
+
+        --- Install a local SWU file passing it to SWUpdate as file descriptor.
+        --
+        --- SWUpdate reads the file directly, the call waits for the
+        --- update to complete like `close()`.
+        --
+        --- @param  self  table    This `lua_swupdate.control` instance
+        --- @param  path  string   Path to the SWU file
+        --- @return boolean | nil  # true or nil in case of error
+        --- @return nil | string   # nil or an error message in case of error
+        install = function(self, path) end,
     }
 end
 
@@ -184,7 +184,7 @@ server_op_res_t docker_image_load(int fd, size_t len)
 	channel_data_t channel_data = channel_data_defaults;
 	struct dict httpheaders_to_send;
 
-	LIST_INIT(&httpheaders_to_send);
+	dict_init(&httpheaders_to_send);
 	if (dict_insert_value(&httpheaders_to_send, "Expect", "")) {
 		ERROR("Error initializing HTTP Headers");
 		return SERVER_EINIT;
@@ -13,6 +13,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 #ifdef CONFIG_GUNZIP
 #include <zlib.h>
 #endif
@@ -32,10 +40,23 @@
 #include "util.h"
 #include "swupdate_crypto.h"
 #include "progress.h"
+#include "install_stats.h"
 
 #define MODULE_NAME "cpio"
 
-#define BUFF_SIZE	 16384
+
+/*
+ * Threaded pipeline: each step hands its output to the
+ * downstream step through a ring of PIPELINE_SLOTS buffers
+ */
+#define PIPELINE_SLOTS		4
+#define PIPELINE_SLOT_SIZE	(128 * 1024)
+
+/* Wait of a worker whose upstream step has no data yet */
+#define PIPELINE_BACKOFF_NS	(10 * 1000 * 1000)
+
+/* Minimum block size when skipped data must be read */
+#define SKIP_BUFFER_SIZE	(256 * 1024)
 
 typedef enum {
 	INPUT_FROM_FD,
@@ -65,12 +86,116 @@ int get_cpiohdr(unsigned char *buf, struct filehdr *fhdr)
 	return 0;
 }
 
+/*
+ * Byte checksum of the crc cpio format: the sum of all bytes
+ * of the file, modulo 2^32. The vector kernels add the bytes in
+ * wide lanes and fold them once at the end of the buffer.
+ */
+static uint32_t checksum_bytes(uint32_t sum, const unsigned char *buf, size_t len)
+{
+	while (len--)
+		sum += *buf++;
+
+	return sum;
+}
+
+#if defined(__SSE2__)
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint32_t checksum_avx2(uint32_t sum, const unsigned char *buf, size_t len)
+{
+	__m256i acc = _mm256_setzero_si256();
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t lanes[4];
+
+	for (; len >= 32; buf += 32, len -= 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+				_mm256_loadu_si256((const __m256i *)buf), zero));
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return checksum_bytes(sum, buf, len);
+}
+#endif
+
+static uint32_t checksum_sse2(uint32_t sum, const unsigned char *buf, size_t len)
+{
+	__m128i acc = _mm_setzero_si128();
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t lanes[2];
+
+	for (; len >= 16; buf += 16, len -= 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+				_mm_loadu_si128((const __m128i *)buf), zero));
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum += lanes[0] + lanes[1];
+
+	return checksum_bytes(sum, buf, len);
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+static uint32_t checksum_neon(uint32_t sum, const unsigned char *buf, size_t len)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+
+	for (; len >= 16; buf += 16, len -= 16)
+		acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(buf)));
+	sum += vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+	       vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+
+	return checksum_bytes(sum, buf, len);
+}
+#else
+/*
+ * Portable fallback: eight bytes at a time, even and odd
+ * bytes are added in 16 bit lanes. A lane grows by at most
+ * 510 per word, so it is folded every 128 words.
+ */
+static uint32_t checksum_words(uint32_t sum, const unsigned char *buf, size_t len)
+{
+	const uint64_t mask = 0x00ff00ff00ff00ffULL;
+	uint64_t word, acc;
+	unsigned int n;
+
+	while (len >= sizeof(word)) {
+		acc = 0;
+		for (n = 0; n < 128 && len >= sizeof(word); n++) {
+			memcpy(&word, buf, sizeof(word));
+			acc += (word & mask) + ((word >> 8) & mask);
+			buf += sizeof(word);
+			len -= sizeof(word);
+		}
+		acc = (acc & 0x0000ffff0000ffffULL) + ((acc >> 16) & 0x0000ffff0000ffffULL);
+		sum += (uint32_t)acc + (uint32_t)(acc >> 32);
+	}
+
+	return checksum_bytes(sum, buf, len);
+}
+#endif
+
+static uint32_t cpio_checksum(uint32_t sum, const unsigned char *buf, size_t len)
+{
+#if defined(__SSE2__)
+#if defined(__GNUC__) && defined(__x86_64__)
+	static int has_avx2 = -1;
+
+	if (has_avx2 < 0)
+		has_avx2 = __builtin_cpu_supports("avx2");
+	if (has_avx2)
+		return checksum_avx2(sum, buf, len);
+#endif
+	return checksum_sse2(sum, buf, len);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return checksum_neon(sum, buf, len);
+#else
+	return checksum_words(sum, buf, len);
+#endif
+}
+
 static int _fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned long *offs,
 	uint32_t *checksum, void *dgst)
 {
 	ssize_t len;
 	unsigned long count = 0;
-	int i;
 
 	while (nbytes > 0) {
 		len = read(fd, buf, nbytes);
@@ -86,8 +211,7 @@ static int _fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigne
 			return count;
 		}
 		if (checksum)
-			for (i = 0; i < len; i++)
-				*checksum += buf[i];
+			*checksum = cpio_checksum(*checksum, buf, len);
 
 		if (dgst) {
 			if (swupdate_HASH_update(dgst, buf, len) < 0)
@@ -109,6 +233,78 @@ int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes)
 	return _fill_buffer(fd, buf, nbytes, &offs, NULL, NULL);
 }
 
+/*
+ * Discard nbytes from the input without looking at them: regular
+ * files are seeked, pipes are spliced into /dev/null and any other
+ * input is read in large blocks.
+ */
+static int skip_input(int fd, unsigned long long nbytes, unsigned long *offs)
+{
+	struct stat st;
+	unsigned char *buf;
+	size_t bufsize;
+	ssize_t len;
+	off_t pos;
+
+	if (fstat(fd, &st) < 0)
+		return -EFAULT;
+
+	if (S_ISREG(st.st_mode)) {
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos >= 0) {
+			if ((unsigned long long)pos + nbytes > (unsigned long long)st.st_size) {
+				ERROR("Failure in stream %d: unexpected end of file", fd);
+				return -EFAULT;
+			}
+			if (lseek(fd, nbytes, SEEK_CUR) < 0)
+				return -EFAULT;
+			*offs += nbytes;
+			return 0;
+		}
+	}
+
+#if defined(__linux__)
+	if (S_ISFIFO(st.st_mode)) {
+		int devnull = open("/dev/null", O_WRONLY);
+
+		while (devnull >= 0 && nbytes > 0) {
+			len = splice(fd, NULL, devnull, NULL, nbytes, SPLICE_F_MOVE);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0)
+				break;
+			nbytes -= len;
+			*offs += len;
+		}
+		if (devnull >= 0)
+			close(devnull);
+		if (!nbytes)
+			return 0;
+		/* fall back to read() if splice is not supported */
+	}
+#endif
+
+	bufsize = max(get_io_buffer_size(), (size_t)SKIP_BUFFER_SIZE);
+	buf = malloc(bufsize);
+	if (!buf) {
+		ERROR("OOM skipping data");
+		return -ENOMEM;
+	}
+
+	while (nbytes > 0) {
+		len = _fill_buffer(fd, buf, min_t(unsigned long long, nbytes, bufsize),
+				   offs, NULL, NULL);
+		if (len <= 0) {
+			free(buf);
+			return len < 0 ? len : -EFAULT;
+		}
+		nbytes -= len;
+	}
+
+	free(buf);
+	return 0;
+}
+
 /*
  * Read padding that could exists between the cpio trailer and the end-of-file.
  * cpio aligns the file to 512 bytes
@@ -226,14 +422,19 @@ int copy_write_padded(void *out, const void *buf, size_t len)
 /*
  * Pipeline description
  *
- * Any given step has an input buffer and an output buffer. If output data is
- * pending, it is immediately returned to the downstream step. If the output
- * buffer is empty, more input data is processed. If the input buffer is empty,
- * data is pulled from the upstream step. When no more data can be produced,
- * zero is returned.
+ * Any given step owns its output buffer and lends a view on it to the
+ * downstream step: the step returns the number of available bytes (at
+ * most size) and sets data to point to them. The view stays valid until
+ * the step is called again, that is calling a step acknowledges that the
+ * previously returned data was consumed. This way data is touched once
+ * per transformation and is never copied between steps.
+ * If output data is pending, it is immediately returned to the downstream
+ * step. If the output buffer is empty, more input data is processed. If
+ * the input is exhausted, data is pulled from the upstream step. When no
+ * more data can be produced, zero is returned.
  */
 
-typedef int (*PipelineStep)(void *state, void *buffer, size_t size);
+typedef int (*PipelineStep)(void *state, const uint8_t **data, size_t size);
 
 struct InputState
 {
@@ -242,12 +443,34 @@ struct InputState
 	unsigned char *inbuf;
 	size_t pos;
 	size_t nbytes;
+	size_t done;	/* bytes consumed from the input */
 	unsigned long *offs;
 	void *dgst;	/* use a private context for HASH */
-	uint32_t checksum;
+	uint32_t *checksum;	/* NULL if not required */
+	uint8_t *buffer;
+	size_t bufsize;
+	struct install_stats *stats;
 };
 
-static int input_step(void *state, void *buffer, size_t size)
+static int input_digest(struct InputState *s, uint32_t *checksum,
+			const uint8_t *buf, size_t len)
+{
+	struct stats_timer t;
+	int ret = 0;
+
+	if (s->stats)
+		stats_begin(&t);
+	if (checksum)
+		*checksum = cpio_checksum(*checksum, buf, len);
+	if (s->dgst && swupdate_HASH_update(s->dgst, buf, len) < 0)
+		ret = -EFAULT;
+	if (s->stats)
+		stats_end(&t, s->stats, STATS_HASH, len);
+
+	return ret;
+}
+
+static int input_step(void *state, const uint8_t **data, size_t size)
 {
 	struct InputState *s = (struct InputState *)state;
 	int ret = 0;
@@ -256,22 +479,30 @@ static int input_step(void *state, void *buffer, size_t size)
 	}
 	switch (s->source) {
 	case INPUT_FROM_FD:
-		ret = _fill_buffer(s->fdin, buffer, size, s->offs, &s->checksum, s->dgst);
+		if (size > s->bufsize)
+			size = s->bufsize;
+		ret = _fill_buffer(s->fdin, s->buffer, size, s->offs, NULL, NULL);
 		if (ret < 0) {
 			return ret;
 		}
+		if (input_digest(s, s->checksum, s->buffer, ret) < 0)
+			return -EFAULT;
+		*data = s->buffer;
 		break;
 	case INPUT_FROM_MEMORY:
-		memcpy(buffer, &s->inbuf[s->pos], size);
-		if (s->dgst) {
-			if (swupdate_HASH_update(s->dgst, &s->inbuf[s->pos], size) < 0)
-				return -EFAULT;
-		}
+		/*
+		 * Data is already in memory: hash it and
+		 * forward it in place
+		 */
+		if (input_digest(s, NULL, &s->inbuf[s->pos], size) < 0)
+			return -EFAULT;
+		*data = &s->inbuf[s->pos];
 		ret = size;
 		s->pos += size;
 		break;
 	}
 	s->nbytes -= ret;
+	s->done += ret;
 	return ret;
 }
 
@@ -281,63 +512,58 @@ struct DecryptState
 	void *upstream_state;
 
 	void *dcrypt;	/* use a private context for decryption */
-	uint8_t input[BUFF_SIZE];
-	uint8_t output[BUFF_SIZE + AES_BLK_SIZE];
+	uint8_t *output;	/* bufsize + AES_BLK_SIZE */
+	size_t bufsize;
 	int outlen;
+	int outpos;
 	bool eof;
 };
 
-static int decrypt_step(void *state, void *buffer, size_t size)
+static int decrypt_step(void *state, const uint8_t **data, size_t size)
 {
 	struct DecryptState *s = (struct DecryptState *)state;
+	const uint8_t *input;
 	int ret;
 	int inlen;
 
-	if (s->outlen != 0) {
-		if ((int)size > s->outlen) {
-			size = s->outlen;
-		}
-		memcpy(buffer, s->output, size);
-		s->outlen -= size;
-		memmove(s->output, s->output + size, s->outlen);
-		return size;
-	}
+	if (s->outpos == s->outlen) {
+		s->outpos = s->outlen = 0;
 
-	ret = s->upstream_step(s->upstream_state, s->input, sizeof s->input);
-	if (ret < 0) {
-		return ret;
-	}
+		ret = s->upstream_step(s->upstream_state, &input, s->bufsize);
+		if (ret < 0) {
+			return ret;
+		}
 
-	inlen = ret;
+		inlen = ret;
 
-	if (!s->eof) {
-		if (inlen != 0) {
-			ret = swupdate_DECRYPT_update(s->dcrypt,
-				s->output, &s->outlen, s->input, inlen);
-		}
-		if (inlen == 0) {
-			/*
-			 * Finalise the decryption. Further plaintext bytes may
-			 * be written at this stage.
-			 */
-			ret = swupdate_DECRYPT_final(s->dcrypt,
-				s->output, &s->outlen);
-			if (ret == 0) {
-				s->eof = true;
+		if (!s->eof) {
+			if (inlen != 0) {
+				ret = swupdate_DECRYPT_update(s->dcrypt,
+					s->output, &s->outlen, input, inlen);
+			}
+			if (inlen == 0) {
+				/*
+				 * Finalise the decryption. Further plaintext bytes may
+				 * be written at this stage.
+				 */
+				ret = swupdate_DECRYPT_final(s->dcrypt,
+					s->output, &s->outlen);
+				if (ret == 0) {
+					s->eof = true;
+				}
+			}
+			if (ret < 0) {
+				return ret;
 			}
-		}
-		if (ret < 0) {
-			return ret;
 		}
 	}
 
-	if (s->outlen != 0) {
-		if ((int)size > s->outlen) {
-			size = s->outlen;
+	if (s->outpos < s->outlen) {
+		if ((int)size > s->outlen - s->outpos) {
+			size = s->outlen - s->outpos;
 		}
-		memcpy(buffer, s->output, size);
-		s->outlen -= size;
-		memmove(s->output, s->output + size, s->outlen);
+		*data = s->output + s->outpos;
+		s->outpos += size;
 		return size;
 	}
 
@@ -345,13 +571,14 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 }
 
 #if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_XZ) || defined(CONFIG_LZ4)
-typedef int (*DecompressStep)(void *state, void *buffer, size_t size);
+typedef int (*DecompressStep)(void *state, const uint8_t **data, size_t size);
 
 struct DecompressState {
 	PipelineStep upstream_step;
 	void *upstream_state;
 	void *impl_state;
-	uint8_t input[BUFF_SIZE];
+	uint8_t *output;
+	size_t bufsize;
 	bool eof;
 };
 #endif
@@ -363,25 +590,28 @@ struct GunzipState {
 	bool initialized;
 };
 
-static int gunzip_step(void *state, void *buffer, size_t size)
+static int gunzip_step(void *state, const uint8_t **data, size_t size)
 {
 	struct DecompressState *ds = (struct DecompressState *)state;
 	struct GunzipState *s = (struct GunzipState *)ds->impl_state;
+	const uint8_t *input;
 	int ret;
 	int outlen = 0;
 
-	s->strm.next_out = buffer;
+	if (size > ds->bufsize)
+		size = ds->bufsize;
+	s->strm.next_out = ds->output;
 	s->strm.avail_out = size;
 	while (outlen == 0) {
 		if (s->strm.avail_in == 0) {
-			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
+			ret = ds->upstream_step(ds->upstream_state, &input, ds->bufsize);
 			if (ret < 0) {
 				return ret;
 			} else if (ret == 0) {
 				ds->eof = true;
 			}
 			s->strm.avail_in = ret;
-			s->strm.next_in = ds->input;
+			s->strm.next_in = (unsigned char *)input;
 		}
 		if (ds->eof) {
 			break;
@@ -398,6 +628,7 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 			return -1;
 		}
 	}
+	*data = ds->output;
 	return outlen;
 }
 
@@ -408,27 +639,30 @@ struct XzState {
 	lzma_stream strm;
 	bool initialized;
 };
-static int xz_step(void* state, void* buffer, size_t size)
+static int xz_step(void* state, const uint8_t **data, size_t size)
 {
 	struct DecompressState *ds = (struct DecompressState *)state;
 	struct XzState *s = (struct XzState *)ds->impl_state;
+	const uint8_t *input;
 	lzma_ret ret;
 	int outlen = 0;
 	lzma_action action = LZMA_RUN;
 
-	s->strm.next_out = buffer;
+	if (size > ds->bufsize)
+		size = ds->bufsize;
+	s->strm.next_out = ds->output;
 	s->strm.avail_out = size;
 
 	while (outlen == 0) {
 		if (s->strm.avail_in == 0) {
-			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
+			ret = ds->upstream_step(ds->upstream_state, &input, ds->bufsize);
 			if (ret < 0) {
 				return ret;
 			} else if (ret == 0) {
 				ds->eof = true;
 			}
 			s->strm.avail_in = ret;
-			s->strm.next_in = ds->input;
+			s->strm.next_in = input;
 		}
 		if (ds->eof) {
 			break;
@@ -445,6 +679,7 @@ static int xz_step(void* state, void* buffer, size_t size)
 			return -1;
 		}
 	}
+	*data = ds->output;
 	return outlen;
 }
 
@@ -457,22 +692,24 @@ struct ZstdState {
 	ZSTD_inBuffer input_view;
 };
 
-static int zstd_step(void* state, void* buffer, size_t size)
+static int zstd_step(void* state, const uint8_t **data, size_t size)
 {
 	struct DecompressState *ds = (struct DecompressState *)state;
 	struct ZstdState *s = (struct ZstdState *)ds->impl_state;
+	const uint8_t *input;
 	size_t decompress_ret;
 	int ret;
-	ZSTD_outBuffer output = { buffer, size, 0 };
+	ZSTD_outBuffer output = { ds->output, min(size, ds->bufsize), 0 };
 
 	do {
 		if (s->input_view.pos == s->input_view.size) {
-			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
+			ret = ds->upstream_step(ds->upstream_state, &input, ds->bufsize);
 			if (ret < 0) {
 				return ret;
 			} else if (ret == 0) {
 				ds->eof = true;
 			}
+			s->input_view.src = input;
 			s->input_view.size = ret;
 			s->input_view.pos = 0;
 		}
@@ -492,6 +729,7 @@ static int zstd_step(void* state, void* buffer, size_t size)
 		} while (s->input_view.pos < s->input_view.size);
 	} while (output.pos == 0 && !ds->eof);
 
+	*data = ds->output;
 	return output.pos;
 }
 
@@ -506,24 +744,28 @@ struct Lz4State {
 	size_t input_pos;
 };
 
-static int lz4_step(void *state, void *buffer, size_t size)
+static int lz4_step(void *state, const uint8_t **data, size_t size)
 {
 	struct DecompressState *ds = (struct DecompressState *)state;
 	struct Lz4State *s = (struct Lz4State *)ds->impl_state;
+	const uint8_t *input;
 	size_t decompress_ret = 0;
 	size_t produced = 0;
 	int ret;
 
+	if (size > ds->bufsize)
+		size = ds->bufsize;
+
 	do {
 		if (s->input_pos == s->input_size) {
-			ret = ds->upstream_step(ds->upstream_state, ds->input, sizeof ds->input);
+			ret = ds->upstream_step(ds->upstream_state, &input, ds->bufsize);
 			if (ret < 0) {
 				return ret;
 			} else if (ret == 0) {
 				ds->eof = true;
 				break;
 			}
-			s->input_src = ds->input;
+			s->input_src = input;
 			s->input_size = ret;
 			s->input_pos = 0;
 		}
@@ -534,7 +776,7 @@ static int lz4_step(void *state, void *buffer, size_t size)
 		size_t old_in_pos = s->input_pos;
 
 		decompress_ret = LZ4F_decompress(s->dctx,
-						 (uint8_t *)buffer + produced, &out_len,
+						 ds->output + produced, &out_len,
 						 s->input_src + s->input_pos, &in_len,
 						 NULL);
 		if (LZ4F_isError(decompress_ret)) {
@@ -556,11 +798,305 @@ static int lz4_step(void *state, void *buffer, size_t size)
 		}
 	} while (produced == 0 && !ds->eof);
 
+	*data = ds->output;
 	return produced;
 }
 
 #endif
 
+/*
+ * Threaded step
+ *
+ * The upstream step is run by a dedicated worker thread that fills a
+ * bounded ring of buffers. The downstream step pulls data from the ring
+ * and runs in the caller's context, so that each stage of the pipeline
+ * (read + hash, decrypt, decompress, write) can run on its own core.
+ * Crossing the thread boundary costs one copy into the ring, the slot is
+ * then lent to the downstream step and released on its next call.
+ * Errors reported by the upstream step are returned to the downstream
+ * step after the data produced before the error has been consumed.
+ */
+struct PipelineSlot {
+	uint8_t *data;
+	size_t len;
+	size_t done;	/* input bytes consumed to fill the slot */
+};
+
+struct ThreadedState {
+	PipelineStep upstream_step;
+	void *upstream_state;
+	const size_t *upstream_done;	/* updated by upstream_step() */
+	size_t done;	/* input bytes behind the data handed downstream */
+
+	pthread_t thread;
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct PipelineSlot slots[PIPELINE_SLOTS];
+	size_t slot_size;
+	unsigned int head;	/* next slot filled by the worker */
+	unsigned int tail;	/* next slot consumed by downstream */
+	unsigned int count;	/* number of filled slots */
+	size_t pos;		/* bytes already lent from tail slot */
+	bool lent;		/* tail slot is lent to downstream */
+	int error;
+	bool eof;
+	bool stop;
+};
+
+static bool threaded_stopped(struct ThreadedState *s)
+{
+	bool stop;
+
+	pthread_mutex_lock(&s->lock);
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+
+	return stop;
+}
+
+/*
+ * The upstream step has no data yet: sleep on the condition variable
+ * instead of spinning, threaded_steps_stop() wakes the worker up.
+ */
+static void threaded_backoff(struct ThreadedState *s)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += PIPELINE_BACKOFF_NS;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->stop)
+		pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *threaded_worker(void *data)
+{
+	struct ThreadedState *s = (struct ThreadedState *)data;
+	struct PipelineSlot *slot;
+	const uint8_t *input;
+	size_t len;
+	int ret = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->count == PIPELINE_SLOTS && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->stop) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		slot = &s->slots[s->head];
+		pthread_mutex_unlock(&s->lock);
+
+		/*
+		 * Fill the whole slot to reduce the number of handoffs,
+		 * the slot is owned by the worker until it is published
+		 */
+		len = 0;
+		while (len < s->slot_size && !threaded_stopped(s)) {
+			ret = s->upstream_step(s->upstream_state, &input,
+					       s->slot_size - len);
+			if (ret == -EAGAIN) {
+				threaded_backoff(s);
+				continue;
+			}
+			if (ret <= 0)
+				break;
+			memcpy(slot->data + len, input, ret);
+			len += ret;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		if (len) {
+			slot->len = len;
+			slot->done = *s->upstream_done;
+			s->head = (s->head + 1) % PIPELINE_SLOTS;
+			s->count++;
+		}
+		if (ret < 0)
+			s->error = ret;
+		else if (ret == 0)
+			s->eof = true;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		if (ret <= 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int threaded_step(void *state, const uint8_t **data, size_t size)
+{
+	struct ThreadedState *s = (struct ThreadedState *)state;
+	struct PipelineSlot *slot;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	/*
+	 * Release the slot when the previous view is acknowledged
+	 */
+	if (s->lent && s->pos == s->slots[s->tail].len) {
+		s->lent = false;
+		s->pos = 0;
+		s->tail = (s->tail + 1) % PIPELINE_SLOTS;
+		s->count--;
+		pthread_cond_broadcast(&s->cond);
+	}
+	while (s->count == 0 && !s->eof && !s->error && !s->stop)
+		pthread_cond_wait(&s->cond, &s->lock);
+	if (s->count == 0) {
+		ret = s->error;
+		if (!s->eof && !ret)
+			ret = -EINTR;
+		pthread_mutex_unlock(&s->lock);
+		return ret;
+	}
+	slot = &s->slots[s->tail];
+	s->lent = true;
+	pthread_mutex_unlock(&s->lock);
+
+	if (size > slot->len - s->pos)
+		size = slot->len - s->pos;
+	*data = slot->data + s->pos;
+	s->pos += size;
+	if (s->pos == slot->len)
+		s->done = slot->done;
+
+	return size;
+}
+
+static int threaded_step_start(struct ThreadedState *s, PipelineStep step, void *state,
+			       size_t slot_size, const size_t **done)
+{
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	s->upstream_step = step;
+	s->upstream_state = state;
+	s->upstream_done = *done;
+	s->slot_size = slot_size;
+
+	for (unsigned int i = 0; i < PIPELINE_SLOTS; i++) {
+		s->slots[i].data = malloc(slot_size);
+		if (!s->slots[i].data) {
+			ERROR("OOM allocating pipeline buffers");
+			goto err;
+		}
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	ret = pthread_create(&s->thread, NULL, threaded_worker, s);
+	if (ret) {
+		ERROR("Code from pthread_create() is %d", ret);
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		goto err;
+	}
+	s->running = true;
+	*done = &s->done;
+
+	return 0;
+
+err:
+	for (unsigned int i = 0; i < PIPELINE_SLOTS; i++)
+		free(s->slots[i].data);
+	return -ENOMEM;
+}
+
+/*
+ * Stop all the workers of a pipeline. A downstream worker can still be
+ * inside threaded_step() on an upstream ring, so every ring is stopped
+ * first, then all workers are joined, and only then the rings are
+ * released.
+ */
+static void threaded_steps_stop(struct ThreadedState *states, unsigned int n)
+{
+	struct ThreadedState *s;
+	unsigned int i;
+
+	/*
+	 * A worker waiting for a free slot is woken up, otherwise it
+	 * terminates as soon as the pending upstream call returns.
+	 * A downstream worker waiting for data from a ring gets -EINTR.
+	 */
+	for (i = 0; i < n; i++) {
+		s = &states[i];
+		if (!s->running)
+			continue;
+		pthread_mutex_lock(&s->lock);
+		s->stop = true;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	for (i = 0; i < n; i++) {
+		s = &states[i];
+		if (s->running)
+			pthread_join(s->thread, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		s = &states[i];
+		if (!s->running)
+			continue;
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		for (unsigned int j = 0; j < PIPELINE_SLOTS; j++)
+			free(s->slots[j].data);
+		s->running = false;
+	}
+}
+
+/*
+ * Timed step
+ *
+ * Accounts the time spent in the upstream step to a stage of the
+ * statistics. Time spent in nested timed steps of the same thread
+ * is accounted to their own stage.
+ */
+struct TimedState {
+	PipelineStep upstream_step;
+	void *upstream_state;
+	struct install_stats *stats;
+	stats_stage_t stage;
+};
+
+static int timed_step(void *state, const uint8_t **data, size_t size)
+{
+	struct TimedState *s = (struct TimedState *)state;
+	struct stats_timer t;
+	int ret;
+
+	stats_begin(&t);
+	ret = s->upstream_step(s->upstream_state, data, size);
+	stats_end(&t, s->stats, s->stage,
+		  (ret > 0 && s->stage != STATS_WAIT) ? ret : 0);
+
+	return ret;
+}
+
+static void timed_step_wrap(struct TimedState *s, struct install_stats *stats,
+			    stats_stage_t stage, PipelineStep *step, void **state)
+{
+	s->upstream_step = *step;
+	s->upstream_state = *state;
+	s->stats = stats;
+	s->stage = stage;
+	*step = &timed_step;
+	*state = s;
+}
+
 static int hash_compare(void *dgst, unsigned char *hash)
 {
 	/*
@@ -612,19 +1148,23 @@ int copyfile(struct swupdate_copy *args)
 		.nbytes = args->nbytes,
 		.offs = args->offs,
 		.dgst = NULL,
-		.checksum = 0
+		.checksum = args->checksum,
+		.buffer = NULL,
+		.stats = args->stats
 	};
 
 	struct DecryptState decrypt_state = {
 		.upstream_step = NULL, .upstream_state = NULL,
 		.dcrypt = NULL,
+		.output = NULL,
 		.outlen = 0, .eof = false
 	};
 
 #if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_XZ) || defined(CONFIG_LZ4)
 	struct DecompressState decompress_state = {
 		.upstream_step = NULL, .upstream_state = NULL,
-		.impl_state = NULL
+		.impl_state = NULL,
+		.output = NULL
 	};
 
 	DecompressStep decompress_step = NULL;
@@ -668,15 +1208,65 @@ int copyfile(struct swupdate_copy *args)
 		input_state.source = INPUT_FROM_MEMORY;
 	}
 
+	/*
+	 * One thread for each step in the pipeline when requested:
+	 * input, decrypt, decompress
+	 */
+	struct ThreadedState threaded_state[3];
+	unsigned int nthreads = 0;
+
+	/*
+	 * Input bytes behind the data that reaches the output: each
+	 * ring forwards the count with its slots, so it is always read
+	 * by the thread that updates it
+	 */
+	const size_t *done = &input_state.done;
+
+	/*
+	 * One timed step for each step and for each thread boundary
+	 */
+	struct TimedState timed_state[6];
+	unsigned int ntimed = 0;
+	struct stats_timer timer;
+
 	PipelineStep step = NULL;
 	void *state = NULL;
-	uint8_t buffer[BUFF_SIZE];
+	const uint8_t *data;
+	uint8_t padding[4];
+	size_t bufsize, slot_size, chunk;
+	int devfd = -1;
 	writeimage callback = args->callback;
 
 	if (!callback) {
 		callback = copy_write;
 	}
 
+	/*
+	 * Fast path: the data of a skipped file is not needed
+	 * and nothing must be computed over it
+	 */
+	if (args->skip_file && !args->inbuf && !IsValidHash(args->hash) &&
+	    !args->checksum) {
+		ret = skip_input(args->fdin, args->nbytes, args->offs);
+		if (ret < 0)
+			return ret;
+		if (_fill_buffer(args->fdin, padding, NPAD_BYTES(*args->offs),
+				 args->offs, NULL, NULL) < 0)
+			DEBUG("Padding bytes are not read, ignoring");
+		return 0;
+	}
+
+	/*
+	 * The output fd is known only when the data is written
+	 * with copy_write(), it is used to adapt the buffer size
+	 * to the device
+	 */
+	if (callback == copy_write && args->out)
+		devfd = *(int *)args->out;
+	bufsize = resolve_io_buffer_size(args->buffer_size, devfd);
+	slot_size = max(bufsize, (size_t)PIPELINE_SLOT_SIZE);
+	chunk = bufsize;
+
 	if (args->checksum)
 		*args->checksum = 0;
 
@@ -761,7 +1351,6 @@ int copyfile(struct swupdate_copy *args)
 				ret = -EFAULT;
 				goto copyfile_exit;
 			}
-			zstd_state.input_view.src = decompress_state.input;
 			decompress_step = &zstd_step;
 			decompress_state.impl_state = &zstd_state;
 		} else
@@ -804,14 +1393,72 @@ int copyfile(struct swupdate_copy *args)
 		}
 	}
 
+	input_state.bufsize = bufsize;
+	decrypt_state.bufsize = bufsize;
+	if (!args->inbuf)
+		input_state.buffer = malloc(bufsize);
+	if (args->encrypted)
+		decrypt_state.output = malloc(bufsize + AES_BLK_SIZE);
+	if ((!args->inbuf && !input_state.buffer) ||
+	    (args->encrypted && !decrypt_state.output)) {
+		ERROR("OOM allocating %zu bytes buffers", bufsize);
+		ret = -ENOMEM;
+		goto copyfile_exit;
+	}
+#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_XZ) || defined(CONFIG_LZ4)
+	if (args->compressed) {
+		decompress_state.bufsize = bufsize;
+		decompress_state.output = malloc(bufsize);
+		if (!decompress_state.output) {
+			ERROR("OOM allocating %zu bytes buffers", bufsize);
+			ret = -ENOMEM;
+			goto copyfile_exit;
+		}
+	}
+#endif
+
 	step = &input_step;
 	state = &input_state;
 
+	if (args->stats)
+		timed_step_wrap(&timed_state[ntimed++], args->stats, STATS_READ,
+				&step, &state);
+
+	if (args->threaded) {
+		if (threaded_step_start(&threaded_state[nthreads], step, state,
+					slot_size, &done) < 0) {
+			ret = -ENOMEM;
+			goto copyfile_exit;
+		}
+		step = &threaded_step;
+		state = &threaded_state[nthreads++];
+		if (args->stats)
+			timed_step_wrap(&timed_state[ntimed++], args->stats, STATS_WAIT,
+					&step, &state);
+	}
+
 	if (args->encrypted) {
 		decrypt_state.upstream_step = step;
 		decrypt_state.upstream_state = state;
 		step = &decrypt_step;
 		state = &decrypt_state;
+
+		if (args->stats)
+			timed_step_wrap(&timed_state[ntimed++], args->stats, STATS_DECRYPT,
+					&step, &state);
+
+		if (args->threaded) {
+			if (threaded_step_start(&threaded_state[nthreads], step, state,
+					slot_size, &done) < 0) {
+				ret = -ENOMEM;
+				goto copyfile_exit;
+			}
+			step = &threaded_step;
+			state = &threaded_state[nthreads++];
+			if (args->stats)
+				timed_step_wrap(&timed_state[ntimed++], args->stats, STATS_WAIT,
+						&step, &state);
+		}
 	}
 
 #if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_XZ) || defined(CONFIG_LZ4)
@@ -820,11 +1467,34 @@ int copyfile(struct swupdate_copy *args)
 		decompress_state.upstream_state = state;
 		step = decompress_step;
 		state = &decompress_state;
+
+		if (args->stats)
+			timed_step_wrap(&timed_state[ntimed++], args->stats, STATS_DECOMPRESS,
+					&step, &state);
+
+		if (args->threaded) {
+			if (threaded_step_start(&threaded_state[nthreads], step, state,
+					slot_size, &done) < 0) {
+				ret = -ENOMEM;
+				goto copyfile_exit;
+			}
+			step = &threaded_step;
+			state = &threaded_state[nthreads++];
+			if (args->stats)
+				timed_step_wrap(&timed_state[ntimed++], args->stats, STATS_WAIT,
+						&step, &state);
+		}
 	}
 #endif
 
+	/*
+	 * When the last step is threaded, hand whole slots to the handler
+	 */
+	if (args->threaded)
+		chunk = slot_size;
+
 	for (;;) {
-		ret = step(state, buffer, sizeof buffer);
+		ret = step(state, &data, chunk);
 		if (ret == -EAGAIN) {
 			continue;
 		}
@@ -844,43 +1514,56 @@ int copyfile(struct swupdate_copy *args)
 		 * results corrupted. This lets the cleanup routine
 		 * to remove it
 		 */
-		if (callback(args->out, buffer, len) < 0) {
+		if (args->stats)
+			stats_begin(&timer);
+		ret = callback(args->out, data, len);
+		if (args->stats)
+			stats_end(&timer, args->stats, STATS_WRITE, len);
+		if (ret < 0) {
 			ret = -ENOSPC;
 			goto copyfile_exit;
 		}
 
-		percent = (unsigned)(100ULL * (args->nbytes - input_state.nbytes) / args->nbytes);
+		percent = (unsigned)(100ULL * *done / args->nbytes);
 		if (percent != prevpercent) {
 			prevpercent = percent;
 			swupdate_progress_update(percent);
 		}
 	}
 
+	/*
+	 * All steps have returned, stop the workers
+	 * before the input state is accessed again
+	 */
+	threaded_steps_stop(threaded_state, nthreads);
+
 	if (IsValidHash(args->hash) && hash_compare(input_state.dgst, args->hash) < 0) {
 		ret = -EFAULT;
 		goto copyfile_exit;
 	}
 
 	if (!args->inbuf) {
-		ret = _fill_buffer(args->fdin, buffer, NPAD_BYTES(*args->offs),
-				   args->offs, args->checksum, NULL);
+		ret = _fill_buffer(args->fdin, padding, NPAD_BYTES(*args->offs),
+				   args->offs, NULL, NULL);
 		if (ret < 0)
 			DEBUG("Padding bytes are not read, ignoring");
 	}
 
-	if (args->checksum != NULL) {
-		*args->checksum = input_state.checksum;
-	}
-
 	ret = 0;
 
 copyfile_exit:
+	threaded_steps_stop(threaded_state, nthreads);
 	if (decrypt_state.dcrypt) {
 		swupdate_DECRYPT_cleanup(decrypt_state.dcrypt);
 	}
 	if (input_state.dgst) {
 		swupdate_HASH_cleanup(input_state.dgst);
 	}
+	free(input_state.buffer);
+	free(decrypt_state.output);
+#if defined(CONFIG_GUNZIP) || defined(CONFIG_ZSTD) || defined(CONFIG_XZ) || defined(CONFIG_LZ4)
+	free(decompress_state.output);
+#endif
 #ifdef CONFIG_GUNZIP
 	if (gunzip_state.initialized) {
 		inflateEnd(&gunzip_state.strm);
@@ -905,6 +1588,10 @@ copyfile_exit:
 	return ret;
 }
 
+/*
+ * The byte checksum is computed for crc cpio entries, or if
+ * it is set to be compared (Lua copyfile()).
+ */
 int copyimage(void *out, struct img_type *img, writeimage callback)
 {
 	struct swupdate_copy copy = {
@@ -916,12 +1603,15 @@ int copyimage(void *out, struct img_type *img, writeimage callback)
 		.seek = img->seek,
 		.skip_file = 0,
 		.compressed = img->compressed,
-		.checksum = &img->checksum,
+		.checksum = (img->cpio_crc || img->checksum) ? &img->checksum : NULL,
 		.hash = img->sha256,
 		.encrypted = img->is_encrypted,
 		.imgivt = img->ivt_ascii,
 		.imgaes = img->aes_ascii,
 		.cipher = img->cipher,
+		.threaded = img->threaded_pipeline,
+		.buffer_size = img->buffer_size,
+		.stats = install_stats_enabled() ? &img->stats : NULL,
 	};
 	return copyfile(&copy);
 }
@@ -7,7 +7,9 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 #include <util.h>
 #include "swupdate_crypto.h"
 
@@ -255,3 +257,62 @@ int swupdate_verify_file(void *dgst, const char *sigfile,
 
 	return lib->verify_file(dgst, sigfile, file, signer_name);
 }
+
+static int write_tmp_file(char *template, const unsigned char *buf, size_t len)
+{
+	int fd = mkstemp(template);
+	int ret;
+
+	if (fd < 0) {
+		ERROR("Cannot create %s", template);
+		return -EBADF;
+	}
+	ret = copy_write(&fd, buf, len);
+	close(fd);
+	if (ret) {
+		unlink(template);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int swupdate_verify_buf(void *dgst, const unsigned char *sig, size_t siglen,
+			const unsigned char *data, size_t len,
+			const char *signer_name)
+{
+	swupdate_dgst_lib *lib;
+	char *sigfile, *file;
+	int ret;
+
+	if (!get_dgstlib())
+		return -EFAULT;
+	lib = (swupdate_dgst_lib *)current[DGSTLIB]->lib;
+
+	if (lib->verify_buf)
+		return lib->verify_buf(dgst, sig, siglen, data, len, signer_name);
+
+	/*
+	 * The library can verify files only
+	 */
+	if (asprintf(&sigfile, "%sverify-sig-XXXXXX", get_tmpdir()) == ENOMEM_ASPRINTF)
+		return -ENOMEM;
+	if (asprintf(&file, "%sverify-data-XXXXXX", get_tmpdir()) == ENOMEM_ASPRINTF) {
+		free(sigfile);
+		return -ENOMEM;
+	}
+
+	ret = write_tmp_file(sigfile, sig, siglen);
+	if (!ret) {
+		ret = write_tmp_file(file, data, len);
+		if (!ret) {
+			ret = lib->verify_file(dgst, sigfile, file, signer_name);
+			unlink(file);
+		}
+		unlink(sigfile);
+	}
+	free(sigfile);
+	free(file);
+
+	return ret;
+}
@@ -10,41 +10,145 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 
 #include "swupdate.h"
 #include "handler.h"
 #include "lua_util.h"
 #include "util.h"
 
-#define MAX_INSTALLER_HANDLER	64
-struct installer_handler supported_types[MAX_INSTALLER_HANDLER];
+/*
+ * Handlers are kept in registration order for the iteration
+ * and in a hash table for the lookup by name. Each handler
+ * is allocated on its own, so a pointer stays valid until the
+ * handler is unregistered.
+ */
+#define HANDLER_HASH_MIN	64
+
+static struct installer_handler **supported_types;
 static unsigned long nr_installers = 0;
+static unsigned long max_installers = 0;
 static unsigned long handler_index = ULONG_MAX;
 
+static struct installer_handler **handler_hash;
+static unsigned long hash_size;
+
+/*
+ * Changed when a handler is unregistered, it invalidates
+ * the handler cached in an image. It starts from 1 because
+ * a zeroed image has no cached handler.
+ */
+static unsigned long handlers_gen = 1;
+
+/* FNV-1a */
+static unsigned long hash_desc(const char *desc)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*desc) {
+		h ^= (unsigned char)*desc++;
+		h *= 16777619UL;
+	}
+
+	return h;
+}
+
+static struct installer_handler **hash_slot(const char *desc)
+{
+	return &handler_hash[hash_desc(desc) & (hash_size - 1)];
+}
+
+static struct installer_handler *lookup_handler(const char *desc)
+{
+	struct installer_handler *hnd;
+
+	if (!hash_size)
+		return NULL;
+
+	for (hnd = *hash_slot(desc); hnd; hnd = hnd->hash_next)
+		if (!strcmp(desc, hnd->desc))
+			return hnd;
+
+	return NULL;
+}
+
+/*
+ * Keep the table at least as large as the number of handlers
+ */
+static int grow_hash(void)
+{
+	struct installer_handler **old = handler_hash;
+	unsigned long old_size = hash_size;
+	struct installer_handler *hnd, *tmp;
+	unsigned long i;
+
+	hash_size = old_size ? old_size * 2 : HANDLER_HASH_MIN;
+	handler_hash = calloc(hash_size, sizeof(*handler_hash));
+	if (!handler_hash) {
+		handler_hash = old;
+		hash_size = old_size;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < old_size; i++) {
+		for (hnd = old[i]; hnd; hnd = tmp) {
+			struct installer_handler **slot = hash_slot(hnd->desc);
+
+			tmp = hnd->hash_next;
+			hnd->hash_next = *slot;
+			*slot = hnd;
+		}
+	}
+	free(old);
+
+	return 0;
+}
+
 static int __register_handler(const char *desc,
-		handler installer, HANDLER_MASK mask, void *data, handler_type_t lifetime)
+		handler installer, HANDLER_MASK mask, void *data, handler_type_t lifetime,
+		bool parallel)
 {
-	int i;
+	struct installer_handler **slot;
+	struct installer_handler *hnd;
 
-	if ((nr_installers > MAX_INSTALLER_HANDLER - 1) || !desc)
+	if (!desc)
 		return -1;
 
 	/*
 	 * Do not register the same handler twice
 	 */
-	for (i = 0; i < nr_installers; i++) {
-		if ((strlen(desc) == strlen(supported_types[i].desc)) &&
-			strcmp(desc, supported_types[i].desc) == 0)
+	if (lookup_handler(desc))
+		return -1;
+
+	if (nr_installers >= hash_size && grow_hash())
+		return -1;
+
+	if (nr_installers == max_installers) {
+		unsigned long n = max_installers ? max_installers * 2 : HANDLER_HASH_MIN;
+		struct installer_handler **tmp;
+
+		tmp = realloc(supported_types, n * sizeof(*supported_types));
+		if (!tmp)
 			return -1;
+		supported_types = tmp;
+		max_installers = n;
 	}
 
-	strlcpy(supported_types[nr_installers].desc, desc,
-		      sizeof(supported_types[nr_installers].desc));
-	supported_types[nr_installers].installer = installer;
-	supported_types[nr_installers].data = data;
-	supported_types[nr_installers].mask = mask;
-	supported_types[nr_installers].noglobal = (lifetime == SESSION_HANDLER);
-	nr_installers++;
+	hnd = calloc(1, sizeof(*hnd));
+	if (!hnd)
+		return -1;
+
+	strlcpy(hnd->desc, desc, sizeof(hnd->desc));
+	hnd->installer = installer;
+	hnd->data = data;
+	hnd->mask = mask;
+	hnd->noglobal = (lifetime == SESSION_HANDLER);
+	hnd->parallel = parallel;
+
+	slot = hash_slot(hnd->desc);
+	hnd->hash_next = *slot;
+	*slot = hnd;
+	supported_types[nr_installers++] = hnd;
 
 	return 0;
 }
@@ -52,50 +156,72 @@ static int __register_handler(const char *desc,
 int register_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data)
 {
-	return __register_handler(desc, installer, mask, data, GLOBAL_HANDLER);
+	return __register_handler(desc, installer, mask, data, GLOBAL_HANDLER, false);
 }
 
 int register_session_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data)
 {
-	return __register_handler(desc, installer, mask, data, SESSION_HANDLER);
+	return __register_handler(desc, installer, mask, data, SESSION_HANDLER, false);
 }
 
-int unregister_handler(const char *desc)
+/*
+ * A parallel handler does not use any global state and
+ * can install several images at the same time if they
+ * are on different devices
+ */
+int register_parallel_handler(const char *desc,
+		handler installer, HANDLER_MASK mask, void *data)
 {
-	int i;
+	return __register_handler(desc, installer, mask, data, GLOBAL_HANDLER, true);
+}
 
-	for (i = 0; i < nr_installers; i++) {
-		if ((strlen(desc) == strlen(supported_types[i].desc)) &&
-			IS_STR_EQUAL(desc, supported_types[i].desc)) {
+static void unhash_handler(struct installer_handler *hnd)
+{
+	struct installer_handler **slot;
+
+	for (slot = hash_slot(hnd->desc); *slot; slot = &(*slot)->hash_next) {
+		if (*slot == hnd) {
+			*slot = hnd->hash_next;
 			break;
 		}
 	}
+	handlers_gen++;
+	free(hnd);
+}
+
+int unregister_handler(const char *desc)
+{
+	struct installer_handler *hnd;
+	unsigned long i;
+
+	hnd = desc ? lookup_handler(desc) : NULL;
 
 	/* Not found */
-	if (i == nr_installers)
+	if (!hnd)
 		return -1;
-	for (int j = i + 1; j < nr_installers; j++) {
-		strlcpy(supported_types[j - 1].desc, supported_types[j].desc,
-		      sizeof(supported_types[j -1].desc));
-		supported_types[j - 1].installer = supported_types[j].installer;
-		supported_types[j - 1].data = supported_types[j].data;
-		supported_types[j - 1].mask = supported_types[j].mask;
-	}
+
+	for (i = 0; supported_types[i] != hnd; i++)
+		;
+	memmove(&supported_types[i], &supported_types[i + 1],
+		(nr_installers - i - 1) * sizeof(*supported_types));
 	nr_installers--;
+	unhash_handler(hnd);
 
 	return 0;
 }
 
 void unregister_session_handlers(void)
 {
-	int i;
+	unsigned long i, n = 0;
 
-	for (i = nr_installers - 1; i >= 0; i--) {
-		if (supported_types[i].noglobal) {
-			unregister_handler(supported_types[i].desc);
-		}
+	for (i = 0; i < nr_installers; i++) {
+		if (supported_types[i]->noglobal)
+			unhash_handler(supported_types[i]);
+		else
+			supported_types[n++] = supported_types[i];
 	}
+	nr_installers = n;
 }
 
 void print_registered_handlers(bool global)
@@ -111,9 +237,9 @@ void print_registered_handlers(bool global)
 	bool noglobal = !global;
 	INFO("Registered %s handlers:", global ? "global" : "session");
 	for (i = 0; i < nr_installers; i++) {
-		if (noglobal == supported_types[i].noglobal) {
+		if (noglobal == supported_types[i]->noglobal) {
 			count++;
-			INFO("\t%s", supported_types[i].desc);
+			INFO("\t%s", supported_types[i]->desc);
 		}
 	}
 	if (count == 0) {
@@ -121,19 +247,22 @@ void print_registered_handlers(bool global)
 	}
 }
 
+/*
+ * The handler is cached in the image, it is looked
+ * up again if the type or the registered handlers change
+ */
 struct installer_handler *find_handler(struct img_type *img)
 {
-	unsigned int i;
+	struct installer_handler *hnd = img->hnd;
 
-	for (i = 0; i < nr_installers; i++) {
-		if ((strlen(img->type) == strlen(supported_types[i].desc)) &&
-			strcmp(img->type,
-				supported_types[i].desc) == 0)
-			break;
-	}
-	if (i >= nr_installers)
-		return NULL;
-	return &supported_types[i];
+	if (hnd && img->hnd_gen == handlers_gen && !strcmp(img->type, hnd->desc))
+		return hnd;
+
+	hnd = lookup_handler(img->type);
+	img->hnd = hnd;
+	img->hnd_gen = handlers_gen;
+
+	return hnd;
 }
 
 struct installer_handler *get_next_handler(void)
@@ -145,7 +274,7 @@ struct installer_handler *get_next_handler(void)
 		handler_index = ULONG_MAX;
 		return NULL;
 	}
-	return &supported_types[handler_index++];
+	return supported_types[handler_index++];
 }
 
 unsigned int get_handler_mask(struct img_type *img)
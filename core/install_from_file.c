@@ -92,8 +92,18 @@ int install_from_file(const char *filename, bool check)
 	pthread_mutex_init(&install_file_mutex, NULL);
 	pthread_mutex_lock(&install_file_mutex);
 	while (timeout_cnt > 0) {
-		rc = swupdate_async_start(readimage, NULL,
-					  endupdate, &req, sizeof(req));
+		/*
+		 * Pass the file itself, SWUpdate reads it without copying
+		 * it through the socket. Older versions reject the request,
+		 * then the file is streamed.
+		 */
+		rc = -EINVAL;
+		if (filename)
+			rc = swupdate_async_start_fd(fd, NULL,
+						     endupdate, &req, sizeof(req));
+		if (rc < 0)
+			rc = swupdate_async_start(readimage, NULL,
+						  endupdate, &req, sizeof(req));
 		if (rc >= 0)
 			break;
 		timeout_cnt--;
@@ -0,0 +1,219 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "swupdate.h"
+#include "util.h"
+#include "progress.h"
+#include "install_stats.h"
+
+static const char *stage_names[STATS_STAGES] = {
+	[STATS_READ] = "read",
+	[STATS_HASH] = "hash",
+	[STATS_DECRYPT] = "decrypt",
+	[STATS_DECOMPRESS] = "decompress",
+	[STATS_WAIT] = "wait",
+	[STATS_WRITE] = "write",
+	[STATS_INSTALL] = "install",
+};
+
+static bool stats_enabled;
+
+/*
+ * Stages of the same image are accounted by the pipeline workers
+ * and by the caller, images can be installed in parallel
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Statistics of the last install, kept for the IPC
+ */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **report;
+static unsigned int report_count;
+
+/*
+ * Time spent in nested timers of the running thread,
+ * it is subtracted from the enclosing timer
+ */
+static __thread uint64_t nested_wall_ns;
+static __thread uint64_t nested_cpu_ns;
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(id, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_begin(struct stats_timer *t)
+{
+	t->nested_wall_ns = nested_wall_ns;
+	t->nested_cpu_ns = nested_cpu_ns;
+	nested_wall_ns = 0;
+	nested_cpu_ns = 0;
+	t->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	t->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stats_end(struct stats_timer *t, struct install_stats *stats,
+	       stats_stage_t stage, uint64_t bytes)
+{
+	uint64_t wall = clock_ns(CLOCK_MONOTONIC) - t->wall_ns;
+	uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - t->cpu_ns;
+	uint64_t own_wall = wall, own_cpu = cpu;
+	struct stage_stats *s = &stats->stage[stage];
+
+	/* STATS_INSTALL includes the nested stages */
+	if (stage != STATS_INSTALL) {
+		own_wall = wall > nested_wall_ns ? wall - nested_wall_ns : 0;
+		own_cpu = cpu > nested_cpu_ns ? cpu - nested_cpu_ns : 0;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	s->wall_ns += own_wall;
+	s->cpu_ns += own_cpu;
+	s->bytes += bytes;
+	stats->valid = true;
+	pthread_mutex_unlock(&stats_lock);
+
+	nested_wall_ns = t->nested_wall_ns + wall;
+	nested_cpu_ns = t->nested_cpu_ns + cpu;
+}
+
+void install_stats_enable(bool enable)
+{
+	stats_enabled = enable;
+}
+
+bool install_stats_enabled(void)
+{
+	return stats_enabled;
+}
+
+static int stats_to_json(struct img_type *img, char *buf, size_t len)
+{
+	struct install_stats *stats = &img->stats;
+	const struct stage_stats *s;
+	char fname[MAX_IMAGE_FNAME * 2];
+	char type[SWUPDATE_GENERAL_STRING_SIZE * 2];
+	size_t n;
+
+	if (snescape(fname, sizeof(fname), img->fname) >= sizeof(fname) ||
+	    snescape(type, sizeof(type), img->type) >= sizeof(type))
+		return -ENOSPC;
+
+	n = snprintf(buf, len, "{\"image\": \"%s\", \"type\": \"%s\"",
+		     fname, type);
+	for (unsigned int i = 0; i < STATS_STAGES && n < len; i++) {
+		s = &stats->stage[i];
+		if (!s->bytes && !s->wall_ns)
+			continue;
+		n += snprintf(buf + n, len - n,
+			      ", \"%s\": {\"bytes\": %llu, \"wall_us\": %llu, \"cpu_us\": %llu}",
+			      stage_names[i],
+			      (unsigned long long)s->bytes,
+			      (unsigned long long)(s->wall_ns / 1000),
+			      (unsigned long long)(s->cpu_ns / 1000));
+	}
+	if (n < len)
+		n += snprintf(buf + n, len - n, "}");
+
+	return n < len ? 0 : -ENOSPC;
+}
+
+static void stats_log(struct img_type *img)
+{
+	const struct stage_stats *s = img->stats.stage;
+	uint64_t wall_ms = s[STATS_INSTALL].wall_ns / 1000000;
+
+	INFO("%s: %llu bytes in %llu ms (%llu KiB/s)", img->fname,
+	     (unsigned long long)s[STATS_WRITE].bytes,
+	     (unsigned long long)wall_ms,
+	     wall_ms ? (unsigned long long)(s[STATS_WRITE].bytes / wall_ms * 1000 / 1024) : 0ULL);
+	for (unsigned int i = 0; i < STATS_INSTALL; i++) {
+		if (!s[i].bytes && !s[i].wall_ns)
+			continue;
+		INFO("\t%-10s %12llu bytes %8llu ms wall %8llu ms cpu", stage_names[i],
+		     (unsigned long long)s[i].bytes,
+		     (unsigned long long)(s[i].wall_ns / 1000000),
+		     (unsigned long long)(s[i].cpu_ns / 1000000));
+	}
+}
+
+/*
+ * Summary at the end of an install: it is logged, sent as
+ * info to the progress interface and kept for the IPC.
+ */
+void install_stats_report(struct imglist *list)
+{
+	char buf[PRINFOSIZE - 32];
+	struct img_type *img;
+	unsigned int count = 0;
+	char **entries;
+
+	if (!stats_enabled)
+		return;
+
+	LIST_FOREACH(img, list, next)
+		if (img->stats.valid)
+			count++;
+
+	entries = count ? calloc(count, sizeof(*entries)) : NULL;
+
+	count = 0;
+	LIST_FOREACH(img, list, next) {
+		if (!img->stats.valid)
+			continue;
+		stats_log(img);
+		if (stats_to_json(img, buf, sizeof(buf)) < 0) {
+			WARN("Statistics for %s truncated", img->fname);
+			continue;
+		}
+		swupdate_progress_info(RUN, CAUSE_INSTALL_STATS, buf);
+		if (entries) {
+			entries[count] = strdup(buf);
+			if (entries[count])
+				count++;
+		}
+	}
+
+	pthread_mutex_lock(&report_lock);
+	for (unsigned int i = 0; i < report_count; i++)
+		free(report[i]);
+	free(report);
+	report = entries;
+	report_count = count;
+	pthread_mutex_unlock(&report_lock);
+}
+
+/*
+ * Copy the statistics of the index-th image of the last
+ * install into buf and return the number of images,
+ * -1 if index is out of range
+ */
+int install_stats_get(unsigned int index, char *buf, size_t len)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&report_lock);
+	if (index < report_count) {
+		strlcpy(buf, report[index], len);
+		ret = report_count;
+	}
+	pthread_mutex_unlock(&report_lock);
+
+	return ret;
+}
@@ -19,6 +19,11 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+#include <limits.h>
+#include <pthread.h>
 
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
@@ -34,6 +39,8 @@
 #include "pctl.h"
 #include "swupdate_vars.h"
 #include "lua_util.h"
+#include "install_stats.h"
+#include "strpool.h"
 
 /*
  * function returns:
@@ -53,11 +60,13 @@ swupdate_file_t check_if_required(struct imglist *list, struct filehdr *pfdh,
 	 * Check that not more than one image want to be streamed
 	 */
 	int install_direct = 0;
+	char extract_file[MAX_IMAGE_FNAME];
 
 	LIST_FOREACH(img, list, next) {
 		if (strcmp(pfdh->filename, img->fname) == 0) {
 			skip = COPY_FILE;
 			img->provided = 1;
+			img->cpio_crc = CPIO_HAS_CHECKSUM(pfdh);
 			if (img->size && img->size != (unsigned int)pfdh->size) {
 				ERROR("Size in sw-description %llu does not match size in cpio %u",
 					img->size, (unsigned int)pfdh->size);
@@ -66,12 +75,14 @@ swupdate_file_t check_if_required(struct imglist *list, struct filehdr *pfdh,
 			}
 			img->size = (unsigned int)pfdh->size;
 
-			if (snprintf(img->extract_file,
-				     sizeof(img->extract_file), "%s%s",
-				     destdir, pfdh->filename) >= (int)sizeof(img->extract_file)) {
+			if (snprintf(extract_file,
+				     sizeof(extract_file), "%s%s",
+				     destdir, pfdh->filename) >= (int)sizeof(extract_file)) {
 				ERROR("Path too long: %s%s", destdir, pfdh->filename);
 				return -EBADF;
 			}
+			if (img_set_string(&img->extract_file, extract_file))
+				return -ENOMEM;
 			/*
 			 *  Streaming is possible to only one handler
 			 *  If more img requires the same file,
@@ -105,12 +116,12 @@ static int extract_scripts(struct imglist *head)
 	int fdout;
 	int ret = 0;
 	const char* tmpdir_scripts = get_tmpdirscripts();
+	char extract_file[MAX_IMAGE_FNAME];
 
 	LIST_FOREACH(script, head, next) {
 		int fdin;
 		char *tmpfile;
 		unsigned long offset = 0;
-		uint32_t checksum;
 
 		if (!script->fname[0] && (script->provided == 0)) {
 			TRACE("No script provided for script of type %s",
@@ -123,8 +134,10 @@ static int extract_scripts(struct imglist *head)
 			return -1;
 		}
 
-		snprintf(script->extract_file, sizeof(script->extract_file), "%s%s",
+		snprintf(extract_file, sizeof(extract_file), "%s%s",
 			 tmpdir_scripts , script->fname);
+		if (img_set_string(&script->extract_file, extract_file))
+			return -ENOMEM;
 
 		fdout = openfileoutput(script->extract_file);
 		if (fdout < 0)
@@ -153,7 +166,6 @@ static int extract_scripts(struct imglist *head)
 			.nbytes = script->size,
 			.offs = &offset,
 			.compressed = script->compressed,
-			.checksum = &checksum,
 			.hash = script->sha256,
 			.encrypted = script->is_encrypted,
 			.imgivt = script->ivt_ascii,
@@ -280,6 +292,7 @@ int run_prepost_scripts(struct imglist *list, script_fn type)
 int install_single_image(struct img_type *img, bool dry_run)
 {
 	struct installer_handler *hnd;
+	struct stats_timer timer;
 	int ret;
 
 	/*
@@ -301,7 +314,7 @@ int install_single_image(struct img_type *img, bool dry_run)
 	/*
 	 * Run a preinstall Lua function, if any
 	 */
-	if (strlen(img->lua_fcn_pre)) {
+	if (img->lua_fcn_pre) {
 		ret = lua_parser_fn(img->L, img->lua_fcn_pre, img);
 		if (ret) {
 			TRACE("Pre-install function %s for %s fails !",
@@ -311,12 +324,16 @@ int install_single_image(struct img_type *img, bool dry_run)
 	}
 
 	/* TODO : check callback to push results / progress */
+	if (install_stats_enabled())
+		stats_begin(&timer);
 	ret = hnd->installer(img, hnd->data);
+	if (install_stats_enabled())
+		stats_end(&timer, &img->stats, STATS_INSTALL, img->size);
 	if (ret != 0) {
 		TRACE("Installer for %s not successful !",
 			hnd->desc);
 	} else {
-		if (strlen(img->lua_fcn_post)) {
+		if (img->lua_fcn_post) {
 			ret = lua_parser_fn(img->L, img->lua_fcn_post, img);
 			if (ret) {
 				TRACE("Post-install function %s for %s fails !",
@@ -369,6 +386,219 @@ int update_installed_image_version(struct swver *sw_ver_list,
 	return true;
 }
 
+/*
+ * Parallel installation
+ *
+ * Images whose handler is registered as parallel are installed by
+ * worker threads, up to "install-workers" at the same time. All other
+ * images act as a barrier: they are installed by the caller after all
+ * running jobs have completed. Two images are never installed at the
+ * same time if they share the physical device or if one of them is
+ * named in the "install-after" attribute of the other one.
+ */
+struct install_scheduler;
+
+struct install_job {
+	struct install_scheduler *sched;
+	struct img_type *img;
+	char disk[PATH_MAX];	/* physical device, empty if unknown */
+	pthread_t thread;
+	bool started;
+	bool completed;
+	int ret;
+};
+
+struct install_scheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct install_job *jobs;
+	unsigned int njobs;
+	unsigned int running;
+	unsigned int max_workers;
+	bool failed;		/* a job failed, no new job is started */
+};
+
+/*
+ * Partitions are mapped to their disk, so that images
+ * on the same storage are serialized
+ */
+static void get_image_disk(struct img_type *img, char *disk, size_t len)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	char *real, *p;
+
+	disk[0] = '\0';
+	if (img->volname || !strlen(img->device))
+		return;
+
+	if (stat(img->device, &st) || !S_ISBLK(st.st_mode)) {
+		strlcpy(disk, img->device, len);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+	real = realpath(path, NULL);
+	if (!real) {
+		strlcpy(disk, path, len);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/partition", real);
+	if (!access(path, F_OK)) {
+		p = strrchr(real, '/');
+		if (p)
+			*p = '\0';
+	}
+	strlcpy(disk, real, len);
+	free(real);
+}
+
+static bool can_install_parallel(struct install_scheduler *sched,
+				 struct img_type *img, bool dry_run)
+{
+	struct installer_handler *hnd;
+
+	if (sched->max_workers < 2 || dry_run)
+		return false;
+
+	if (img->install_sequential || img->is_script || img->is_partitioner)
+		return false;
+
+	/* The Lua state is shared and cannot run concurrently */
+	if (img->lua_fcn_pre || img->lua_fcn_post)
+		return false;
+
+	hnd = find_handler(img);
+
+	return hnd && hnd->parallel;
+}
+
+/*
+ * Must be called with the scheduler lock held
+ */
+static bool install_job_blocked(struct install_scheduler *sched, unsigned int index)
+{
+	struct install_job *job = &sched->jobs[index];
+
+	for (unsigned int i = 0; i < index; i++) {
+		struct install_job *prev = &sched->jobs[i];
+
+		if (!prev->started || prev->completed)
+			continue;
+		if (!strlen(job->disk) || !strlen(prev->disk) ||
+		    !strcmp(job->disk, prev->disk))
+			return true;
+		if (job->img->install_after &&
+		    (!strcmp(job->img->install_after, prev->img->id.name) ||
+		     !strcmp(job->img->install_after, prev->img->fname)))
+			return true;
+	}
+
+	return false;
+}
+
+static void *install_worker(void *data)
+{
+	struct install_job *job = (struct install_job *)data;
+	struct install_scheduler *sched = job->sched;
+	int ret;
+
+	ret = install_single_image(job->img, false);
+
+	pthread_mutex_lock(&sched->lock);
+	job->ret = ret;
+	job->completed = true;
+	if (ret)
+		sched->failed = true;
+	sched->running--;
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->lock);
+
+	return NULL;
+}
+
+/*
+ * Collect the results of the completed jobs, if wait is set
+ * all running jobs are waited for
+ */
+static int install_reap_jobs(struct install_scheduler *sched,
+			     struct swupdate_cfg *sw, bool wait)
+{
+	struct install_job *job;
+	bool completed;
+	int ret = 0;
+
+	if (wait) {
+		pthread_mutex_lock(&sched->lock);
+		while (sched->running)
+			pthread_cond_wait(&sched->cond, &sched->lock);
+		pthread_mutex_unlock(&sched->lock);
+	}
+
+	for (unsigned int i = 0; i < sched->njobs; i++) {
+		job = &sched->jobs[i];
+		if (!job->started)
+			continue;
+		pthread_mutex_lock(&sched->lock);
+		completed = job->completed;
+		pthread_mutex_unlock(&sched->lock);
+		if (!completed)
+			continue;
+
+		pthread_join(job->thread, NULL);
+		job->started = false;
+		close(job->img->fdin);
+		update_installed_image_version(&sw->installed_sw_list, job->img);
+		if (job->ret && !ret)
+			ret = job->ret;
+	}
+
+	return ret;
+}
+
+static int install_start_job(struct install_scheduler *sched,
+			     struct swupdate_cfg *sw, unsigned int index)
+{
+	struct install_job *job = &sched->jobs[index];
+	int ret;
+
+	get_image_disk(job->img, job->disk, sizeof(job->disk));
+
+	pthread_mutex_lock(&sched->lock);
+	while (!sched->failed &&
+	       (sched->running >= sched->max_workers ||
+		install_job_blocked(sched, index)))
+		pthread_cond_wait(&sched->cond, &sched->lock);
+	pthread_mutex_unlock(&sched->lock);
+
+	/* The failed job is reaped here and its error returned */
+	ret = install_reap_jobs(sched, sw, false);
+	if (ret)
+		return ret;
+
+	TRACE("Installing %s in parallel (%s)", job->img->fname,
+	      strlen(job->disk) ? job->disk : "unknown device");
+
+	job->sched = sched;
+	pthread_mutex_lock(&sched->lock);
+	job->started = true;
+	sched->running++;
+	pthread_mutex_unlock(&sched->lock);
+
+	ret = pthread_create(&job->thread, NULL, install_worker, job);
+	if (ret) {
+		ERROR("Code from pthread_create() is %d", ret);
+		pthread_mutex_lock(&sched->lock);
+		job->started = false;
+		sched->running--;
+		pthread_mutex_unlock(&sched->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * streamfd: file descriptor if it is required to extract
  *           images from the stream (update from file)
@@ -384,6 +614,17 @@ int install_images(struct swupdate_cfg *sw)
 	const char* TMPDIR = get_tmpdir();
 	bool dry_run = sw->parms.dry_run;
 	bool dropimg;
+	struct install_scheduler sched = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.jobs = NULL,
+		.njobs = 0,
+		.running = 0,
+		.max_workers = sw->install_workers > 0 ? sw->install_workers : 1,
+		.failed = false,
+	};
+	unsigned int njobs = 0;
+	int reaped;
 
 	/* Extract all scripts, preinstall scripts must be run now */
 	const char* tmpdir_scripts = get_tmpdirscripts();
@@ -402,6 +643,16 @@ int install_images(struct swupdate_cfg *sw)
 		}
 	}
 
+	LIST_FOREACH(img, &sw->images, next)
+		sched.njobs++;
+	if (sched.njobs) {
+		sched.jobs = calloc(sched.njobs, sizeof(*sched.jobs));
+		if (!sched.jobs) {
+			ERROR("OOM allocating install jobs");
+			return -ENOMEM;
+		}
+	}
+
 	LIST_FOREACH_SAFE(img, &sw->images, next, tmp) {
 
 		dropimg = false;
@@ -416,17 +667,27 @@ int install_images(struct swupdate_cfg *sw)
 		if (img->install_directly)
 			continue;
 
+		/*
+		 * Stop as soon as a job has failed, the running
+		 * ones are waited for before returning
+		 */
+		ret = install_reap_jobs(&sched, sw, false);
+		if (ret)
+			break;
+
 		if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
 				ENOMEM_ASPRINTF) {
 				ERROR("Path too long: %s%s", TMPDIR, img->fname);
-				return -1;
+				ret = -1;
+				break;
 		}
 
 		ret = stat(filename, &buf);
 		if (ret) {
 			TRACE("%s not found or wrong", filename);
 			free(filename);
-			return -1;
+			ret = -1;
+			break;
 		}
 		img->size = buf.st_size;
 		img->fdin = open(filename, O_RDONLY);
@@ -434,11 +695,12 @@ int install_images(struct swupdate_cfg *sw)
 		if (img->fdin < 0) {
 			ERROR("Image %s cannot be opened",
 			img->fname);
-			return -1;
+			ret = -1;
+			break;
 		}
 
 		if ((strlen(img->path) > 0) &&
-			(strlen(img->extract_file) > 0) &&
+			img->extract_file &&
 			(strncmp(img->path, img->extract_file, sizeof(img->path)) == 0)){
 			struct img_type *tmpimg;
 			WARN("Temporary and final location for %s is identical, skip "
@@ -453,7 +715,24 @@ int install_images(struct swupdate_cfg *sw)
 			}
 			dropimg = true;
 			ret = 0;
+		} else if (can_install_parallel(&sched, img, dry_run)) {
+			/*
+			 * The job closes the image and updates
+			 * the version when it is reaped
+			 */
+			sched.jobs[njobs].img = img;
+			ret = install_start_job(&sched, sw, njobs++);
+			if (!ret)
+				continue;
+			close(img->fdin);
+			break;
 		} else {
+			/* Any other image waits for the running jobs */
+			ret = install_reap_jobs(&sched, sw, true);
+			if (ret) {
+				close(img->fdin);
+				break;
+			}
 			ret = install_single_image(img, dry_run);
 		}
 
@@ -465,9 +744,16 @@ int install_images(struct swupdate_cfg *sw)
 			free_image(img);
 
 		if (ret)
-			return ret;
+			break;
 	}
 
+	reaped = install_reap_jobs(&sched, sw, true);
+	free(sched.jobs);
+	if (!ret)
+		ret = reaped;
+	if (ret)
+		return ret;
+
 	/*
 	 * Skip scripts in dry-run mode
 	 */
@@ -541,6 +827,25 @@ void free_image(struct img_type *img) {
 	free(img);
 }
 
+/*
+ * The string is interned, it is not freed with the
+ * image but together with all others by cleanup_files()
+ */
+int img_set_string(const char **field, const char *value)
+{
+	if (!value || !*value) {
+		*field = NULL;
+		return 0;
+	}
+
+	value = strpool_intern(value);
+	if (!value)
+		return -ENOMEM;
+	*field = value;
+
+	return 0;
+}
+
 void cleanup_files(struct swupdate_cfg *software) {
 	char *fn;
 	struct img_type *img;
@@ -610,6 +915,9 @@ void cleanup_files(struct swupdate_cfg *software) {
 		free(fn);
 	}
 #endif
+
+	/* strings of all images */
+	strpool_release();
 }
 
 int preupdatecmd(struct swupdate_cfg *swcfg)
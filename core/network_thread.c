@@ -17,6 +17,8 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -35,6 +37,7 @@
 #include "generated/autoconf.h"
 #include "state.h"
 #include "swupdate_vars.h"
+#include "install_stats.h"
 
 #define NUM_CACHED_MESSAGES 100
 #define DEFAULT_INTERNAL_TIMEOUT 60
@@ -53,18 +56,64 @@ static unsigned long nrmsgs = 0;
 
 static pthread_mutex_t msglock = PTHREAD_MUTEX_INITIALIZER;
 
-struct subprocess_msg_elem {
+struct ctrl_msg_elem {
 	ipc_message message;
 	int client;
-	SIMPLEQ_ENTRY(subprocess_msg_elem) next;
+	bool compact;		/* answer with the compact framing */
+	SIMPLEQ_ENTRY(ctrl_msg_elem) next;
 };
 
-SIMPLEQ_HEAD(subprocess_msglist, subprocess_msg_elem);
-static struct subprocess_msglist subprocess_messages;
+SIMPLEQ_HEAD(ctrl_msglist, ctrl_msg_elem);
 
-static pthread_t subprocess_ipc_handler_thread_id;
-static pthread_mutex_t subprocess_msg_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t subprocess_wkup = PTHREAD_COND_INITIALIZER;
+/*
+ * Requests that can take long are queued to a worker
+ * thread, the worker sends the answer and closes the
+ * connection. The control thread stays free to answer
+ * other clients.
+ */
+struct ctrl_worker {
+	struct ctrl_msglist messages;
+	pthread_mutex_t lock;
+	pthread_cond_t wkup;
+	void (*handle)(ipc_message *msg);
+};
+
+static void handle_subprocess_ipc(ipc_message *msg);
+static void handle_slow_request(ipc_message *msg);
+
+static struct ctrl_worker subprocess_worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wkup = PTHREAD_COND_INITIALIZER,
+	.handle = handle_subprocess_ipc
+};
+
+static struct ctrl_worker slow_worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wkup = PTHREAD_COND_INITIALIZER,
+	.handle = handle_slow_request
+};
+
+/*
+ * Clients of the control socket whose request
+ * is not yet completely received
+ */
+#define CTRL_MAX_CLIENTS	64
+
+struct ctrl_client {
+	int fd;
+	int passedfd;
+	size_t len;
+	size_t need;		/* size of the request, 0 until the header is read */
+	bool compact;
+	time_t start;		/* CLOCK_MONOTONIC seconds */
+	union {
+		ipc_message msg;
+		char raw[sizeof(ipc_header) + sizeof(msgdata)];
+	} req;
+	LIST_ENTRY(ctrl_client) next;
+};
+
+LIST_HEAD(ctrl_clients, ctrl_client);
 
 struct notify_conn {
 	SIMPLEQ_ENTRY(notify_conn) next;
@@ -254,17 +303,15 @@ static void empty_pipe(int fd)
 	} while (1);
 }
 
-static void send_subprocess_reply(
-		const struct subprocess_msg_elem *const subprocess_msg)
+static void send_worker_reply(const struct ctrl_msg_elem *const ctrl_msg)
 {
-	if (write(subprocess_msg->client, &subprocess_msg->message,
-			sizeof(subprocess_msg->message)) < 0)
+	if (ipc_message_send(ctrl_msg->client, &ctrl_msg->message,
+			     ctrl_msg->compact) < 0)
 		ERROR("Error writing on ctrl socket: %s", strerror(errno));
 }
 
-static void handle_subprocess_ipc(struct subprocess_msg_elem *subprocess_msg)
+static void handle_subprocess_ipc(ipc_message *msg)
 {
-	ipc_message *msg = &subprocess_msg->message;
 	int pipe = pctl_getfd_from_type(msg->data.procmsg.source);
 	if (pipe < 0) {
 		ERROR("Cannot find channel for requested process");
@@ -332,338 +379,671 @@ static void handle_subprocess_ipc(struct subprocess_msg_elem *subprocess_msg)
 	}
 }
 
-static void *subprocess_thread (void *data)
+/*
+ * Set while the post-update commands run, no install
+ * is accepted in the meantime. Protected by stream_mutex.
+ */
+static bool postupdate_running;
+
+/*
+ * Commands that can block for a while (scripts,
+ * bootloader environment) are run by a worker
+ */
+static void handle_slow_request(ipc_message *msg)
+{
+	update_state_t value;
+	char *varvalue;
+
+	switch (msg->type) {
+	case POST_UPDATE:
+		pthread_mutex_lock(&stream_mutex);
+		postupdate_running = true;
+		pthread_mutex_unlock(&stream_mutex);
+		if (postupdate(get_swupdate_cfg(),
+					   msg->data.procmsg.len > 0 ? msg->data.procmsg.buf : NULL) == 0) {
+			msg->type = ACK;
+			sprintf(msg->data.msg, "Post-update actions successfully executed.");
+		} else {
+			msg->type = NACK;
+			sprintf(msg->data.msg, "Post-update actions failed.");
+		}
+		pthread_mutex_lock(&stream_mutex);
+		postupdate_running = false;
+		pthread_mutex_unlock(&stream_mutex);
+		break;
+	case SET_UPDATE_STATE:
+		value = *(update_state_t *)msg->data.msg;
+		msg->type = (is_valid_state(value) &&
+			    save_state(value) == SERVER_OK)
+			       ? ACK
+			       : NACK;
+		break;
+	case GET_UPDATE_STATE:
+		msg->data.msg[0] = get_state();
+		msg->type = ACK;
+		break;
+	case SET_SWUPDATE_VARS:
+		msg->type = swupdate_vars_set(msg->data.vars.varname,
+				  strlen(msg->data.vars.varvalue) ? msg->data.vars.varvalue : NULL,
+				  msg->data.vars.varnamespace) == 0 ? ACK : NACK;
+		break;
+	case GET_SWUPDATE_VARS:
+		varvalue = swupdate_vars_get(msg->data.vars.varname,
+				  msg->data.vars.varnamespace);
+		memset(msg->data.vars.varvalue, 0, sizeof(msg->data.vars.varvalue));
+		if (varvalue) {
+			strlcpy(msg->data.vars.varvalue, varvalue, sizeof(msg->data.vars.varvalue));
+			free(varvalue);
+			msg->type = ACK;
+		} else
+			msg->type = NACK;
+		break;
+	default:
+		msg->type = NACK;
+	}
+}
+
+static void *ctrl_worker_thread (void *data)
 {
-	(void)data;
+	struct ctrl_worker *worker = (struct ctrl_worker *)data;
+
 	thread_ready();
 
-	pthread_mutex_lock(&subprocess_msg_lock);
+	pthread_mutex_lock(&worker->lock);
 
 	while(1) {
-		while(!SIMPLEQ_EMPTY(&subprocess_messages)) {
-			struct subprocess_msg_elem *subprocess_msg;
-			subprocess_msg = SIMPLEQ_FIRST(&subprocess_messages);
-			SIMPLEQ_REMOVE_HEAD(&subprocess_messages, next);
+		while(!SIMPLEQ_EMPTY(&worker->messages)) {
+			struct ctrl_msg_elem *ctrl_msg;
+			ctrl_msg = SIMPLEQ_FIRST(&worker->messages);
+			SIMPLEQ_REMOVE_HEAD(&worker->messages, next);
 
-			pthread_mutex_unlock(&subprocess_msg_lock);
+			pthread_mutex_unlock(&worker->lock);
 
-			handle_subprocess_ipc(subprocess_msg);
-			send_subprocess_reply(subprocess_msg);
-			close(subprocess_msg->client);
+			worker->handle(&ctrl_msg->message);
+			send_worker_reply(ctrl_msg);
+			close(ctrl_msg->client);
 
-			free(subprocess_msg);
-			pthread_mutex_lock(&subprocess_msg_lock);
+			free(ctrl_msg);
+			pthread_mutex_lock(&worker->lock);
 		}
 
-		pthread_cond_wait(&subprocess_wkup, &subprocess_msg_lock);
+		pthread_cond_wait(&worker->wkup, &worker->lock);
 	}
 
 	return NULL;
 }
 
-void *network_thread (void *data)
+/*
+ * Pass the request to a worker, that owns the
+ * connection from now on
+ */
+static int queue_to_worker(struct ctrl_worker *worker, int client,
+			   ipc_message *msg, bool compact)
 {
-	struct installer *instp = (struct installer *)data;
-	int ctrllisten, ctrlconnfd;
-	socklen_t clilen;
-	struct sockaddr_un cliaddr;
-	ipc_message msg;
-	int nread;
-	struct msg_elem *notification, *tmp;
-	struct notify_conn *conn;
-	int ret;
-	update_state_t value;
-	struct subprocess_msg_elem *subprocess_msg;
-	bool should_close_socket;
-	struct swupdate_cfg *cfg;
-	char *varvalue;
+	struct ctrl_msg_elem *ctrl_msg;
 
-	if (!instp) {
-		TRACE("Fatal error: Network thread aborting...");
-		return (void *)0;
+	ctrl_msg = (struct ctrl_msg_elem *)malloc(sizeof(*ctrl_msg));
+	if (ctrl_msg == NULL) {
+		ERROR("Cannot handle IPC request because of OOM.");
+		return -ENOMEM;
 	}
 
-	SIMPLEQ_INIT(&notifymsgs);
-	SIMPLEQ_INIT(&notify_conns);
-	SIMPLEQ_INIT(&subprocess_messages);
-	register_notifier(network_notifier);
+	ctrl_msg->client = client;
+	ctrl_msg->message = *msg;
+	ctrl_msg->compact = compact;
 
-	sigset_t sigpipe_mask;
-	sigemptyset(&sigpipe_mask);
-	sigaddset(&sigpipe_mask, SIGPIPE);
-	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, NULL);
+	pthread_mutex_lock(&worker->lock);
+	SIMPLEQ_INSERT_TAIL(&worker->messages, ctrl_msg, next);
+	pthread_cond_signal(&worker->wkup);
+	pthread_mutex_unlock(&worker->lock);
 
-	subprocess_ipc_handler_thread_id = start_thread(subprocess_thread, NULL);
+	return 0;
+}
 
-	/* Initialize and bind to UDS */
-	ctrllisten = listener_create(get_ctrl_socket(), SOCK_STREAM);
-	if (ctrllisten < 0 ) {
-		ERROR("Error creating IPC control socket");
-		exit(2);
-	}
+/*
+ * Read the next part of a request, a file descriptor can
+ * be passed together with it (REQ_INSTALL_FD).
+ * The request is a whole ipc_message or an ipc_header
+ * followed by the used part of msgdata: the size is known
+ * after the header. Clients wait for the answer before
+ * sending anything else, so reading ahead is safe.
+ * Returns 1 if the request is complete, 0 if more data
+ * is expected and -1 if the connection must be dropped.
+ */
+static int ctrl_client_read(struct ctrl_client *c)
+{
+	struct iovec iov = {
+		.iov_base = c->req.raw + c->len,
+		.iov_len = (c->need ? c->need : sizeof(c->req.msg)) - c->len
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msgh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf)
+	};
+	struct cmsghdr *cmsg;
+	ipc_header hdr;
+	ssize_t nread;
+	int fd;
 
-	thread_ready();
 	do {
-		clilen = sizeof(cliaddr);
-		if ( (ctrlconnfd = accept(ctrllisten, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
-			if (errno == EINTR)
-				continue;
-			else {
-				TRACE("Accept returns: %s", strerror(errno));
-				continue;
-			}
+		nread = recvmsg(c->fd, &msgh, MSG_CMSG_CLOEXEC);
+	} while (nread < 0 && errno == EINTR);
+
+	if (nread < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+			/* just one fd per request */
+			if (c->passedfd >= 0)
+				close(fd);
+			else
+				c->passedfd = fd;
 		}
-		if (fcntl(ctrlconnfd, F_SETFD, FD_CLOEXEC) < 0)
-			WARN("Could not set %d as cloexec: %s", ctrlconnfd, strerror(errno));
+	}
 
-		nread = read(ctrlconnfd, (void *)&msg, sizeof(msg));
+	if (!nread) {
+		if (c->len)
+			TRACE("IPC message too short (read %zu bytes, expected %zu bytes)",
+			      c->len, c->need ? c->need : sizeof(c->req.msg));
+		return -1;
+	}
 
-		if (nread != sizeof(msg)) {
-			TRACE("IPC message too short: fragmentation not supported (read %d bytes, expected %zu bytes)",
-				nread, sizeof(msg));
-			close(ctrlconnfd);
-			continue;
+	c->len += nread;
+
+	if (!c->need && c->len >= sizeof(hdr)) {
+		memcpy(&hdr, c->req.raw, sizeof(hdr));
+		switch (hdr.magic) {
+		case IPC_MAGIC:
+			c->need = sizeof(c->req.msg);
+			break;
+		case IPC_MAGIC_COMPACT:
+			if (hdr.len > sizeof(msgdata)) {
+				TRACE("IPC message too long (%u bytes)", hdr.len);
+				return -1;
+			}
+			c->need = sizeof(hdr) + hdr.len;
+			c->compact = true;
+			break;
+		default:
+			/* answered with a NACK */
+			c->need = c->len;
 		}
+		if (c->len > c->need) {
+			TRACE("IPC client sent %zu bytes after the request",
+			      c->len - c->need);
+			return -1;
+		}
+	}
+
+	if (!c->need || c->len < c->need)
+		return 0;
+
+	/* expand a compact request in place */
+	if (c->compact) {
+		memcpy(&hdr, c->req.raw, sizeof(hdr));
+		memmove(&c->req.msg.data, c->req.raw + sizeof(hdr), hdr.len);
+		memset((char *)&c->req.msg.data + hdr.len, 0,
+		       sizeof(msgdata) - hdr.len);
+		c->req.msg.magic = IPC_MAGIC;
+	}
+
+	return 1;
+}
+
+static void ctrl_client_free(struct ctrl_client *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	if (c->passedfd >= 0)
+		close(c->passedfd);
+	free(c);
+}
+
+/*
+ * Requests starting an install or changing its settings are
+ * serialized with the installer, the other ones must not wait
+ * for it.
+ */
+static bool ctrl_request_locked(ipc_message *msg)
+{
+	if (msg->magic != IPC_MAGIC)
+		return false;
+
+	switch (msg->type) {
+	case REQ_INSTALL:
+	case REQ_INSTALL_FD:
+	case SET_AES_KEY:
+	case SET_VERSIONS_RANGE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Process a complete request. The connection is closed
+ * after the answer or passed to the installer, to a worker
+ * or to the list of notification clients.
+ */
+static void handle_ctrl_request(struct installer *instp, int ctrlconnfd,
+				ipc_message *request, int passedfd,
+				bool compact)
+{
+	ipc_message msg = *request;
+	bool fdreq;
+	struct msg_elem *notification, *tmp;
+	struct notify_conn *conn;
+	int ret;
+	bool should_close_socket;
+	bool locked = ctrl_request_locked(&msg);
+	struct swupdate_cfg *cfg;
 
-		should_close_socket = true;
+	should_close_socket = true;
+	if (locked)
 		pthread_mutex_lock(&stream_mutex);
-		if (msg.magic == IPC_MAGIC)  {
-			switch (msg.type) {
-			case POST_UPDATE:
-				if (postupdate(get_swupdate_cfg(),
-							   msg.data.procmsg.len > 0 ? msg.data.procmsg.buf : NULL) == 0) {
-					msg.type = ACK;
-					sprintf(msg.data.msg, "Post-update actions successfully executed.");
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Post-update actions failed.");
-				}
+	if (msg.magic == IPC_MAGIC)  {
+		switch (msg.type) {
+		case POST_UPDATE:
+		case SET_UPDATE_STATE:
+		case GET_UPDATE_STATE:
+		case SET_SWUPDATE_VARS:
+		case GET_SWUPDATE_VARS:
+			if (queue_to_worker(&slow_worker, ctrlconnfd, &msg, compact)) {
+				msg.type = NACK;
 				break;
-			case SWUPDATE_SUBPROCESS:
-				subprocess_msg = (struct subprocess_msg_elem*)malloc(
-						sizeof(struct subprocess_msg_elem));
-				if (subprocess_msg == NULL) {
-					ERROR("Cannot handle subprocess IPC because of OOM.");
-					msg.type = NACK;
-					break;
-				}
-
-				should_close_socket = false;
-				subprocess_msg->client = ctrlconnfd;
-				subprocess_msg->message = msg;
+			}
+			/* the answer is sent by the worker */
+			should_close_socket = false;
+			break;
+		case SWUPDATE_SUBPROCESS:
+			if (queue_to_worker(&subprocess_worker, ctrlconnfd, &msg,
+					    compact)) {
+				msg.type = NACK;
+				break;
+			}
 
-				pthread_mutex_lock(&subprocess_msg_lock);
-				SIMPLEQ_INSERT_TAIL(&subprocess_messages, subprocess_msg, next);
-				pthread_cond_signal(&subprocess_wkup);
-				pthread_mutex_unlock(&subprocess_msg_lock);
-				/*
-				 * ACK/NACK will be inserted by the called SUBPROCESS
-				 * It should not be touched here.
-				 * We leave the type as is and delegate the socket to a
-				 * dedicated processing thread.
-				 */
+			should_close_socket = false;
+			/*
+			 * ACK/NACK will be inserted by the called SUBPROCESS
+			 * It should not be touched here.
+			 * We leave the type as is and delegate the socket to a
+			 * dedicated processing thread.
+			 */
 
+			break;
+		case REQ_INSTALL_FD:
+			if (passedfd < 0) {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "No file descriptor passed");
 				break;
-			case REQ_INSTALL:
-				TRACE("Incoming network request: processing...");
-				if (instp->status == IDLE) {
-					instp->fd = ctrlconnfd;
-					instp->req = msg.data.instmsg.req;
-					if ((instp->req.apiversion == SWUPDATE_API_VERSION) &&
-					    (is_selection_allowed(instp->req.software_set,
-								  instp->req.running_mode,
-								  &instp->software->accepted_set))) {
-						/*
-						 * Prepare answer
-						 */
-						msg.type = ACK;
-						memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			}
+			/* fallthrough */
+		case REQ_INSTALL:
+			TRACE("Incoming network request: processing...");
+			fdreq = msg.type == REQ_INSTALL_FD;
+			if (postupdate_running) {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "Post-update in progress");
+			} else if (instp->status == IDLE) {
+				instp->fd = fdreq ? passedfd : ctrlconnfd;
+				instp->req = msg.data.instmsg.req;
+				if ((instp->req.apiversion == SWUPDATE_API_VERSION) &&
+				    (is_selection_allowed(instp->req.software_set,
+							  instp->req.running_mode,
+							  &instp->software->accepted_set))) {
+					/*
+					 * Prepare answer
+					 */
+					msg.type = ACK;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+					/*
+					 * With a passed fd the installer reads the SWU
+					 * from it, the socket is not needed anymore
+					 */
+					if (fdreq)
+						passedfd = -1;
+					else
 						should_close_socket = false;
 
-						/* Drop all old notification from last run */
-						cleanum_msg_list();
-
-						/* Wake-up the installer */
-						stream_wkup = true;
-						pthread_cond_signal(&stream_cond);
-					} else {
-						msg.type = NACK;
-						memset(msg.data.msg, 0, sizeof(msg.data.msg));
-					}
+					/* Drop all old notification from last run */
+					cleanum_msg_list();
+
+					/*
+					 * Wake-up the installer, status is already
+					 * RUN so that a client polling the status
+					 * does not see IDLE before it is started
+					 */
+					instp->status = RUN;
+					stream_wkup = true;
+					pthread_cond_signal(&stream_cond);
 				} else {
 					msg.type = NACK;
-					sprintf(msg.data.msg, "Installation in progress");
-				}
-				break;
-			case GET_STATUS:
-				msg.type = ACK;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
-
-				/* Get first notification from the queue */
-				pthread_mutex_lock(&msglock);
-				notification = SIMPLEQ_FIRST(&notifymsgs);
-				if (notification) {
-					SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-					nrmsgs--;
-					strncpy(msg.data.status.desc, notification->msg,
-						sizeof(msg.data.status.desc) - 1);
-					msg.data.status.current = notification->status;
-					msg.data.status.error = notification->error;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
 				}
-				pthread_mutex_unlock(&msglock);
+			} else {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "Installation in progress");
+			}
+			break;
+		case GET_STATUS:
+			msg.type = ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			msg.data.status.current = instp->status;
+			msg.data.status.last_result = instp->last_install;
+			msg.data.status.error = instp->last_error;
+
+			/* Get first notification from the queue */
+			pthread_mutex_lock(&msglock);
+			notification = SIMPLEQ_FIRST(&notifymsgs);
+			if (notification) {
+				SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
+				nrmsgs--;
+				strncpy(msg.data.status.desc, notification->msg,
+					sizeof(msg.data.status.desc) - 1);
+				msg.data.status.current = notification->status;
+				msg.data.status.error = notification->error;
+			}
+			pthread_mutex_unlock(&msglock);
 
-				break;
-			case NOTIFY_STREAM:
-				msg.type = ACK;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
+			break;
+		case NOTIFY_STREAM:
+			/* the stream uses the fixed framing */
+			msg.type = ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			msg.data.status.current = instp->status;
+			msg.data.status.last_result = instp->last_install;
+			msg.data.status.error = instp->last_error;
 
-				ret = write(ctrlconnfd, &msg, sizeof(msg));
-				msg.type = NOTIFY_STREAM;
-				if (ret < 0) {
-					ERROR("Error write notify ack on socket ctrl");
-					close(ctrlconnfd);
-					break;
-				}
+			ret = write(ctrlconnfd, &msg, sizeof(msg));
+			msg.type = NOTIFY_STREAM;
+			if (ret < 0) {
+				ERROR("Error write notify ack on socket ctrl");
+				close(ctrlconnfd);
+				break;
+			}
 
-				/* Send notify history */
-				pthread_mutex_lock(&msglock);
-				ret = 0;
-				SIMPLEQ_FOREACH_SAFE(notification, &notifymsgs, next, tmp) {
-					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			/* Send notify history */
+			pthread_mutex_lock(&msglock);
+			ret = 0;
+			SIMPLEQ_FOREACH_SAFE(notification, &notifymsgs, next, tmp) {
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
 
-					strncpy(msg.data.notify.msg, notification->msg,
-							sizeof(msg.data.notify.msg) - 1);
-					msg.data.notify.status = notification->status;
-					msg.data.notify.error = notification->error;
-					msg.data.notify.level = notification->level;
+				strncpy(msg.data.notify.msg, notification->msg,
+						sizeof(msg.data.notify.msg) - 1);
+				msg.data.notify.status = notification->status;
+				msg.data.notify.error = notification->error;
+				msg.data.notify.level = notification->level;
 
-					ret = write_notify_msg(&msg, ctrlconnfd);
-					if (ret < 0) {
-						break;
-					}
-				}
+				ret = write_notify_msg(&msg, ctrlconnfd);
 				if (ret < 0) {
-					pthread_mutex_unlock(&msglock);
-					ERROR("Error write notify history on socket ctrl");
-					close(ctrlconnfd);
 					break;
 				}
-
-				/*
-				 * Save the new connection to send notifications to
-				 */
-				conn = (struct notify_conn *)calloc(1, sizeof(*conn));
-				if (!conn) {
-					pthread_mutex_unlock(&msglock);
-					ERROR("Out of memory, skipping...");
-					close(ctrlconnfd);
-					pthread_mutex_unlock(&stream_mutex);
-					continue;
-				}
-				conn->sockfd = ctrlconnfd;
-				SIMPLEQ_INSERT_TAIL(&notify_conns, conn, next);
+			}
+			if (ret < 0) {
 				pthread_mutex_unlock(&msglock);
-
+				ERROR("Error write notify history on socket ctrl");
+				close(ctrlconnfd);
 				break;
-			case SET_AES_KEY:
-				if (IS_STR_EQUAL(msg.data.aeskeymsg.key_ascii, "pkcs11"))
-					msg.type = NACK;
-				else {
-					msg.type = ACK;
-					if (set_aes_key(msg.data.aeskeymsg.key_ascii, msg.data.aeskeymsg.ivt_ascii))
-						msg.type = NACK;
-				}
+			}
+
+			/*
+			 * Save the new connection to send notifications to
+			 */
+			conn = (struct notify_conn *)calloc(1, sizeof(*conn));
+			if (!conn) {
+				pthread_mutex_unlock(&msglock);
+				ERROR("Out of memory, skipping...");
+				close(ctrlconnfd);
 				break;
-			case SET_VERSIONS_RANGE:
+			}
+			conn->sockfd = ctrlconnfd;
+			SIMPLEQ_INSERT_TAIL(&notify_conns, conn, next);
+			pthread_mutex_unlock(&msglock);
+
+			break;
+		case SET_AES_KEY:
+			if (IS_STR_EQUAL(msg.data.aeskeymsg.key_ascii, "pkcs11"))
+				msg.type = NACK;
+			else {
 				msg.type = ACK;
-				if (set_version_range(msg.data.versions.update_type,
-						  msg.data.versions.minimum_version,
-						  msg.data.versions.maximum_version,
-						  msg.data.versions.current_version)) msg.type = NACK;
-				break;
-			case GET_HW_REVISION:
-				cfg = get_swupdate_cfg();
-				if (get_hw_revision(&cfg->hw) < 0) {
+				if (set_aes_key(msg.data.aeskeymsg.key_ascii, msg.data.aeskeymsg.ivt_ascii))
 					msg.type = NACK;
-					memset(msg.data.msg, 0, sizeof(msg.data.msg));
-					break;
-				}
-				msg.type = ACK;
-				memset(msg.data.revisions.boardname, 0, sizeof(msg.data.revisions.boardname));
-				strncpy(msg.data.revisions.boardname, cfg->hw.boardname,
-					sizeof(msg.data.revisions.boardname) - 1);
-				memset(msg.data.revisions.revision, 0, sizeof(msg.data.revisions.revision));
-				strncpy(msg.data.revisions.revision, cfg->hw.revision,
-					sizeof(msg.data.revisions.revision) - 1);
-				break;
-			case SET_UPDATE_STATE:
-				value = *(update_state_t *)msg.data.msg;
-				msg.type = (is_valid_state(value) &&
-					    save_state(value) == SERVER_OK)
-					       ? ACK
-					       : NACK;
-				break;
-			case GET_UPDATE_STATE:
-				msg.data.msg[0] = get_state();
-				msg.type = ACK;
-				break;
-			case SET_SWUPDATE_VARS:
-				msg.type = swupdate_vars_set(msg.data.vars.varname,
-						  strlen(msg.data.vars.varvalue) ? msg.data.vars.varvalue : NULL,
-						  msg.data.vars.varnamespace) == 0 ? ACK : NACK;
+			}
+			break;
+		case SET_VERSIONS_RANGE:
+			msg.type = ACK;
+			if (set_version_range(msg.data.versions.update_type,
+					  msg.data.versions.minimum_version,
+					  msg.data.versions.maximum_version,
+					  msg.data.versions.current_version)) msg.type = NACK;
+			break;
+		case GET_HW_REVISION:
+			cfg = get_swupdate_cfg();
+			if (get_hw_revision(&cfg->hw) < 0) {
+				msg.type = NACK;
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
 				break;
-			case GET_SWUPDATE_VARS:
-				varvalue = swupdate_vars_get(msg.data.vars.varname,
-						  msg.data.vars.varnamespace);
-				memset(msg.data.vars.varvalue, 0, sizeof(msg.data.vars.varvalue));
-				if (varvalue) {
-					strlcpy(msg.data.vars.varvalue, varvalue, sizeof(msg.data.vars.varvalue));
-					free(varvalue);
-					msg.type = ACK;
-				} else
-					msg.type = NACK;
+			}
+			msg.type = ACK;
+			memset(msg.data.revisions.boardname, 0, sizeof(msg.data.revisions.boardname));
+			strncpy(msg.data.revisions.boardname, cfg->hw.boardname,
+				sizeof(msg.data.revisions.boardname) - 1);
+			memset(msg.data.revisions.revision, 0, sizeof(msg.data.revisions.revision));
+			strncpy(msg.data.revisions.revision, cfg->hw.revision,
+				sizeof(msg.data.revisions.revision) - 1);
+			break;
+		case SET_DELTA_URL:
+			cfg = get_swupdate_cfg();
+
+			/*
+			 * check strings in IPC
+			 */
+			msg.data.dwl_url.filename[sizeof(msg.data.dwl_url.filename) - 1] = '\0';
+			msg.data.dwl_url.url[sizeof(msg.data.dwl_url.url) - 1] = '\0';
+			/*
+			 * Check for mutex: there is currently no other users, one writer and one reader
+			 * for the list (the handler).
+			 */
+			TRACE("EXTERNAL URL: %s:%s",msg.data.dwl_url.filename, msg.data.dwl_url.url );
+			msg.type = dict_insert_value(&cfg->external_urls,
+						     msg.data.dwl_url.filename,
+						     msg.data.dwl_url.url) == 0 ? ACK : NACK;
+			break;
+		case GET_INSTALL_STATS:
+			ret = install_stats_get(msg.data.stats.index,
+						msg.data.stats.buf,
+						sizeof(msg.data.stats.buf));
+			if (ret < 0) {
+				msg.type = NACK;
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
 				break;
-			case SET_DELTA_URL:
-				cfg = get_swupdate_cfg();
+			}
+			msg.type = ACK;
+			msg.data.stats.count = ret;
+			break;
+		default:
+			msg.type = NACK;
+		}
+	} else {
+		/* Wrong request */
+		msg.type = NACK;
+		sprintf(msg.data.msg, "Wrong request: aborting");
+	}
 
+	if (msg.type == ACK || msg.type == NACK) {
+		ret = ipc_message_send(ctrlconnfd, &msg, compact);
+		if (ret < 0)
+			ERROR("Error write on socket ctrl: %s", strerror(errno));
+
+		if (should_close_socket == true)
+			close(ctrlconnfd);
+	}
+	if (passedfd >= 0)
+		close(passedfd);
+	if (locked)
+		pthread_mutex_unlock(&stream_mutex);
+}
+
+/*
+ * Client timeouts must not follow steps of the wall
+ * clock, for example when NTP sets the time at boot
+ */
+static time_t monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static void ctrl_accept(int ctrllisten, struct ctrl_clients *clients,
+			unsigned int *nclients)
+{
+	struct ctrl_client *c;
+	int fd;
+
+	for (;;) {
+		fd = accept(ctrllisten, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				TRACE("Accept returns: %s", strerror(errno));
+			return;
+		}
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+			WARN("Could not set %d as cloexec: %s", fd, strerror(errno));
+
+		if (*nclients >= CTRL_MAX_CLIENTS) {
+			WARN("Too many clients on control socket, connection refused");
+			close(fd);
+			continue;
+		}
+
+		c = (struct ctrl_client *)calloc(1, sizeof(*c));
+		if (!c) {
+			ERROR("Out of memory, skipping...");
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->passedfd = -1;
+		c->start = monotonic_seconds();
+		swupdate_file_setnonblock(fd, true);
+		LIST_INSERT_HEAD(clients, c, next);
+		(*nclients)++;
+	}
+}
+
+void *network_thread (void *data)
+{
+	struct installer *instp = (struct installer *)data;
+	int ctrllisten;
+	struct ctrl_clients clients;
+	struct ctrl_client *c, *tmp;
+	unsigned int nclients = 0, nfds, i;
+	struct pollfd fds[CTRL_MAX_CLIENTS + 1];
+	struct ctrl_client *pending[CTRL_MAX_CLIENTS + 1];
+	time_t now;
+	int ret;
+
+	if (!instp) {
+		TRACE("Fatal error: Network thread aborting...");
+		return (void *)0;
+	}
+
+	SIMPLEQ_INIT(&notifymsgs);
+	SIMPLEQ_INIT(&notify_conns);
+	SIMPLEQ_INIT(&subprocess_worker.messages);
+	SIMPLEQ_INIT(&slow_worker.messages);
+	LIST_INIT(&clients);
+	register_notifier(network_notifier);
+
+	sigset_t sigpipe_mask;
+	sigemptyset(&sigpipe_mask);
+	sigaddset(&sigpipe_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, NULL);
+
+	start_thread(ctrl_worker_thread, &subprocess_worker);
+	start_thread(ctrl_worker_thread, &slow_worker);
+
+	/* Initialize and bind to UDS */
+	ctrllisten = listener_create(get_ctrl_socket(), SOCK_STREAM);
+	if (ctrllisten < 0 ) {
+		ERROR("Error creating IPC control socket");
+		exit(2);
+	}
+	swupdate_file_setnonblock(ctrllisten, true);
+
+	thread_ready();
+	do {
+		/*
+		 * Wait for new clients and for the requests of the
+		 * connected clients, that can arrive in fragments
+		 */
+		fds[0].fd = ctrllisten;
+		fds[0].events = POLLIN;
+		nfds = 1;
+		LIST_FOREACH(c, &clients, next) {
+			fds[nfds].fd = c->fd;
+			fds[nfds].events = POLLIN;
+			pending[nfds] = c;
+			nfds++;
+		}
+
+		ret = poll(fds, nfds, 1000);
+		if (ret < 0) {
+			if (errno != EINTR)
+				TRACE("poll returns: %s", strerror(errno));
+			continue;
+		}
+
+		for (i = 1; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+			c = pending[i];
+			ret = ctrl_client_read(c);
+			if (!ret)
+				continue;
+			LIST_REMOVE(c, next);
+			nclients--;
+			if (ret > 0) {
 				/*
-				 * check strings in IPC
-				 */
-				msg.data.dwl_url.filename[sizeof(msg.data.dwl_url.filename) - 1] = '\0';
-				msg.data.dwl_url.url[sizeof(msg.data.dwl_url.url) - 1] = '\0';
-				/*
-				 * Check for mutex: there is currently no other users, one writer and one reader
-				 * for the list (the handler).
+				 * The connection is passed on blocking as
+				 * before, the installer reads the SWU from it
 				 */
-				TRACE("EXTERNAL URL: %s:%s",msg.data.dwl_url.filename, msg.data.dwl_url.url );
-				msg.type = dict_insert_value(&cfg->external_urls,
-							     msg.data.dwl_url.filename,
-							     msg.data.dwl_url.url) == 0 ? ACK : NACK;
-				break;
-			default:
-				msg.type = NACK;
+				swupdate_file_setnonblock(c->fd, false);
+				handle_ctrl_request(instp, c->fd, &c->req.msg,
+						    c->passedfd, c->compact);
+				c->fd = -1;
+				c->passedfd = -1;
 			}
-		} else {
-			/* Wrong request */
-			msg.type = NACK;
-			sprintf(msg.data.msg, "Wrong request: aborting");
+			ctrl_client_free(c);
 		}
 
-		if (msg.type == ACK || msg.type == NACK) {
-			ret = write(ctrlconnfd, &msg, sizeof(msg));
-			if (ret < 0)
-				ERROR("Error write on socket ctrl: %s", strerror(errno));
+		if (fds[0].revents)
+			ctrl_accept(ctrllisten, &clients, &nclients);
 
-			if (should_close_socket == true)
-				close(ctrlconnfd);
+		/* Drop clients that do not complete their request */
+		now = monotonic_seconds();
+		LIST_FOREACH_SAFE(c, &clients, next, tmp) {
+			if (now - c->start < DEFAULT_INTERNAL_TIMEOUT)
+				continue;
+			TRACE("IPC client timeout, %zu bytes received", c->len);
+			LIST_REMOVE(c, next);
+			nclients--;
+			ctrl_client_free(c);
 		}
-		pthread_mutex_unlock(&stream_mutex);
 	} while (1);
 	return (void *)0;
 }
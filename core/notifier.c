@@ -18,6 +18,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "bsdqueue.h"
 #include "swupdate_status.h"
@@ -37,6 +38,7 @@
  */
 struct notify_elem {
 	notifier client;
+	unsigned int flags;
 	STAILQ_ENTRY(notify_elem) next;
 };
 
@@ -45,6 +47,39 @@ STAILQ_HEAD(notifylist, notify_elem);
 static struct notifylist clients;
 static pthread_mutex_t clients_mutex;
 
+/*
+ * In asynchronous mode, notify() just copies the event into
+ * a preallocated ring and a dispatcher thread calls the
+ * notifiers. Producers reserve a slot with a compare and swap
+ * on the head, each slot has a sequence number telling if it
+ * is free or if it is filled and ready to be dispatched.
+ */
+#define NOTIFY_RING_SIZE	128	/* must be a power of 2 */
+
+struct notify_slot {
+	unsigned long seq;
+	RECOVERY_STATUS status;
+	int error;
+	int level;
+	bool nomsg;
+	char buf[NOTIFY_BUF_SIZE];
+};
+
+static struct {
+	bool enabled;
+	pid_t owner;			/* process running the dispatcher */
+	struct notify_slot *slots;
+	unsigned long head;		/* next slot to be reserved */
+	unsigned long done;		/* events already dispatched */
+	unsigned int waiters;
+	sem_t pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* signalled when events are dispatched */
+	pthread_t thread;
+	unsigned long dropped;
+	unsigned long skipped;
+} async_notify;
+
 /*
  * Notification can be sent even by other
  * processes - if they are started by
@@ -194,7 +229,7 @@ void notifier_set_color(int level, char *col)
  * receive any notification that is sent via
  * the notify() call
  */
-int register_notifier(notifier client)
+int register_notifier_ext(notifier client, unsigned int flags)
 {
 
 	struct notify_elem *newclient;
@@ -206,6 +241,7 @@ int register_notifier(notifier client)
 	if (!newclient)
 		return -ENOMEM;
 	newclient->client = client;
+	newclient->flags = flags;
 
 	pthread_mutex_lock(&clients_mutex);
 	STAILQ_INSERT_TAIL(&clients, newclient, next);
@@ -214,6 +250,177 @@ int register_notifier(notifier client)
 	return 0;
 }
 
+int register_notifier(notifier client)
+{
+	return register_notifier_ext(client, 0);
+}
+
+static void dispatch(RECOVERY_STATUS status, int error, int level,
+		     const char *msg, bool backlog)
+{
+	struct notify_elem *elem;
+
+	pthread_mutex_lock(&clients_mutex);
+	STAILQ_FOREACH(elem, &clients, next) {
+		/*
+		 * Lossy notifiers are skipped for debug
+		 * output to catch up with the events
+		 */
+		if (backlog && (elem->flags & NOTIFY_LOSSY) &&
+		    level >= DEBUGLEVEL) {
+			async_notify.skipped++;
+			continue;
+		}
+		(elem->client)(status, error, level, msg);
+	}
+	pthread_mutex_unlock(&clients_mutex);
+}
+
+static bool is_terminal(RECOVERY_STATUS status)
+{
+	return status == SUCCESS || status == FAILURE || status == DONE;
+}
+
+/*
+ * Wait until the event with sequence pos was dispatched
+ */
+static void wait_dispatched(unsigned long pos)
+{
+	__atomic_add_fetch(&async_notify.waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&async_notify.lock);
+	while ((long)(__atomic_load_n(&async_notify.done, __ATOMIC_SEQ_CST) - pos) <= 0)
+		pthread_cond_wait(&async_notify.cond, &async_notify.lock);
+	pthread_mutex_unlock(&async_notify.lock);
+	__atomic_sub_fetch(&async_notify.waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Queue the event for the dispatcher. If the ring is full,
+ * debug output is dropped, other events wait for a free slot.
+ * Terminal events wait until they are dispatched, so that
+ * nothing is lost if SWUpdate exits or reboots.
+ */
+static void notify_async(RECOVERY_STATUS status, int error, int level,
+			 const char *msg)
+{
+	struct notify_slot *slot;
+	bool in_dispatcher = pthread_equal(pthread_self(), async_notify.thread);
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&async_notify.head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &async_notify.slots[pos & (NOTIFY_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&async_notify.head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* ring full */
+			if (in_dispatcher || (level >= DEBUGLEVEL && !is_terminal(status))) {
+				__atomic_add_fetch(&async_notify.dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			wait_dispatched(pos - NOTIFY_RING_SIZE);
+			pos = __atomic_load_n(&async_notify.head, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&async_notify.head, __ATOMIC_RELAXED);
+	}
+
+	slot->status = status;
+	slot->error = error;
+	slot->level = level;
+	slot->nomsg = !msg;
+	if (msg)
+		strlcpy(slot->buf, msg, sizeof(slot->buf));
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&async_notify.pending);
+
+	if (is_terminal(status) && !in_dispatcher)
+		wait_dispatched(pos);
+}
+
+static void *notify_dispatcher(void __attribute__ ((__unused__)) *data)
+{
+	struct notify_slot *slot;
+	unsigned long pos = 0, backlog;
+
+	thread_ready();
+	for (;;) {
+		if (sem_wait(&async_notify.pending))
+			continue;
+
+		slot = &async_notify.slots[pos & (NOTIFY_RING_SIZE - 1)];
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			sched_yield();	/* slot reserved but not yet filled */
+
+		backlog = __atomic_load_n(&async_notify.head, __ATOMIC_RELAXED) - pos;
+		dispatch(slot->status, slot->error, slot->level,
+			 slot->nomsg ? NULL : slot->buf,
+			 backlog > NOTIFY_RING_SIZE / 2);
+
+		__atomic_store_n(&slot->seq, pos + NOTIFY_RING_SIZE, __ATOMIC_RELEASE);
+		pos++;
+		__atomic_store_n(&async_notify.done, pos, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&async_notify.waiters, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&async_notify.lock);
+			pthread_cond_broadcast(&async_notify.cond);
+			pthread_mutex_unlock(&async_notify.lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Wait for all queued events at exit
+ */
+static void notify_flush(void)
+{
+	unsigned long head;
+
+	/* children inherit the handler but not the dispatcher */
+	if (getpid() != async_notify.owner ||
+	    pthread_equal(pthread_self(), async_notify.thread))
+		return;
+	head = __atomic_load_n(&async_notify.head, __ATOMIC_SEQ_CST);
+	if (head)
+		wait_dispatched(head - 1);
+	if (async_notify.dropped || async_notify.skipped)
+		fprintf(stderr, "Notifier: %lu events dropped, %lu skipped\n",
+			async_notify.dropped, async_notify.skipped);
+}
+
+/*
+ * Switch the main process to asynchronous notifications,
+ * it cannot be switched back
+ */
+void notifier_set_async(bool enable)
+{
+	if (!enable || async_notify.enabled || pid == getpid())
+		return;
+
+	async_notify.slots = (struct notify_slot *)calloc(NOTIFY_RING_SIZE,
+							   sizeof(*async_notify.slots));
+	if (!async_notify.slots) {
+		WARN("Out of memory, notifications stay synchronous");
+		return;
+	}
+	for (unsigned long i = 0; i < NOTIFY_RING_SIZE; i++)
+		async_notify.slots[i].seq = i;
+	sem_init(&async_notify.pending, 0, 0);
+	pthread_mutex_init(&async_notify.lock, NULL);
+	pthread_cond_init(&async_notify.cond, NULL);
+
+	async_notify.owner = getpid();
+	async_notify.thread = start_thread(notify_dispatcher, NULL);
+	atexit(notify_flush);
+	__atomic_store_n(&async_notify.enabled, true, __ATOMIC_RELEASE);
+}
+
 /*
  * Main function to send notification. It is checked
  * if it is sent by the main process, where the notifier
@@ -223,7 +430,6 @@ int register_notifier(notifier client)
  */
 void notify(RECOVERY_STATUS status, int error, int level, const char *msg)
 {
-	struct notify_elem *elem;
 	struct notify_ipc_msg notifymsg;
 
 	if (pid == getpid()) {
@@ -244,10 +450,15 @@ void notify(RECOVERY_STATUS status, int error, int level, const char *msg)
 			}
 		}
 	} else { /* Main process */
-		pthread_mutex_lock(&clients_mutex);
-		STAILQ_FOREACH(elem, &clients, next)
-			(elem->client)(status, error, level, msg);
-		pthread_mutex_unlock(&clients_mutex);
+		/*
+		 * A child forked without exec (run_system_cmd()) has
+		 * no dispatcher and sends synchronously
+		 */
+		if (__atomic_load_n(&async_notify.enabled, __ATOMIC_ACQUIRE) &&
+		    getpid() == async_notify.owner)
+			notify_async(status, error, level, msg);
+		else
+			dispatch(status, error, level, msg, false);
 	}
 }
 
@@ -595,7 +806,7 @@ void notify_init(void)
 		addr_init(&notify_server, "NotifyServer");
 		STAILQ_INIT(&clients);
 		pthread_mutex_init(&clients_mutex, NULL);
-		register_notifier(console_notifier);
+		register_notifier_ext(console_notifier, NOTIFY_LOSSY);
 		register_notifier(process_notifier);
 		register_notifier(progress_notifier);
 		start_thread(notifier_thread, NULL);
@@ -84,6 +84,32 @@ static int check_missing_hash(struct imglist *list)
 }
 #endif
 
+/*
+ * The image named by install-after must be installed before,
+ * so it must come earlier in the list
+ */
+static int check_install_after(struct imglist *list)
+{
+	struct img_type *img, *prev;
+
+	LIST_FOREACH(img, list, next) {
+		if (!img->install_after || !strlen(img->install_after))
+			continue;
+		for (prev = LIST_FIRST(list); prev != img; prev = LIST_NEXT(prev, next)) {
+			if (!strcmp(img->install_after, prev->id.name) ||
+			    !strcmp(img->install_after, prev->fname))
+				break;
+		}
+		if (prev == img) {
+			ERROR("%s: install-after %s does not name a previous image",
+			      img->fname, img->install_after);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 static int check_handler(struct img_type *item, unsigned int mask, const char *desc)
 {
 	struct installer_handler *hnd;
@@ -142,23 +168,50 @@ struct swupdate_type_cfg *swupdate_find_update_type(struct swupdate_type_list *l
 	return NULL;
 }
 
-int parse(struct swupdate_cfg *sw, const char *descfile)
+/*
+ * Write sw-description into TMPDIR for who needs it as
+ * a file. If filename is set, it gets the allocated path.
+ */
+int write_sw_description(const char *buf, size_t len, char **filename)
 {
-	int ret = -1;
-	parser_fn current;
-#ifdef CONFIG_SIGNED_IMAGES
-	char *sigfile;
+	char *fn;
+	int fd, ret;
 
-	sigfile = malloc(strlen(descfile) + strlen(".sig") + 1);
-	if (!sigfile)
+	if (asprintf(&fn, "%s%s", get_tmpdir(), SW_DESCRIPTION_FILENAME) ==
+		ENOMEM_ASPRINTF) {
+		ERROR("OOM writing %s", SW_DESCRIPTION_FILENAME);
 		return -ENOMEM;
-	strcpy(sigfile, descfile);
-	strcat(sigfile, ".sig");
+	}
+
+	fd = openfileoutput(fn);
+	if (fd < 0) {
+		free(fn);
+		return -EBADF;
+	}
+	ret = copy_write(&fd, buf, len);
+	close(fd);
+	if (ret) {
+		free(fn);
+		return -EIO;
+	}
 
-	ret = swupdate_verify_file(sw->dgst, sigfile, descfile,
-				   sw->forced_signer_name);
-	free(sigfile);
+	if (filename)
+		*filename = fn;
+	else
+		free(fn);
 
+	return 0;
+}
+
+int parse(struct swupdate_cfg *sw, const struct swdesc_buf *desc)
+{
+	int ret = -1;
+	parser_fn current;
+	bool on_disk;
+#ifdef CONFIG_SIGNED_IMAGES
+	ret = swupdate_verify_buf(sw->dgst, desc->sig, desc->siglen,
+				  (const unsigned char *)desc->data, desc->len,
+				  sw->forced_signer_name);
 	if (ret)
 		return ret;
 
@@ -168,7 +221,7 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 	for (unsigned int i = 0; i < ARRAY_SIZE(parsers); i++) {
 		current = parsers[i];
 
-		ret = current(sw, descfile, &errors[i]);
+		ret = current(sw, desc->data, desc->len, &errors[i]);
 
 		if (ret == 0)
 			break;
@@ -194,9 +247,22 @@ int parse(struct swupdate_cfg *sw, const char *descfile)
 					"images / files");
 	ret |= check_handler_list(&sw->images, PARTITION_HANDLER, IS_PARTITION,
 					"partitions");
+	ret |= check_install_after(&sw->images);
 	if (ret)
 		return -EINVAL;
 
+	/*
+	 * sw-description is parsed from memory, scripts
+	 * could still look for it in TMPDIR. Without cleanup,
+	 * it is left there for debugging as before.
+	 */
+	on_disk = !LIST_EMPTY(&sw->scripts);
+#ifdef CONFIG_NOCLEANUP
+	on_disk = true;
+#endif
+	if (on_disk && write_sw_description(desc->data, desc->len, NULL))
+		return -EIO;
+
 	/*
 	 *  Bootloader is slightly different, it has no image
 	 *  but a list of variables
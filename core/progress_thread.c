@@ -20,6 +20,7 @@
 #include <sys/select.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include "swupdate.h"
@@ -35,13 +36,50 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+/*
+ * Messages queued for each listener: the queue grows
+ * if state transitions are not consumed fast enough
+ */
+#define PROGRESS_QUEUE_MIN	16
+#define PROGRESS_QUEUE_MAX	256
+
+/*
+ * Terminal states wait for the listeners to get them,
+ * a listener that does not read cannot block for longer
+ */
+#define PROGRESS_DRAIN_TIMEOUT_MS	2000
+
 struct progress_conn {
 	SIMPLEQ_ENTRY(progress_conn) next;
 	int sockfd;
+	bool dead;
+	struct progress_msg *queue;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	size_t sent;		/* bytes of the head already sent */
 };
 
 SIMPLEQ_HEAD(connections, progress_conn);
 
+/*
+ * Step run by an installer thread. Images can be installed
+ * in parallel: only the oldest running step is reported,
+ * the next one is reported when it completes.
+ */
+struct progress_step {
+	TAILQ_ENTRY(progress_step) next;
+	bool running;
+	unsigned int nr;
+	unsigned int percent;
+	char image[sizeof(((struct progress_msg *)0)->cur_image)];
+	char hnd_name[sizeof(((struct progress_msg *)0)->hnd_name)];
+};
+
+TAILQ_HEAD(progress_steps, progress_step);
+
+static __thread struct progress_step thread_step;
+
 /*
  * Structure contains data regarding
  * current installation
@@ -52,62 +90,283 @@ struct swupdate_progress {
 	const handler *curhnd;
 	struct connections conns;
 	pthread_mutex_t lock;
-	bool step_running;
+	pthread_cond_t drained;		/* dispatcher has flushed the queues */
+	struct progress_steps steps;	/* running steps, oldest first */
+	unsigned int last_step;
+	int wakefd[2];		/* wakes up the dispatcher */
+	bool wake_pending;
+	unsigned long coalesced;
+	unsigned long dropped;
+	unsigned long removed;
 };
 static struct swupdate_progress progress;
 
+/*
+ * Percent updates can be merged or dropped if a listener
+ * is slow, state transitions and info events are never lost.
+ */
+static bool is_droppable(const struct progress_msg *msg)
+{
+	return (msg->status == PROGRESS || msg->status == DOWNLOAD) &&
+		!msg->infolen;
+}
+
+static struct progress_msg *queue_entry(struct progress_conn *conn,
+					unsigned int i)
+{
+	return &conn->queue[(conn->head + i) % conn->size];
+}
+
+static bool grow_queue(struct progress_conn *conn)
+{
+	struct progress_msg *queue;
+	unsigned int size;
+
+	if (conn->size >= PROGRESS_QUEUE_MAX)
+		return false;
+
+	size = min(conn->size * 2, PROGRESS_QUEUE_MAX);
+	queue = (struct progress_msg *)malloc(size * sizeof(*queue));
+	if (!queue)
+		return false;
+	for (unsigned int i = 0; i < conn->count; i++)
+		queue[i] = *queue_entry(conn, i);
+	free(conn->queue);
+	conn->queue = queue;
+	conn->size = size;
+	conn->head = 0;
+
+	return true;
+}
+
+/*
+ * Remove the oldest percent update that is not being sent
+ */
+static bool drop_queued(struct progress_conn *conn)
+{
+	unsigned int i = conn->sent ? 1 : 0;
+
+	for (; i < conn->count; i++) {
+		if (!is_droppable(queue_entry(conn, i)))
+			continue;
+		for (; i < conn->count - 1; i++)
+			*queue_entry(conn, i) = *queue_entry(conn, i + 1);
+		conn->count--;
+		return true;
+	}
+
+	return false;
+}
+
+static void queue_progress_msg(struct swupdate_progress *pprog,
+			       struct progress_conn *conn)
+{
+	struct progress_msg *last;
+
+	if (conn->dead)
+		return;
+
+	/*
+	 * A percent update replaces the previous one
+	 * if this is still waiting in the queue
+	 */
+	if (conn->count && (conn->count > 1 || !conn->sent)) {
+		last = queue_entry(conn, conn->count - 1);
+		if (is_droppable(&pprog->msg) && is_droppable(last) &&
+		    last->status == pprog->msg.status &&
+		    last->cur_step == pprog->msg.cur_step) {
+			*last = pprog->msg;
+			pprog->coalesced++;
+			return;
+		}
+	}
+
+	if (conn->count == conn->size && !grow_queue(conn)) {
+		if (is_droppable(&pprog->msg)) {
+			pprog->dropped++;
+			return;
+		}
+		if (!drop_queued(conn)) {
+			/*
+			 * The listener does not read at all,
+			 * consider it dead
+			 */
+			conn->dead = true;
+			return;
+		}
+		pprog->dropped++;
+	}
+
+	*queue_entry(conn, conn->count) = pprog->msg;
+	conn->count++;
+}
+
 /*
  * This must be called after acquiring the mutex
- * for the progress structure
- * It is assumed that the listeners are reading
- * the events and consume the messages. To avoid deadlocks,
- * SWUpdate will try to send the message without blocking,
- * and if send() returns EWOULDBLOCk, tries some times again
- * with a 1 second delay.
- * This is because SWUpdate could send a lot of events,
- * and listeners cannot be scheduled at time. The delay just
- * slow down the update when happens. If the message cannot be
- * sent after retries, SWUpdate will consider the listener
- * dead and removes it from the list.
+ * for the progress structure.
+ * The message is just queued for each listener and sent by
+ * the dispatcher thread, so that the installer is never blocked
+ * by a listener that does not consume the events fast enough.
  */
 static void send_progress_msg(void)
 {
-	struct progress_conn *conn, *tmp;
+	struct progress_conn *conn;
 	struct swupdate_progress *pprog = &progress;
-	void *buf;
-	size_t count;
-	ssize_t n;
-	bool tryagain;
-	const int maxAttempts = 5;
+	char c = 0;
 
 	pprog->msg.apiversion = PROGRESS_API_VERSION;
-	SIMPLEQ_FOREACH_SAFE(conn, &pprog->conns, next, tmp) {
-		buf = &pprog->msg;
-		count = sizeof(pprog->msg);
-		errno = 0;
-		pprog->msg.source = get_install_source();
-		while (count > 0) {
-			int attempt = 0;
-			do {
-				n = send(conn->sockfd, buf, count, MSG_NOSIGNAL | MSG_DONTWAIT);
-				attempt++;
-				tryagain = n <= 0 && (errno == EWOULDBLOCK || errno == EAGAIN);
-				if (tryagain)
-					sleep(1);
-			} while (tryagain && attempt < maxAttempts);
-			if (n <= 0) {
-				close(conn->sockfd);
-				SIMPLEQ_REMOVE(&pprog->conns, conn,
-					       	progress_conn, next);
-				free(conn);
+	pprog->msg.source = get_install_source();
+	SIMPLEQ_FOREACH(conn, &pprog->conns, next)
+		queue_progress_msg(pprog, conn);
+
+	if (!pprog->wake_pending && !SIMPLEQ_EMPTY(&pprog->conns)) {
+		if (write(pprog->wakefd[1], &c, 1) == 1)
+			pprog->wake_pending = true;
+	}
+}
+
+/*
+ * Send the queued messages without blocking,
+ * must be called with the mutex held
+ */
+static void flush_conn(struct progress_conn *conn)
+{
+	struct progress_msg *msg;
+	ssize_t n;
+
+	while (conn->count && !conn->dead) {
+		msg = queue_entry(conn, 0);
+		n = send(conn->sockfd, (char *)msg + conn->sent,
+			 sizeof(*msg) - conn->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+			return;
+		if (n <= 0) {
+			conn->dead = true;
+			return;
+		}
+		conn->sent += n;
+		if (conn->sent == sizeof(*msg)) {
+			conn->sent = 0;
+			conn->head = (conn->head + 1) % conn->size;
+			conn->count--;
+		}
+	}
+}
+
+/*
+ * Wait until the queued messages are sent, so that a terminal
+ * state is delivered before the caller reboots or exits.
+ * Must be called with the mutex held, returns false on timeout.
+ */
+static bool drain_progress_msg(struct swupdate_progress *pprog)
+{
+	struct progress_conn *conn;
+	struct timespec ts;
+	bool pending;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += PROGRESS_DRAIN_TIMEOUT_MS / 1000;
+	ts.tv_nsec += (PROGRESS_DRAIN_TIMEOUT_MS % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	for (;;) {
+		pending = false;
+		SIMPLEQ_FOREACH(conn, &pprog->conns, next) {
+			if (conn->count && !conn->dead) {
+				pending = true;
 				break;
 			}
-			count -= (size_t)n;
-			buf = (char*)buf + n;
 		}
+		if (!pending)
+			return true;
+		if (pthread_cond_timedwait(&pprog->drained, &pprog->lock, &ts) == ETIMEDOUT)
+			return false;
 	}
 }
 
+static void free_conn(struct progress_conn *conn)
+{
+	close(conn->sockfd);
+	free(conn->queue);
+	free(conn);
+}
+
+/*
+ * Dispatcher: sends the queued messages to the listeners,
+ * waiting for the sockets to be writable.
+ * Connections are removed only here, so the file descriptors
+ * stay valid while poll() is running without the mutex.
+ */
+static void *progress_dispatcher(void __attribute__ ((__unused__)) *data)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct progress_conn *conn, *tmp;
+	struct pollfd *fds = NULL;
+	unsigned int nfds, maxfds = 0;
+	char buf[64];
+
+	thread_ready();
+	for (;;) {
+		pthread_mutex_lock(&pprog->lock);
+		SIMPLEQ_FOREACH_SAFE(conn, &pprog->conns, next, tmp) {
+			flush_conn(conn);
+			if (conn->dead) {
+				SIMPLEQ_REMOVE(&pprog->conns, conn,
+					       progress_conn, next);
+				free_conn(conn);
+				pprog->removed++;
+			}
+		}
+		pthread_cond_broadcast(&pprog->drained);
+
+		nfds = 1;
+		SIMPLEQ_FOREACH(conn, &pprog->conns, next)
+			nfds++;
+		if (nfds > maxfds) {
+			free(fds);
+			fds = calloc(nfds, sizeof(*fds));
+			maxfds = fds ? nfds : 0;
+		}
+		if (!fds) {
+			pthread_mutex_unlock(&pprog->lock);
+			ERROR("Out of memory, progress messages are not sent");
+			sleep(1);
+			continue;
+		}
+
+		fds[0].fd = pprog->wakefd[0];
+		fds[0].events = POLLIN;
+		nfds = 1;
+		SIMPLEQ_FOREACH(conn, &pprog->conns, next) {
+			if (!conn->count)
+				continue;
+			fds[nfds].fd = conn->sockfd;
+			fds[nfds].events = POLLOUT;
+			nfds++;
+		}
+		pthread_mutex_unlock(&pprog->lock);
+
+		if (poll(fds, nfds, -1) < 0 && errno != EINTR) {
+			ERROR("progress dispatcher: poll error %d", errno);
+			sleep(1);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			pthread_mutex_lock(&pprog->lock);
+			while (read(pprog->wakefd[0], buf, sizeof(buf)) > 0);
+			pprog->wake_pending = false;
+			pthread_mutex_unlock(&pprog->lock);
+		}
+	}
+
+	return NULL;
+}
+
 static void _swupdate_download_update(unsigned int perc, unsigned long long totalbytes)
 {
 	/*
@@ -125,6 +384,20 @@ static void _swupdate_download_update(unsigned int perc, unsigned long long tota
 	pthread_mutex_unlock(&pprog->lock);
 }
 
+/*
+ * Must be called with the mutex held
+ */
+static void report_step(struct swupdate_progress *pprog,
+			struct progress_step *step)
+{
+	pprog->msg.cur_step = step->nr;
+	pprog->msg.cur_percent = step->percent;
+	strlcpy(pprog->msg.cur_image, step->image, sizeof(pprog->msg.cur_image));
+	strlcpy(pprog->msg.hnd_name, step->hnd_name, sizeof(pprog->msg.hnd_name));
+	pprog->msg.status = RUN;
+	send_progress_msg();
+}
+
 void swupdate_progress_init(unsigned int nsteps) {
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
@@ -132,6 +405,7 @@ void swupdate_progress_init(unsigned int nsteps) {
 	pprog->msg.apiversion = PROGRESS_API_VERSION;
 	pprog->msg.nsteps = nsteps;
 	pprog->msg.cur_step = 0;
+	pprog->last_step = 0;
 	pprog->msg.status = START;
 	pprog->msg.cur_percent = 0;
 	pprog->msg.infolen = get_install_info(pprog->msg.info,
@@ -153,11 +427,21 @@ void swupdate_progress_addstep(void) {
 void swupdate_progress_update(unsigned int perc)
 {
 	struct swupdate_progress *pprog = &progress;
+	struct progress_step *step;
+
 	pthread_mutex_lock(&pprog->lock);
-	if (perc != pprog->msg.cur_percent && pprog->step_running) {
-		pprog->msg.status = PROGRESS;
-		pprog->msg.cur_percent = perc;
-		send_progress_msg();
+	/*
+	 * A thread without a step of its own (for example a
+	 * helper of the handler) reports for the oldest one
+	 */
+	step = thread_step.running ? &thread_step : TAILQ_FIRST(&pprog->steps);
+	if (step && perc != step->percent) {
+		step->percent = perc;
+		if (step == TAILQ_FIRST(&pprog->steps)) {
+			pprog->msg.status = PROGRESS;
+			pprog->msg.cur_percent = perc;
+			send_progress_msg();
+		}
 	}
 	pthread_mutex_unlock(&pprog->lock);
 }
@@ -188,40 +472,67 @@ void swupdate_download_update(unsigned int perc, unsigned long long totalbytes)
 void swupdate_progress_inc_step(const char *image, const char *handler_name)
 {
 	struct swupdate_progress *pprog = &progress;
+	struct progress_step *step = &thread_step;
+
 	pthread_mutex_lock(&pprog->lock);
-	pprog->msg.cur_step++;
-	pprog->msg.cur_percent = 0;
-	strlcpy(pprog->msg.cur_image, image, sizeof(pprog->msg.cur_image));
-	strlcpy(pprog->msg.hnd_name, handler_name, sizeof(pprog->msg.hnd_name));
-	pprog->step_running = true;
-	pprog->msg.status = RUN;
-	send_progress_msg();
+	if (step->running)
+		TAILQ_REMOVE(&pprog->steps, step, next);
+	step->nr = ++pprog->last_step;
+	step->percent = 0;
+	strlcpy(step->image, image, sizeof(step->image));
+	strlcpy(step->hnd_name, handler_name, sizeof(step->hnd_name));
+	step->running = true;
+	TAILQ_INSERT_TAIL(&pprog->steps, step, next);
+	if (step == TAILQ_FIRST(&pprog->steps))
+		report_step(pprog, step);
 	pthread_mutex_unlock(&pprog->lock);
 }
 
 void swupdate_progress_step_completed(void)
 {
 	struct swupdate_progress *pprog = &progress;
+	struct progress_step *step = &thread_step;
+	bool oldest;
+
 	pthread_mutex_lock(&pprog->lock);
-	pprog->step_running = false;
-	pprog->msg.status = IDLE;
+	if (step->running) {
+		oldest = step == TAILQ_FIRST(&pprog->steps);
+		TAILQ_REMOVE(&pprog->steps, step, next);
+		step->running = false;
+		if (TAILQ_EMPTY(&pprog->steps))
+			pprog->msg.status = IDLE;
+		else if (oldest)
+			report_step(pprog, TAILQ_FIRST(&pprog->steps));
+	}
 	pthread_mutex_unlock(&pprog->lock);
 }
 
 void swupdate_progress_end(RECOVERY_STATUS status)
 {
 	struct swupdate_progress *pprog = &progress;
+	bool drained;
+
 	pthread_mutex_lock(&pprog->lock);
-	pprog->step_running = false;
 	pprog->msg.status = status;
 	send_progress_msg();
+	drained = drain_progress_msg(pprog);
+	if (pprog->coalesced || pprog->dropped || pprog->removed)
+		TRACE("Progress: %lu messages coalesced, %lu dropped, %lu listeners removed",
+		      pprog->coalesced, pprog->dropped, pprog->removed);
+	pprog->coalesced = 0;
+	pprog->dropped = 0;
+	pprog->removed = 0;
 	pprog->msg.nsteps = 0;
 	pprog->msg.cur_step = 0;
+	pprog->last_step = 0;
 	pprog->msg.cur_percent = 0;
 	pprog->msg.dwl_percent = 0;
 	pprog->msg.dwl_bytes = 0;
 
 	pthread_mutex_unlock(&pprog->lock);
+
+	if (!drained)
+		WARN("Progress: final state not delivered to all listeners");
 }
 
 void swupdate_progress_info(RECOVERY_STATUS status, int cause, const char *info)
@@ -241,16 +552,21 @@ void swupdate_progress_info(RECOVERY_STATUS status, int cause, const char *info)
 void swupdate_progress_done(const char *info)
 {
 	struct swupdate_progress *pprog = &progress;
+	bool drained;
+
 	pthread_mutex_lock(&pprog->lock);
 	if (info != NULL) {
 		snprintf(pprog->msg.info, sizeof(pprog->msg.info), "%s", info);
 		pprog->msg.infolen = strlen(pprog->msg.info);
 	}
-	pprog->step_running = false;
 	pprog->msg.status = DONE;
 	send_progress_msg();
+	drained = drain_progress_msg(pprog);
 	pprog->msg.infolen = 0;
 	pthread_mutex_unlock(&pprog->lock);
+
+	if (!drained)
+		WARN("Progress: final state not delivered to all listeners");
 }
 
 static int progress_send_connect_ack(int connfd)
@@ -303,7 +619,15 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 	int err;
 
 	pthread_mutex_init(&pprog->lock, NULL);
+	pthread_cond_init(&pprog->drained, NULL);
 	SIMPLEQ_INIT(&pprog->conns);
+	TAILQ_INIT(&pprog->steps);
+
+	if (pipe2(pprog->wakefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+		ERROR("Cannot create progress pipe, exiting.");
+		exit(2);
+	}
+	start_thread(progress_dispatcher, NULL);
 
 	/* Initialize and bind to UDS */
 	listen = listener_create(get_prog_socket(), SOCK_STREAM);
@@ -337,13 +661,21 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 			continue;
 		}
 		conn->sockfd = connfd;
+		conn->size = PROGRESS_QUEUE_MIN;
+		conn->queue = (struct progress_msg *)calloc(conn->size,
+							    sizeof(*conn->queue));
+		if (!conn->queue) {
+			ERROR("Out of memory, skipping...");
+			close(connfd);
+			free(conn);
+			continue;
+		}
 		pthread_mutex_lock(&pprog->lock);
 		/* Send an ACK to the client to indicate that it is duly registered */
 		err = progress_send_connect_ack(connfd);
 		if (err) {
 			ERROR("progress_bar_thread: Could not send progress ACK");
-			close(conn->sockfd);
-			free(conn);
+			free_conn(conn);
 		} else {
 			SIMPLEQ_INSERT_TAIL(&pprog->conns, conn, next);
 		}
@@ -41,6 +41,7 @@
 #include "installer.h"
 #include "installer_priv.h"
 #include "progress.h"
+#include "install_stats.h"
 #include "pctl.h"
 #include "state.h"
 #include "bootloader.h"
@@ -48,6 +49,7 @@
 #include "swupdate_crypto.h"
 
 #define BUFF_SIZE	 4096
+#define TEE_BUFF_SIZE	(64 * 1024)
 #define PERCENT_LB_INDEX	4
 
 enum {
@@ -84,14 +86,55 @@ pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
 
 static struct installer inst;
 
-static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
-			       bool encrypted, int max_size)
+/*
+ * Output of copyfile() for the files kept in memory
+ */
+struct mem_output {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int copy_to_mem(void *out, const void *buf, size_t len)
+{
+	struct mem_output *mem = (struct mem_output *)out;
+
+	if (len > mem->size - mem->len) {
+		ERROR("Output exceeds the size of the file");
+		return -EFBIG;
+	}
+	memcpy(mem->buf + mem->len, buf, len);
+	mem->len += len;
+
+	return 0;
+}
+
+/*
+ * Upper bound for sw-description and its signature when
+ * sw-description-max-size is not set: the size comes from
+ * the CPIO header and must not be trusted for an allocation.
+ */
+#define SWDESC_MAX_SIZE_DEFAULT	(16 * 1024 * 1024)
+
+static int swdesc_max_size(const struct swupdate_cfg *software)
+{
+	if (software->swdesc_max_size > 0)
+		return software->swdesc_max_size;
+
+	return SWDESC_MAX_SIZE_DEFAULT;
+}
+
+/*
+ * Extract a file into a NUL terminated buffer. The
+ * decrypted data is never larger than the encrypted one.
+ */
+static int extract_file_to_buf(int fd, const char *fname, unsigned long *poffs,
+			       bool encrypted, int max_size,
+			       unsigned char **data, size_t *len)
 {
-	char output_file[MAX_IMAGE_FNAME];
 	struct filehdr fdh;
-	int fdout = -1;
-	uint32_t checksum;
-	const char* TMPDIR = get_tmpdir();
+	struct mem_output mem = {0};
+	uint32_t checksum = 0;
 	cipher_t cipher = AES_CBC;
 	int ret = -1;
 
@@ -111,35 +154,34 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 			fname);
 		goto err;
 	}
-	if (snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR,
-		     fdh.filename) >= (int)sizeof(output_file)) {
-		ERROR("Path too long: %s%s", TMPDIR, fdh.filename);
-		goto err;
-	}
-	if (max_size && fdh.size >= max_size) {
-		ERROR("%s size (%ld) exceeds configured max of %d, aborting",
+	if (fdh.size >= max_size) {
+		ERROR("%s size (%ld) exceeds max of %d, aborting",
 			fdh.filename, fdh.size, max_size);
 		goto err;
 	}
 	if (!is_filename_valid(fdh.filename)) {
 		ERROR("%s is an invalid filename, aborting", fdh.filename);
-		return -1;
+		goto err;
 	}
 
 	TRACE("Found file");
 	TRACE("\tfilename %s", fdh.filename);
 	TRACE("\tsize %u", (unsigned int)fdh.size);
 
-	fdout = openfileoutput(output_file);
-	if (fdout < 0)
+	mem.size = fdh.size;
+	mem.buf = malloc(mem.size + 1);
+	if (!mem.buf) {
+		ERROR("%s: out of memory", fdh.filename);
 		goto err;
+	}
 
 	struct swupdate_copy copy = {
 		.fdin = fd,
-		.out = &fdout,
+		.callback = copy_to_mem,
+		.out = &mem,
 		.nbytes = fdh.size,
 		.offs = poffs,
-		.checksum = &checksum,
+		.checksum = CPIO_HAS_CHECKSUM(&fdh) ? &checksum : NULL,
 		.encrypted = encrypted,
 		.cipher = cipher,
 	};
@@ -149,14 +191,54 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 	if (!swupdate_verify_chksum(checksum, &fdh)) {
 		goto err;
 	}
+	mem.buf[mem.len] = '\0';
+	*data = mem.buf;
+	*len = mem.len;
+	mem.buf = NULL;
 	ret = 0;
 err:
 #ifdef CONFIG_ASYM_ENCRYPTED_SW_DESCRIPTION
 	if (encrypted)
 		set_cryptolib(cryptolib);
 #endif
-	if (fdout >= 0)
-		close(fdout);
+	free(mem.buf);
+	return ret;
+}
+
+/*
+ * Read sw-description and its signature from the SWU
+ * and parse it without storing them into TMPDIR
+ */
+static int extract_sw_description(int fd, unsigned long *poffs,
+				  struct swupdate_cfg *software, bool encrypted)
+{
+	struct swdesc_buf desc = {0};
+	int ret;
+
+	ret = extract_file_to_buf(fd, SW_DESCRIPTION_FILENAME, poffs, encrypted,
+				  swdesc_max_size(software),
+				  (unsigned char **)&desc.data, &desc.len);
+	if (ret < 0) {
+		ERROR("%s cannot be extracted", SW_DESCRIPTION_FILENAME);
+		return ret;
+	}
+#ifdef CONFIG_SIGNED_IMAGES
+	ret = extract_file_to_buf(fd, SW_DESCRIPTION_FILENAME ".sig", poffs, false,
+				  swdesc_max_size(software),
+				  &desc.sig, &desc.siglen);
+	if (ret < 0) {
+		ERROR("Signature cannot be extracted: %s.sig", SW_DESCRIPTION_FILENAME);
+		free(desc.data);
+		return ret;
+	}
+#endif
+	ret = parse(software, &desc);
+	if (ret)
+		ERROR("Compatible SW not found");
+
+	free(desc.sig);
+	free(desc.data);
+
 	return ret;
 }
 
@@ -183,11 +265,9 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 	unsigned long offset;
 	struct filehdr fdh;
 	swupdate_file_t skip;
-	uint32_t checksum;
+	uint32_t checksum = 0;
 	int fdout;
 	struct img_type *img, *part;
-	char output_file[MAX_IMAGE_FNAME];
-	const char* TMPDIR = get_tmpdir();
 	bool installed_directly = false;
 	bool encrypted_sw_desc = false;
 
@@ -208,26 +288,15 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 		switch (status) {
 		/* Waiting for the first Header */
 		case STREAM_WAIT_DESCRIPTION:
-			if (extract_file_to_tmp(fd, SW_DESCRIPTION_FILENAME, &offset,
-						encrypted_sw_desc, software->swdesc_max_size) < 0 )
+			if (extract_sw_description(fd, &offset, software,
+						   encrypted_sw_desc))
 				return -1;
 
 			status = STREAM_WAIT_SIGNATURE;
 			break;
 
 		case STREAM_WAIT_SIGNATURE:
-#ifdef CONFIG_SIGNED_IMAGES
-			snprintf(output_file, sizeof(output_file), "%s.sig", SW_DESCRIPTION_FILENAME);
-			if (extract_file_to_tmp(fd, output_file, &offset, false,
-						software->swdesc_max_size) < 0 )
-				return -1;
-#endif
-			snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME);
-			if (parse(software, output_file)) {
-				ERROR("Compatible SW not found");
-				return -1;
-			}
-
+			/* signature already read together with sw-description */
 			if (check_hw_compatibility(&software->hw, &software->hardware)) {
 				ERROR("SW not compatible with hardware");
 				return -1;
@@ -283,7 +352,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				.out = &fdout,
 				.nbytes = fdh.size,
 				.offs = &offset,
-				.checksum = &checksum,
+				.checksum = CPIO_HAS_CHECKSUM(&fdh) ? &checksum : NULL,
 			};
 			/*
 			 * If images are not streamed directly into the target
@@ -299,6 +368,8 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 					return -1;
 				}
 				copy.hash = img->sha256;
+				copy.threaded = img->threaded_pipeline;
+				copy.buffer_size = img->buffer_size;
 				if (copyfile(&copy) < 0) {
 					close(fdout);
 					return -1;
@@ -312,10 +383,17 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 
 			case SKIP_FILE:
 				copy.skip_file = 1;
+				/*
+				 * The checksum of a skipped file is verified
+				 * only on request, otherwise its data is just
+				 * discarded without reading it if possible
+				 */
+				if (!software->verify_skipped_checksum)
+					copy.checksum = NULL;
 				if (copyfile(&copy) < 0) {
 					return -1;
 				}
-				if (!swupdate_verify_chksum(checksum, &fdh)) {
+				if (copy.checksum && !swupdate_verify_chksum(checksum, &fdh)) {
 					return -1;
 				}
 				break;
@@ -339,9 +417,9 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				LIST_FOREACH(part, &software->images, next) {
 					if (!part->install_directly && part->is_partitioner) {
 						TRACE("Need to adjust partition %s before streaming %s",
-							part->volname, img->fname);
+							IMG_STR(part->volname), img->fname);
 						if (install_single_image(part, software->parms.dry_run)) {
-							ERROR("Error adjusting partition %s", part->volname);
+							ERROR("Error adjusting partition %s", IMG_STR(part->volname));
 							return -1;
 						}
 						/* Avoid trying to adjust again later */
@@ -390,7 +468,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 static int cpfiles(int fdin, int fdout, size_t max)
 {
 	char *buf;
-	const int bufsize = 16 * 1024;
+	const size_t bufsize = resolve_io_buffer_size(0, fdout);
 	int ret, len;
 	size_t maxread;
 	bool cpyall = (max == 0);
@@ -430,7 +508,146 @@ static int cpfiles(int fdin, int fdout, size_t max)
 
 
 #define SW_TMP_OUTPUT	"swtmp-outputXXXXXXXX"
-static int save_stream(int fdin, struct swupdate_cfg *software)
+/*
+ * The incoming SWU is saved and passed to the installer
+ * at the same time: the worker copies the input into the
+ * output file and into a socket read by extract_files().
+ * The socket cannot be seeked, so skipped artifacts are
+ * discarded by reading them: the worker must read the
+ * whole SWU anyway to save it.
+ */
+struct stream_tee {
+	int fdin;		/* incoming SWU, closed by the worker */
+	int tmpfd;		/* beginning of the SWU already read */
+	int fdout;		/* saved SWU */
+	int sock;		/* worker side of the socket pair */
+	int installfd;		/* installer side of the socket pair */
+	int ret;
+	bool running;
+	pthread_t thread;
+};
+
+static void tee_feed(struct stream_tee *t, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len && t->sock >= 0) {
+		n = send(t->sock, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			/*
+			 * The installer does not read anymore, the
+			 * SWU is just saved till the end
+			 */
+			TRACE("Installer stopped reading, SWU is only saved");
+			close(t->sock);
+			t->sock = -1;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *tee_worker(void *data)
+{
+	struct stream_tee *t = (struct stream_tee *)data;
+	unsigned char *buf;
+	int src = t->tmpfd;
+	ssize_t len;
+
+	buf = (unsigned char *)malloc(TEE_BUFF_SIZE);
+	if (!buf) {
+		ERROR("OOM when saving stream");
+		t->ret = -ENOMEM;
+		goto out;
+	}
+
+	for (;;) {
+		len = read(src, buf, TEE_BUFF_SIZE);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			ERROR("Reading from file failed, error %d", errno);
+			t->ret = -EFAULT;
+			break;
+		}
+		if (!len) {
+			if (src == t->tmpfd) {
+				src = t->fdin;
+				continue;
+			}
+			break;
+		}
+		if (copy_write(&t->fdout, buf, len) < 0) {
+			t->ret = -EIO;
+			break;
+		}
+		tee_feed(t, buf, len);
+	}
+
+out:
+	free(buf);
+	/*
+	 * The installer gets EOF, a truncated SWU
+	 * lets it fail if saving was stopped
+	 */
+	if (t->sock >= 0)
+		close(t->sock);
+	close(t->fdout);
+	close(t->tmpfd);
+	close(t->fdin);
+
+	return NULL;
+}
+
+static int stream_tee_start(struct stream_tee *t, int fdin, int tmpfd, int fdout)
+{
+	int sv[2];
+	int ret;
+
+	memset(t, 0, sizeof(*t));
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		ERROR("Cannot create socket pair: %s", strerror(errno));
+		return -EFAULT;
+	}
+
+	t->fdin = fdin;
+	t->tmpfd = tmpfd;
+	t->fdout = fdout;
+	t->sock = sv[0];
+	t->installfd = sv[1];
+
+	ret = pthread_create(&t->thread, NULL, tee_worker, t);
+	if (ret) {
+		ERROR("Code from pthread_create() is %d", ret);
+		close(sv[0]);
+		close(sv[1]);
+		return -EFAULT;
+	}
+	t->running = true;
+
+	return 0;
+}
+
+/*
+ * Wait until the whole SWU is saved, the installer
+ * side must be closed before
+ */
+static int stream_tee_finish(struct stream_tee *t)
+{
+	if (!t->running)
+		return 0;
+
+	pthread_join(t->thread, NULL);
+	t->running = false;
+
+	return t->ret;
+}
+
+static int save_stream(int fdin, struct swupdate_cfg *software,
+		       struct stream_tee *tee)
 {
 	unsigned char *buf;
 	int fdout = -1, ret, len;
@@ -439,7 +656,6 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	struct filehdr fdh;
 	unsigned int tmpsize;
 	unsigned long offset;
-	char output_file[MAX_IMAGE_FNAME];
 	const char* TMPDIR = get_tmpdir();
 	bool encrypted_sw_desc = false;
 	int files = 1;
@@ -509,9 +725,9 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 		 * This doubles with check in extract_file_to_tmp, but it does not make
 		 * sense to check after having copied everything once in tmpfd...
 		 */
-		if (software->swdesc_max_size && fdh.size >= software->swdesc_max_size) {
-			ERROR("sw-description size (%ld) exceeds configured max of %d, aborting",
-				fdh.size, software->swdesc_max_size);
+		if (fdh.size >= swdesc_max_size(software)) {
+			ERROR("sw-description size (%ld) exceeds max of %d, aborting",
+				fdh.size, swdesc_max_size(software));
 			ret = -EINVAL;
 			goto no_copy_output;
 		}
@@ -528,32 +744,15 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	lseek(tmpfd, 0, SEEK_SET);
 	offset = 0;
 
-	if (extract_file_to_tmp(tmpfd, SW_DESCRIPTION_FILENAME, &offset,
-				encrypted_sw_desc, software->swdesc_max_size) < 0) {
-		ERROR("%s cannot be extracted", SW_DESCRIPTION_FILENAME);
-		ret = -EINVAL;
-		goto no_copy_output;
-	}
-#ifdef CONFIG_SIGNED_IMAGES
-	snprintf(output_file, sizeof(output_file), "%s.sig", SW_DESCRIPTION_FILENAME);
-	if (extract_file_to_tmp(tmpfd, output_file, &offset, false,
-				software->swdesc_max_size) < 0 ) {
-		ERROR("Signature cannot be extracted:%s", output_file);
+	if (extract_sw_description(tmpfd, &offset, software, encrypted_sw_desc)) {
 		ret = -EINVAL;
 		goto no_copy_output;
 	}
 
-#endif
-	snprintf(output_file, sizeof(output_file), "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME);
-	if (parse(software, output_file)) {
-		ERROR("Compatible SW not found");
-		ret = -1;
-		goto no_copy_output;
-	}
-
 	/*
-	 * if all is ok, copy the first part of SWU (stored in tmp file)
-	 * into the output
+	 * if all is ok, the first part of SWU (stored in tmp file)
+	 * and then the rest of the stream are copied into the output
+	 * while the installer reads them
 	 */
 	lseek(tmpfd, 0, SEEK_SET);
 
@@ -562,21 +761,22 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	 * Try to create directory if file cannot be opened
 	 */
 	if (fdout < 0) {
+		ret = -1;
 		if (mkpath(software->output, 0755))
-			return -1;
+			goto no_copy_output;
 		fdout = openfileoutput(software->output);
 		if (fdout < 0)
-			return -1;
+			goto no_copy_output;
 	}
 
-	ret = cpfiles(tmpfd, fdout, 0);
-	if (ret < 0)
-		goto no_copy_output;
-
-	ret = cpfiles(fdin, fdout, 0);
+	ret = stream_tee_start(tee, fdin, tmpfd, fdout);
 	if (ret < 0)
 		goto no_copy_output;
 
+	/* the worker owns the file descriptors now */
+	unlink(tmpfilename);
+	tmpfd = -1;
+	fdout = -1;
 	ret = 0;
 
 no_copy_output:
@@ -599,6 +799,7 @@ void *network_initializer(void *data)
 	struct swupdate_cfg *software = data;
 	struct swupdate_request *req;
 	struct swupdate_parms parms;
+	struct stream_tee tee = { .running = false };
 	bool do_reboot = true;
 
 	/* No installation in progress */
@@ -669,22 +870,17 @@ void *network_initializer(void *data)
 		 * Check if the stream should be saved
 		 */
 		if (!req->disable_store_swu  && strlen(software->output)) {
-			ret = save_stream(inst.fd, software);
+			ret = save_stream(inst.fd, software, &tee);
 			if (ret < 0) {
 				notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL,
 					"Error saving stream, not installing ...");
-			}
-
-			/*
-			 * now replace the file descriptor with
-			 * the saved file
-			 */
-			if (!(inst.fd < 0))
-				close(inst.fd);
-			inst.fd = open(software->output, O_RDONLY,  S_IRUSR);
-			if (inst.fd < 0) {
-				ERROR("%s cannot be opened", software->output);
-				ret = -ENODEV;
+			} else {
+				/*
+				 * now replace the file descriptor: the SWU
+				 * is read while it is saved, the input
+				 * is closed by the worker
+				 */
+				inst.fd = tee.installfd;
 			}
 		}
 
@@ -702,6 +898,15 @@ void *network_initializer(void *data)
 		if (!(inst.fd < 0))
 			close(inst.fd);
 
+		/*
+		 * Images are installed only after the
+		 * SWU is completely saved
+		 */
+		if (tee.running && stream_tee_finish(&tee) < 0 && !ret) {
+			ERROR("SWU cannot be saved to %s", software->output);
+			ret = -EIO;
+		}
+
 		if (!software->parms.dry_run && is_bootloader(BOOTLOADER_EBG)) {
 			if (!software->bootloader_transaction_marker) {
 				/*
@@ -763,6 +968,7 @@ void *network_initializer(void *data)
 			}
 
 			ret = install_images(software);
+			install_stats_report(&software->images);
 			if (ret != 0) {
 				update_transaction_state(software, STATE_FAILED);
 				notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL, "Installation failed !");
@@ -0,0 +1,150 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "strpool.h"
+
+#define STRPOOL_BLOCK_SIZE	4096
+#define STRPOOL_HASH_MIN	256
+
+struct strpool_block {
+	struct strpool_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+static struct strpool_block *blocks;
+static const char **table;	/* open addressing, at most half full */
+static size_t table_size;
+static size_t count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+static size_t hash_str(const char *s)
+{
+	size_t h = 2166136261U;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static const char **find_slot(const char **t, size_t size, const char *s)
+{
+	size_t mask = size - 1;
+	size_t i = hash_str(s) & mask;
+
+	while (t[i] && strcmp(t[i], s))
+		i = (i + 1) & mask;
+
+	return &t[i];
+}
+
+static int grow_table(void)
+{
+	size_t size = table_size ? table_size * 2 : STRPOOL_HASH_MIN;
+	const char **t = calloc(size, sizeof(*t));
+
+	if (!t)
+		return -1;
+
+	for (size_t i = 0; i < table_size; i++)
+		if (table[i])
+			*find_slot(t, size, table[i]) = table[i];
+	free(table);
+	table = t;
+	table_size = size;
+
+	return 0;
+}
+
+static char *pool_alloc(size_t len)
+{
+	struct strpool_block *b = blocks;
+	char *p;
+
+	if (!b || b->size - b->used < len) {
+		size_t size = len > STRPOOL_BLOCK_SIZE ? len : STRPOOL_BLOCK_SIZE;
+
+		b = malloc(sizeof(*b) + size);
+		if (!b)
+			return NULL;
+		b->used = 0;
+		b->size = size;
+		/* a block for a long string does not become the current one */
+		if (blocks && len > STRPOOL_BLOCK_SIZE) {
+			b->next = blocks->next;
+			blocks->next = b;
+		} else {
+			b->next = blocks;
+			blocks = b;
+		}
+	}
+	p = b->data + b->used;
+	b->used += len;
+
+	return p;
+}
+
+/*
+ * Return the copy of s in the pool, NULL
+ * if there is no memory. s can be freed.
+ */
+const char *strpool_intern(const char *s)
+{
+	const char **slot;
+	size_t len;
+	char *p = NULL;
+
+	if (!s)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	if ((count + 1) * 2 > table_size && grow_table())
+		goto out;
+
+	slot = find_slot(table, table_size, s);
+	if (*slot) {
+		p = (char *)*slot;
+		goto out;
+	}
+
+	len = strlen(s) + 1;
+	p = pool_alloc(len);
+	if (!p)
+		goto out;
+	memcpy(p, s, len);
+	*slot = p;
+	count++;
+
+out:
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+void strpool_release(void)
+{
+	struct strpool_block *b, *next;
+
+	pthread_mutex_lock(&lock);
+	for (b = blocks; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	blocks = NULL;
+	free(table);
+	table = NULL;
+	table_size = 0;
+	count = 0;
+	pthread_mutex_unlock(&lock);
+}
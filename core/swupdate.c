@@ -43,6 +43,7 @@
 #include "suricatta/suricatta.h"
 #include "delta_process.h"
 #include "progress.h"
+#include "install_stats.h"
 #include "parselib.h"
 #include "swupdate_settings.h"
 #include "pctl.h"
@@ -300,10 +301,10 @@ static void swupdate_init(struct swupdate_cfg *sw)
 	LIST_INIT(&sw->images);
 	LIST_INIT(&sw->hardware);
 	LIST_INIT(&sw->scripts);
-	LIST_INIT(&sw->bootloader);
+	dict_init(&sw->bootloader);
 	LIST_INIT(&sw->extprocs);
 	LIST_INIT(&sw->swupdate_types);
-	LIST_INIT(&sw->external_urls);
+	dict_init(&sw->external_urls);
 	strlcpy(update_type->type_name, "default", sizeof(update_type->type_name));
 	LIST_INSERT_HEAD(&sw->swupdate_types, update_type, next);
 	sw->update_type = update_type;
@@ -375,6 +376,8 @@ static int read_globals_settings(void *elem, void *data)
 {
 	char tmp[SWUPDATE_GENERAL_STRING_SIZE] = "";
 	struct swupdate_cfg *sw = (struct swupdate_cfg *)data;
+	bool stats_enabled = false;
+	bool async_notify = false;
 
 	GET_FIELD_STRING(LIBCFG_PARSER, elem,
 				"bootloader", tmp);
@@ -446,6 +449,36 @@ static int read_globals_settings(void *elem, void *data)
 				"gpgme-protocol", sw->gpgme_protocol);
 	GET_FIELD_INT(LIBCFG_PARSER, elem, "sw-description-max-size",
 				&sw->swdesc_max_size);
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "threaded-pipeline",
+				&sw->threaded_pipeline);
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "install-workers",
+				&sw->install_workers);
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "verify-skipped-checksum",
+				&sw->verify_skipped_checksum);
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "install-stats", &stats_enabled);
+	install_stats_enable(stats_enabled);
+	GET_FIELD_BOOL(LIBCFG_PARSER, elem, "async-notify", &async_notify);
+	notifier_set_async(async_notify);
+	if (is_field_numeric(LIBCFG_PARSER, elem, "buffer-size")) {
+		long long bufsize = 0;
+
+		GET_FIELD_INT64(LIBCFG_PARSER, elem, "buffer-size", &bufsize);
+		if (bufsize >= IO_BUFFER_SIZE_MIN && bufsize <= IO_BUFFER_SIZE_MAX)
+			set_io_buffer_size(bufsize);
+		else
+			WARN("buffer-size %lld out of range, ignored", bufsize);
+	} else {
+		size_t bufsize;
+
+		tmp[0] = '\0';
+		GET_FIELD_STRING(LIBCFG_PARSER, elem, "buffer-size", tmp);
+		if (tmp[0] != '\0') {
+			if (!buffer_size_from_string(tmp, &bufsize))
+				set_io_buffer_size(bufsize);
+			else
+				WARN("buffer-size '%s' invalid, ignored", tmp);
+		}
+	}
 
 
 	read_updatetype_settings(elem, sw->update_type);
@@ -475,6 +508,19 @@ static int read_console_settings(void *elem, void __attribute__ ((__unused__)) *
 	return 0;
 }
 
+static int read_delta_settings(void *elem, void *data)
+{
+	struct swupdate_cfg *sw = (struct swupdate_cfg *)data;
+
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "index-workers",
+				&sw->delta_index_workers);
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "download-window",
+				&sw->delta_download_window);
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "download-buffer",
+				&sw->delta_download_buffer);
+	return 0;
+}
+
 static int read_processes_settings(void *settings, void *data)
 {
 	struct swupdate_cfg *sw = (struct swupdate_cfg *)data;
@@ -747,6 +793,7 @@ int main(int argc, char **argv)
 		 */
 		(void)read_module_settings(&handle, "logcolors", read_console_settings, &swcfg);
 		(void)read_module_settings(&handle, "processes", read_processes_settings, &swcfg);
+		(void)read_module_settings(&handle, "delta", read_delta_settings, &swcfg);
 	}
 
 	/*
@@ -54,6 +54,148 @@ static void remove_list(struct dict_list *list)
 	}
 }
 
+/*
+ * Dictionaries with more entries than this get an index,
+ * small ones (most of the image properties) are just walked
+ */
+#define DICT_INDEX_MIN	8
+
+/*
+ * Open addressing with linear probing, the table
+ * is kept at most half full.
+ * The index is changed only when an entry is inserted or
+ * removed, never by a lookup. A dictionary can have one
+ * writer inserting entries and readers at the same time
+ * (external_urls): entries are published with release
+ * semantic and a grown index keeps the previous one
+ * allocated till the dictionary is dropped.
+ */
+struct dict_index {
+	unsigned int size;	/* power of 2 */
+	unsigned int count;
+	struct dict_index *retired;	/* previous, smaller index */
+	struct dict_entry *slots[];
+};
+
+/* FNV-1a */
+static unsigned int hash_key(const char *key)
+{
+	unsigned int h = 2166136261U;
+
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static void index_add(struct dict_index *index, struct dict_entry *entry)
+{
+	unsigned int mask = index->size - 1;
+	unsigned int i = entry->hash & mask;
+
+	while (index->slots[i])
+		i = (i + 1) & mask;
+	__atomic_store_n(&index->slots[i], entry, __ATOMIC_RELEASE);
+	index->count++;
+}
+
+static void free_index(struct dict_index *index)
+{
+	struct dict_index *retired;
+
+	while (index) {
+		retired = index->retired;
+		free(index);
+		index = retired;
+	}
+}
+
+/*
+ * Build the index with room for at least count entries,
+ * the current index is kept if it fails
+ */
+static int build_index(struct dict *dictionary, unsigned int count)
+{
+	struct dict_index *index;
+	struct dict_entry *entry;
+	unsigned int size = DICT_INDEX_MIN * 4;
+
+	while (size < count * 2)
+		size *= 2;
+
+	index = calloc(1, sizeof(*index) + size * sizeof(index->slots[0]));
+	if (!index)
+		return -ENOMEM;
+
+	index->size = size;
+	index->retired = dictionary->index;
+	LIST_FOREACH(entry, dictionary, next)
+		index_add(index, entry);
+	__atomic_store_n(&dictionary->index, index, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void index_insert(struct dict *dictionary, struct dict_entry *entry)
+{
+	struct dict_index *index = dictionary->index;
+	struct dict_entry *e;
+	unsigned int n = 0;
+
+	if (!index) {
+		/* the entry is already in the list */
+		LIST_FOREACH(e, dictionary, next)
+			if (++n > DICT_INDEX_MIN)
+				break;
+		if (n > DICT_INDEX_MIN)
+			(void)build_index(dictionary, n);
+		return;
+	}
+	/* the entry is already in the list */
+	if ((index->count + 1) * 2 > index->size &&
+	    !build_index(dictionary, index->size))
+		return;
+	/* a free slot must be left to end the probing */
+	if (index->count + 2 > index->size) {
+		dictionary->index = NULL;
+		free_index(index);
+		return;
+	}
+	index_add(index, entry);
+}
+
+static void index_remove(struct dict *dictionary, struct dict_entry *entry)
+{
+	struct dict_index *index = dictionary->index;
+	unsigned int mask, i, j, k;
+
+	if (!index)
+		return;
+
+	mask = index->size - 1;
+	for (i = entry->hash & mask; index->slots[i] != entry; i = (i + 1) & mask)
+		if (!index->slots[i])
+			return;
+
+	/*
+	 * Move back the entries of the same cluster that
+	 * cannot be found anymore after the hole
+	 */
+	index->slots[i] = NULL;
+	index->count--;
+	for (j = (i + 1) & mask; index->slots[j]; j = (j + 1) & mask) {
+		k = index->slots[j]->hash & mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			index->slots[i] = index->slots[j];
+			index->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
 static struct dict_entry *insert_entry(struct dict *dictionary, const char *key)
 {
 	struct dict_entry *entry = (struct dict_entry *)malloc(sizeof(*entry));
@@ -62,8 +204,14 @@ static struct dict_entry *insert_entry(struct dict *dictionary, const char *key)
 
 	memset(entry, 0, sizeof(*entry));
 	entry->key = strdup(key);
+	if (!entry->key) {
+		free(entry);
+		return NULL;
+	}
+	entry->hash = hash_key(key);
 
 	LIST_INSERT_HEAD(dictionary, entry, next);
+	index_insert(dictionary, entry);
 
 	return entry;
 }
@@ -71,23 +219,55 @@ static struct dict_entry *insert_entry(struct dict *dictionary, const char *key)
 static struct dict_entry *get_entry(struct dict *dictionary, const char *key)
 {
 	struct dict_entry *entry;
+	struct dict_index *index;
+	unsigned int h = hash_key(key);
+	unsigned int mask, i;
+
+	index = __atomic_load_n(&dictionary->index, __ATOMIC_ACQUIRE);
+	if (index) {
+		mask = index->size - 1;
+		for (i = h & mask;
+		     (entry = __atomic_load_n(&index->slots[i], __ATOMIC_ACQUIRE));
+		     i = (i + 1) & mask) {
+			if (entry->hash == h && strcmp(key, entry->key) == 0)
+				return entry;
+		}
+		return NULL;
+	}
 
 	LIST_FOREACH(entry, dictionary, next) {
-		if (strcmp(key, entry->key) == 0)
+		if (entry->hash == h && strcmp(key, entry->key) == 0)
 			return entry;
 	}
 
 	return NULL;
 }
 
-static void remove_entry(struct dict_entry *entry)
+static void remove_entry(struct dict *dictionary, struct dict_entry *entry)
 {
+	index_remove(dictionary, entry);
 	LIST_REMOVE(entry, next);
 	free(entry->key);
 	remove_list(&entry->list);
 	free(entry);
 }
 
+void dict_init(struct dict *dictionary)
+{
+	LIST_INIT(dictionary);
+	dictionary->index = NULL;
+}
+
+/*
+ * The copy shares the entries with src and must not be
+ * dropped, lookups in the copy walk the list
+ */
+void dict_shallow_copy(struct dict *dst, const struct dict *src)
+{
+	dst->lh_first = src->lh_first;
+	dst->index = NULL;
+}
+
 char *dict_entry_get_key(struct dict_entry *entry)
 {
 	if (!entry)
@@ -142,7 +322,7 @@ int dict_set_value(struct dict *dictionary, const char *key, const char *value)
 	struct dict_entry *entry = get_entry(dictionary, key);
 
 	if (entry)
-		remove_entry(entry);
+		remove_entry(dictionary, entry);
 
 	entry = insert_entry(dictionary, key);
 	if (!entry)
@@ -158,7 +338,7 @@ void dict_remove(struct dict *dictionary, const char *key)
 	if (!entry)
 		return;
 
-	remove_entry(entry);
+	remove_entry(dictionary, entry);
 }
 
 void dict_drop_db(struct dict *dictionary)
@@ -166,8 +346,10 @@ void dict_drop_db(struct dict *dictionary)
 	struct dict_entry *entry;
 	struct dict_entry *tmp;
 
+	free_index(dictionary->index);
+	dictionary->index = NULL;
 	LIST_FOREACH_SAFE(entry, dictionary, next, tmp) {
-		remove_entry(entry);
+		remove_entry(dictionary, entry);
 	}
 }
 
@@ -13,7 +13,7 @@ static void syslog_notifier(RECOVERY_STATUS status, int error, int level, const
 int syslog_init(void)
 {
    setlogmask(LOG_UPTO(LOG_DEBUG));
-   return register_notifier(syslog_notifier);
+   return register_notifier_ext(syslog_notifier, NOTIFY_LOSSY);
 }
 
 void syslog_notifier(RECOVERY_STATUS status, int error, int level, const char *msg)
@@ -18,6 +18,9 @@
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
 #include <sys/mount.h>
 #include <sys/time.h>
 #include <sys/uio.h>
@@ -973,6 +976,13 @@ size_t snescape(char *dst, size_t n, const char *src)
 	memset(dst, 0, n);
 
 	for (int i = 0; src[i] != '\0'; i++) {
+		/* control characters are not allowed in a JSON string */
+		if ((unsigned char)src[i] < 0x20) {
+			if (len + 6 < n)
+				snprintf(&dst[len], 7, "\\u%04x", (unsigned char)src[i]);
+			len += 6;
+			continue;
+		}
 		if (src[i] == '\\' || src[i] == '\"') {
 			if (len < n - 2)
 				dst[len] = '\\';
@@ -1368,3 +1378,124 @@ bool is_filename_valid (const char *file_name)
 {
 	return file_name != NULL && file_name[0] != '/' && strstr(file_name, "../") == NULL;
 }
+
+/*
+ * Size of the buffers used to stream artifacts,
+ * it can be set globally in swupdate.cfg
+ */
+static size_t io_buffer_size = IO_BUFFER_SIZE_DEFAULT;
+
+int buffer_size_from_string(const char *s, size_t *size)
+{
+	unsigned long long val;
+
+	if (!s || !size)
+		return -EINVAL;
+
+	if (!strcmp(s, "auto")) {
+		*size = IO_BUFFER_SIZE_AUTO;
+		return 0;
+	}
+
+	val = ustrtoull(s, NULL, 0);
+	if (errno || val < IO_BUFFER_SIZE_MIN || val > IO_BUFFER_SIZE_MAX)
+		return -EINVAL;
+
+	*size = val;
+	return 0;
+}
+
+void set_io_buffer_size(size_t size)
+{
+	io_buffer_size = size ? size : IO_BUFFER_SIZE_DEFAULT;
+}
+
+size_t get_io_buffer_size(void)
+{
+	return resolve_io_buffer_size(0, -1);
+}
+
+static unsigned long read_sysfs_ulong(const char *fmt, unsigned int major,
+				      unsigned int minor)
+{
+	char path[128];
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	if (snprintf(path, sizeof(path), fmt, major, minor) >= (int)sizeof(path))
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	return strtoul(buf, NULL, 10);
+}
+
+/*
+ * Find the preferred size for writing to fd: for block devices,
+ * this is the largest of the optimal I/O size and the erase block
+ * size (eMMC) as exported by sysfs. Partitions have no queue
+ * directory, the values of the parent disk are taken.
+ */
+static size_t get_device_io_size(int fd)
+{
+	struct stat st;
+	unsigned long size = 0;
+
+	if (fd < 0 || fstat(fd, &st))
+		return 0;
+
+	if (!S_ISBLK(st.st_mode))
+		return st.st_blksize;
+
+#if defined(__linux__)
+	static const char *attrs[] = {
+		"/sys/dev/block/%u:%u/queue/optimal_io_size",
+		"/sys/dev/block/%u:%u/../queue/optimal_io_size",
+		"/sys/dev/block/%u:%u/queue/minimum_io_size",
+		"/sys/dev/block/%u:%u/../queue/minimum_io_size",
+		"/sys/dev/block/%u:%u/device/preferred_erase_size",
+		"/sys/dev/block/%u:%u/../device/preferred_erase_size",
+	};
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(attrs); i++)
+		size = max(size, read_sysfs_ulong(attrs[i],
+						  major(st.st_rdev),
+						  minor(st.st_rdev)));
+#endif
+
+	return size ? size : st.st_blksize;
+}
+
+/*
+ * Return the buffer size to be used for an artifact:
+ * size is the value requested for the artifact, 0 if the global
+ * setting must be used. In adaptive mode, the default size grows
+ * toward the preferred I/O size of the output fd, if known.
+ */
+size_t resolve_io_buffer_size(size_t size, int fd)
+{
+	size_t devsize;
+
+	if (!size)
+		size = io_buffer_size;
+
+	if (size != IO_BUFFER_SIZE_AUTO) {
+		size = max_t(size_t, size, IO_BUFFER_SIZE_MIN);
+		return min_t(size_t, size, IO_BUFFER_SIZE_MAX);
+	}
+
+	size = IO_BUFFER_SIZE_DEFAULT;
+	devsize = get_device_io_size(fd);
+	if (devsize > size)
+		size = min_t(size_t, ROUND_UP(devsize, IO_BUFFER_SIZE_MIN),
+			     IO_BUFFER_SIZE_MAX);
+
+	return size;
+}
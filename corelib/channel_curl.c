@@ -52,6 +52,7 @@ typedef struct {
 	int output;
 	output_data_t *outdata;
 	channel_t *this;
+	channel_op_res_t result;	/* error in the write callback */
 } write_callback_t;
 
 typedef struct {
@@ -173,7 +174,6 @@ channel_op_res_t channel_open(channel_t *this, void *cfg)
 	return CHANNEL_OK;
 }
 
-static channel_op_res_t result_channel_callback_ipc;
 size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 				   write_callback_t *data)
 {
@@ -182,14 +182,14 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 	}
 	if (!data)
 		return 0;
-	result_channel_callback_ipc = CHANNEL_OK;
+	data->result = CHANNEL_OK;
 
 	if (data->channel_data->usessl) {
 		if (swupdate_HASH_update(data->channel_data->dgst,
 					 streamdata,
 					 size * nmemb) < 0) {
 			ERROR("Updating checksum of chunk failed.");
-			result_channel_callback_ipc = CHANNEL_EIO;
+			data->result = CHANNEL_EIO;
 			return 0;
 		}
 	}
@@ -201,7 +201,7 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 		ipc_send_data(data->output, streamdata, (int)(size * nmemb)) <
 	    0) {
 		ERROR("Writing into SWUpdate IPC stream failed.");
-		result_channel_callback_ipc = CHANNEL_EIO;
+		data->result = CHANNEL_EIO;
 		return 0;
 	}
 
@@ -217,12 +217,12 @@ size_t channel_callback_ipc(void *streamdata, size_t size, size_t nmemb,
 	return size * nmemb;
 }
 
-#define BUFF_SIZE 16384
 static unsigned long long int resume_cache_file(const char *fname,
 					  write_callback_t *data)
 {
 	int fdsw;
 	char *buf;
+	size_t bufsize;
 	ssize_t cnt;
 	unsigned long long processed = 0;
 
@@ -231,14 +231,15 @@ static unsigned long long int resume_cache_file(const char *fname,
 	fdsw = open(fname, O_RDONLY);
 	if (fdsw < 0)
 		return 0; /* ignore, load from network */
-	buf = calloc(1, BUFF_SIZE);
+	bufsize = get_io_buffer_size();
+	buf = calloc(1, bufsize);
 	if (!buf) {
 		ERROR("Channel get operation failed with OOM");
 		close(fdsw);
 		return 0;
 	}
 
-	while ((cnt = read(fdsw, buf, BUFF_SIZE)) > 0) {
+	while ((cnt = read(fdsw, buf, bufsize)) > 0) {
 		if (!channel_callback_ipc(buf, cnt, 1, data))
 			break;
 		processed += cnt;
@@ -1378,7 +1379,7 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 	}
 
 	wrdata.output = file_handle;
-	result_channel_callback_ipc = CHANNEL_OK;
+	wrdata.result = CHANNEL_OK;
 
 	if ((curl_easy_setopt(channel_curl->handle, CURLOPT_WRITEFUNCTION,
 			      channel_callback_ipc) != CURLE_OK) ||
@@ -1506,7 +1507,7 @@ channel_op_res_t channel_get_file(channel_t *this, void *data)
 
 	channel_log_reply(result, channel_data, NULL);
 
-	if (result_channel_callback_ipc != CHANNEL_OK) {
+	if (wrdata.result != CHANNEL_OK) {
 		result = CHANNEL_EIO;
 		goto cleanup_file;
 	}
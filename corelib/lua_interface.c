@@ -297,15 +297,16 @@ static void lua_set_compressed_string(struct img_type *img, const char *value)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_name, id.name)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_version, id.version)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_filename, fname)
-DEFINE_IMG_STRLCPY_SETTER(lua_set_volume, volname)
+DEFINE_IMG_STRPOOL_SETTER(lua_set_volume, volname)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_type, type)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_device, device)
-DEFINE_IMG_STRLCPY_SETTER(lua_set_mtdname, mtdname)
+DEFINE_IMG_STRPOOL_SETTER(lua_set_mtdname, mtdname)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_path, path)
-DEFINE_IMG_STRLCPY_SETTER(lua_set_data, type_data)
-DEFINE_IMG_STRLCPY_SETTER(lua_set_filesystem, filesystem)
+DEFINE_IMG_STRPOOL_SETTER(lua_set_data, type_data)
+DEFINE_IMG_STRPOOL_SETTER(lua_set_filesystem, filesystem)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_ivt, ivt_ascii)
 DEFINE_IMG_STRLCPY_SETTER(lua_set_aes_key, aes_ascii)
+DEFINE_IMG_STRPOOL_SETTER(lua_set_install_after, install_after)
 
 static void lua_set_sha256(struct img_type *img, const char *value)
 {
@@ -325,6 +326,12 @@ static void lua_set_offset_string(struct img_type *img, const char *value)
 	}
 }
 
+static void lua_set_buffer_size_string(struct img_type *img, const char *value)
+{
+	if (buffer_size_from_string(value, &img->buffer_size) < 0)
+		ERROR("buffer_size '%s' invalid, ignored", value);
+}
+
 static const struct lua_img_string_handler_entry lua_string_handlers[] = {
 	{ "compressed", lua_set_compressed_string },
 	{ "name", lua_set_name },
@@ -341,6 +348,8 @@ static const struct lua_img_string_handler_entry lua_string_handlers[] = {
 	{ "ivt", lua_set_ivt },
 	{ "aes-key", lua_set_aes_key },
 	{ "offset", lua_set_offset_string },
+	{ "install_after", lua_set_install_after },
+	{ "buffer_size", lua_set_buffer_size_string },
 };
 
 /**
@@ -370,6 +379,8 @@ DEFINE_IMG_BOOL_SETTER(lua_set_encrypted, is_encrypted)
 DEFINE_IMG_BOOL_SETTER(lua_set_partition, is_partitioner)
 DEFINE_IMG_BOOL_SETTER(lua_set_script, is_script)
 DEFINE_IMG_BOOL_SETTER(lua_set_preserve_attributes, preserve_attributes)
+DEFINE_IMG_BOOL_SETTER(lua_set_threaded_pipeline, threaded_pipeline)
+DEFINE_IMG_BOOL_SETTER(lua_set_install_sequential, install_sequential)
 
 static const struct lua_img_bool_handler_entry lua_bool_handlers[] = {
 	{ "compressed", lua_set_compressed_bool },
@@ -380,6 +391,8 @@ static const struct lua_img_bool_handler_entry lua_bool_handlers[] = {
 	{ "partition", lua_set_partition },
 	{ "script", lua_set_script },
 	{ "preserve_attributes", lua_set_preserve_attributes },
+	{ "threaded_pipeline", lua_set_threaded_pipeline },
+	{ "install_sequential", lua_set_install_sequential },
 };
 
 static void lua_bool_to_img(struct img_type *img, const char *key,
@@ -400,11 +413,30 @@ DEFINE_IMG_NUMBER_SETTER(lua_set_size, size, long long)
 DEFINE_IMG_NUMBER_SETTER(lua_set_checksum, checksum, unsigned int)
 DEFINE_IMG_NUMBER_SETTER(lua_set_skip, skip, unsigned int)
 
+/*
+ * buffer_size is checked against the same limits as "buffer-size"
+ * in sw-description: 0 selects the global setting, the value pushed
+ * for "auto" is accepted back.
+ */
+static void lua_set_buffer_size(struct img_type *img, double val)
+{
+	if (val >= (double)IO_BUFFER_SIZE_AUTO) {
+		img->buffer_size = IO_BUFFER_SIZE_AUTO;
+		return;
+	}
+	if (val != 0 && (val < IO_BUFFER_SIZE_MIN || val > IO_BUFFER_SIZE_MAX)) {
+		ERROR("buffer_size %.0f out of range, ignored", val);
+		return;
+	}
+	img->buffer_size = (size_t)val;
+}
+
 static const struct lua_img_number_handler_entry lua_number_handlers[] = {
 	{ "offset", lua_set_offset_number },
 	{ "size", lua_set_size },
 	{ "checksum", lua_set_checksum },
 	{ "skip", lua_set_skip },
+	{ "buffer_size", lua_set_buffer_size },
 };
 
 static void lua_number_to_img(struct img_type *img, const char *key,
@@ -435,9 +467,10 @@ static int l_copy2file(lua_State *L)
 	}
 
 	struct img_type img = {};
-	uint32_t image_checksum = img.checksum;
+	uint32_t image_checksum;
 
 	table2image(L, &img);
+	image_checksum = img.checksum;
 	if (check_same_file(img.fdin, fdout)) {
 		lua_pop(L, 1);
 		lua_pushinteger(L, -1);
@@ -511,11 +544,12 @@ static int l_istream_read(lua_State* L)
 	luaL_checktype(L, 2, LUA_TFUNCTION);
 
 	struct img_type img = {};
-	uint32_t image_checksum = img.checksum;
+	uint32_t image_checksum;
 
 	lua_pushvalue(L, 1);
 	table2image(L, &img);
 	lua_pop(L, 1);
+	image_checksum = img.checksum;
 
 	int ret = copyimage(L, &img, istream_read_callback);
 
@@ -549,15 +583,16 @@ static void update_table(lua_State* L, struct img_type *img)
 		LUA_PUSH_IMG_STRING(img, "name", id.name);
 		LUA_PUSH_IMG_STRING(img, "version", id.version);
 		LUA_PUSH_IMG_STRING(img, "filename", fname);
-		LUA_PUSH_IMG_STRING(img, "volume", volname);
+		LUA_PUSH_IMG_STRING_VALUE(img, "volume", IMG_STR(img->volname));
 		LUA_PUSH_IMG_STRING(img, "type", type);
 		LUA_PUSH_IMG_STRING(img, "device", device);
 		LUA_PUSH_IMG_STRING(img, "path", path);
-		LUA_PUSH_IMG_STRING(img, "mtdname", mtdname);
-		LUA_PUSH_IMG_STRING(img, "data", type_data);
-		LUA_PUSH_IMG_STRING(img, "filesystem", filesystem);
+		LUA_PUSH_IMG_STRING_VALUE(img, "mtdname", IMG_STR(img->mtdname));
+		LUA_PUSH_IMG_STRING_VALUE(img, "data", IMG_STR(img->type_data));
+		LUA_PUSH_IMG_STRING_VALUE(img, "filesystem", IMG_STR(img->filesystem));
 		LUA_PUSH_IMG_STRING(img, "ivt", ivt_ascii);
 		LUA_PUSH_IMG_STRING(img, "aes-key", aes_ascii);
+		LUA_PUSH_IMG_STRING_VALUE(img, "install_after", IMG_STR(img->install_after));
 
 		LUA_PUSH_IMG_BOOL(img, "installed_directly", install_directly);
 		LUA_PUSH_IMG_BOOL(img, "install_if_different", id.install_if_different);
@@ -566,11 +601,14 @@ static void update_table(lua_State* L, struct img_type *img)
 		LUA_PUSH_IMG_BOOL(img, "partition", is_partitioner);
 		LUA_PUSH_IMG_BOOL(img, "script", is_script);
 		LUA_PUSH_IMG_BOOL(img, "preserve_attributes", preserve_attributes);
+		LUA_PUSH_IMG_BOOL(img, "threaded_pipeline", threaded_pipeline);
+		LUA_PUSH_IMG_BOOL(img, "install_sequential", install_sequential);
 
 		LUA_PUSH_IMG_NUMBER(img, "offset", seek);
 		LUA_PUSH_IMG_NUMBER(img, "size", size);
 		LUA_PUSH_IMG_NUMBER(img, "checksum", checksum);
 		LUA_PUSH_IMG_NUMBER(img, "skip", skip);
+		LUA_PUSH_IMG_NUMBER(img, "buffer_size", buffer_size);
 
 		switch (img->compressed) {
 			case COMPRESSED_ZLIB:
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "swupdate.h"
 #include "swupdate_openssl.h"
 #include "util.h"
@@ -455,27 +456,16 @@ dgst_init_error:
 	return ret;
 }
 
-static int openssl_cms_verify_file(void  *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int cms_verify(struct openssl_digest *dgst, BIO *sig_bio,
+		      BIO *content_bio, const char *signer_name)
 {
 	int status = -EFAULT;
 	CMS_ContentInfo *cms = NULL;
-	BIO *content_bio = NULL;
-
-	struct openssl_digest *dgst = (struct openssl_digest *)ctx;
-
-	/* Open CMS blob that needs to be checked */
-	BIO *sigfile_bio = BIO_new_file(sigfile, "rb");
-	if (!sigfile_bio) {
-		ERROR("%s cannot be opened", sigfile);
-		status = -EBADF;
-		goto out;
-	}
 
 	/* Parse the DER-encoded CMS message */
-	cms = d2i_CMS_bio(sigfile_bio, NULL);
+	cms = d2i_CMS_bio(sig_bio, NULL);
 	if (!cms) {
-		ERROR("%s cannot be parsed as DER-encoded CMS signature blob", sigfile);
+		ERROR("Signature cannot be parsed as DER-encoded CMS blob");
 		status = -EFAULT;
 		goto out;
 	}
@@ -486,14 +476,6 @@ static int openssl_cms_verify_file(void  *ctx, const char *sigfile,
 		goto out;
 	}
 
-	/* Open the content file (data which was signed) */
-	content_bio = BIO_new_file(file, "rb");
-	if (!content_bio) {
-		ERROR("%s cannot be opened", file);
-		status = -EBADF;
-		goto out;
-	}
-
 	/* Then try to verify signature */
 	if (!CMS_verify(cms, NULL, dgst->certs, content_bio,
 			NULL, CMS_BINARY | VERIFY_CMS_FLAGS)) {
@@ -520,6 +502,36 @@ out:
 	if (cms) {
 		CMS_ContentInfo_free(cms);
 	}
+	return status;
+}
+
+static int openssl_cms_verify_file(void  *ctx, const char *sigfile,
+		const char *file, const char *signer_name)
+{
+	int status = -EFAULT;
+	BIO *content_bio = NULL;
+
+	struct openssl_digest *dgst = (struct openssl_digest *)ctx;
+
+	/* Open CMS blob that needs to be checked */
+	BIO *sigfile_bio = BIO_new_file(sigfile, "rb");
+	if (!sigfile_bio) {
+		ERROR("%s cannot be opened", sigfile);
+		status = -EBADF;
+		goto out;
+	}
+
+	/* Open the content file (data which was signed) */
+	content_bio = BIO_new_file(file, "rb");
+	if (!content_bio) {
+		ERROR("%s cannot be opened", file);
+		status = -EBADF;
+		goto out;
+	}
+
+	status = cms_verify(dgst, sigfile_bio, content_bio, signer_name);
+out:
+
 	if (content_bio) {
 		BIO_free(content_bio);
 	}
@@ -529,10 +541,34 @@ out:
 	return status;
 }
 
+static int openssl_cms_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
+{
+	struct openssl_digest *dgst = (struct openssl_digest *)ctx;
+	BIO *sig_bio, *content_bio;
+	int status = -ENOMEM;
+
+	if (siglen > INT_MAX || len > INT_MAX)
+		return -EFBIG;
+
+	/* read-only BIOs on the buffers, nothing is copied */
+	sig_bio = BIO_new_mem_buf(sig, (int)siglen);
+	content_bio = BIO_new_mem_buf(data, (int)len);
+	if (sig_bio && content_bio)
+		status = cms_verify(dgst, sig_bio, content_bio, signer_name);
+
+	BIO_free(content_bio);
+	BIO_free(sig_bio);
+
+	return status;
+}
+
 __attribute__((constructor))
 static void openssl_dgst(void)
 {
 	libs.dgst_init = openssl_cms_dgst_init;
 	libs.verify_file = openssl_cms_verify_file;
+	libs.verify_buf = openssl_cms_verify_buf;
 	(void)register_dgstlib(MODNAME, &libs);
 }
@@ -23,15 +23,11 @@
 
 static swupdate_dgst_lib	libs;
 
-static int mbedtls_rsa_verify_file(void *ctx, const char *sigfile,
-		const char *file, const char *signer_name)
+static int rsa_verify_hash(struct mbedtls_digest *dgst,
+			   const mbedtls_md_info_t *md_info,
+			   const uint8_t *hash, size_t hashlen,
+			   const unsigned char *sig, size_t siglen)
 {
-	struct mbedtls_digest *dgst = (struct mbedtls_digest *)ctx;
-	unsigned char *sigbuf = NULL;
-	size_t sigbuf_len = 0;
-	int error;
-	uint8_t hash_computed[32];
-	const mbedtls_md_info_t *md_info;
 	mbedtls_pk_type_t pk_type = MBEDTLS_PK_RSA;
 	void *pss_options = NULL;
 	mbedtls_pk_rsassa_pss_options options = {
@@ -43,6 +39,23 @@ static int mbedtls_rsa_verify_file(void *ctx, const char *sigfile,
 		pss_options = &options;
 	}
 
+	return mbedtls_pk_verify_ext(
+		pk_type, pss_options,
+		&dgst->mbedtls_pk_context, mbedtls_md_get_type(md_info),
+		hash, hashlen,
+		sig, siglen);
+}
+
+static int mbedtls_rsa_verify_file(void *ctx, const char *sigfile,
+		const char *file, const char *signer_name)
+{
+	struct mbedtls_digest *dgst = (struct mbedtls_digest *)ctx;
+	unsigned char *sigbuf = NULL;
+	size_t sigbuf_len = 0;
+	int error;
+	uint8_t hash_computed[32];
+	const mbedtls_md_info_t *md_info;
+
 	(void)signer_name;
 
 	md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
@@ -64,15 +77,41 @@ static int mbedtls_rsa_verify_file(void *ctx, const char *sigfile,
 		return error;
 	}
 
-	int ret = mbedtls_pk_verify_ext(
-		pk_type, pss_options,
-		&dgst->mbedtls_pk_context, mbedtls_md_get_type(md_info),
-		hash_computed, sizeof(hash_computed),
-		sigbuf, sigbuf_len);
+	int ret = rsa_verify_hash(dgst, md_info, hash_computed,
+				  sizeof(hash_computed), sigbuf, sigbuf_len);
 	free(sigbuf);
 	return ret;
 }
 
+static int mbedtls_rsa_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
+{
+	struct mbedtls_digest *dgst = (struct mbedtls_digest *)ctx;
+	int error;
+	uint8_t hash_computed[32];
+	const mbedtls_md_info_t *md_info;
+
+	(void)signer_name;
+
+	md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+	if (!md_info) {
+		ERROR("mbedtls_md_info_from_type");
+		return -ENOENT;
+	}
+
+	assert(mbedtls_md_get_size(md_info) == sizeof(hash_computed));
+
+	error = mbedtls_md(md_info, data, len, hash_computed);
+	if (error) {
+		ERROR("mbedtls_md: %d", error);
+		return error;
+	}
+
+	return rsa_verify_hash(dgst, md_info, hash_computed,
+			       sizeof(hash_computed), sig, siglen);
+}
+
 static int mbedtls_rsa_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 {
 	struct mbedtls_digest *dgst;
@@ -102,6 +141,7 @@ static void mbedtls_rsa_dgst(void)
 {
 	libs.dgst_init = mbedtls_rsa_dgst_init;
 	libs.verify_file = mbedtls_rsa_verify_file;
+	libs.verify_buf = mbedtls_rsa_verify_buf;
 #if defined(CONFIG_SIGALG_RAWRSA)
 	(void)register_dgstlib(MODNAME, &libs);
 #endif
@@ -76,7 +76,7 @@ static int dgst_verify_init(struct openssl_digest *dgst)
 	return 0;
 }
 
-static int verify_update(struct openssl_digest *dgst, char *msg, unsigned int mlen)
+static int verify_update(struct openssl_digest *dgst, const void *msg, size_t mlen)
 {
 	int rc;
 
@@ -89,7 +89,7 @@ static int verify_update(struct openssl_digest *dgst, char *msg, unsigned int ml
 	return 0;
 }
 
-static int verify_final(struct openssl_digest *dgst, unsigned char *sig, unsigned int slen)
+static int verify_final(struct openssl_digest *dgst, const unsigned char *sig, size_t slen)
 {
 	unsigned int rc;
 
@@ -104,6 +104,43 @@ static int verify_final(struct openssl_digest *dgst, unsigned char *sig, unsigne
 	return rc;
 }
 
+static int verify_start(struct openssl_digest *dgst)
+{
+	if (!dgst) {
+		ERROR("Wrong crypto initialization: did you pass the key ?");
+		return -ENOKEY;
+	}
+
+	ERR_clear_error();
+	if (EVP_DigestInit_ex(dgst->ctx, EVP_sha256(), NULL) != 1) {
+		ERROR("EVP_DigestInit_ex failed: %s", ERR_error_string(ERR_get_error(), NULL));
+		return -ENOKEY;
+	}
+
+	if (dgst_verify_init(dgst) < 0)
+		return -ENOKEY;
+
+	return 0;
+}
+
+static int verify_end(struct openssl_digest *dgst, const unsigned char *sig,
+		      size_t siglen)
+{
+	int i;
+
+	i = verify_final(dgst, sig, siglen);
+	if(i > 0) {
+		TRACE("Verified OK");
+		return 0;
+	} else if(i == 0) {
+		TRACE("Verification Failure");
+		return -EBADMSG;
+	}
+
+	TRACE("Error Verifying Data");
+	return -EFAULT;
+}
+
 static int openssl_rsa_verify_file(void *ctx, const char *sigfile,
 		const char *file, const char *signer_name)
 {
@@ -111,7 +148,6 @@ static int openssl_rsa_verify_file(void *ctx, const char *sigfile,
 	FILE *fp = NULL;
 	BIO *sigbio;
 	int siglen = 0;
-	int i;
 	unsigned char *sigbuf = NULL;
 	char *msg = NULL;
 	int size;
@@ -144,17 +180,9 @@ static int openssl_rsa_verify_file(void *ctx, const char *sigfile,
 		goto out;
 	}
 
-	ERR_clear_error();
-	if (EVP_DigestInit_ex(dgst->ctx, EVP_sha256(), NULL) != 1) {
-		ERROR("EVP_DigestInit_ex failed: %s", ERR_error_string(ERR_get_error(), NULL));
-		status = -ENOKEY;
+	status = verify_start(dgst);
+	if (status)
 		goto out;
-	}
-
-	if (dgst_verify_init(dgst) < 0) {
-		status = -ENOKEY;
-		goto out;
-	}
 
 	fp = fopen(file, "r");
 	if (!fp) {
@@ -176,17 +204,7 @@ static int openssl_rsa_verify_file(void *ctx, const char *sigfile,
 	}
 
 	TRACE("Verify signed image: Read %d bytes", size);
-	i = verify_final(dgst, sigbuf, (unsigned int)siglen);
-	if(i > 0) {
-		TRACE("Verified OK");
-		status = 0;
-	} else if(i == 0) {
-		TRACE("Verification Failure");
-		status = -EBADMSG;
-	} else {
-		TRACE("Error Verifying Data");
-		status = -EFAULT;
-	}
+	status = verify_end(dgst, sigbuf, siglen);
 
 out:
 	if (fp)
@@ -199,6 +217,32 @@ out:
 	return status;
 }
 
+static int openssl_rsa_verify_buf(void *ctx, const unsigned char *sig,
+		size_t siglen, const unsigned char *data, size_t len,
+		const char *signer_name)
+{
+	struct openssl_digest *dgst = (struct openssl_digest *)ctx;
+	int status;
+
+	(void)signer_name;
+	status = verify_start(dgst);
+	if (status)
+		return status;
+
+	if (!siglen) {
+		ERROR("Signature is empty");
+		return -ENOKEY;
+	}
+	/* as for a file, what follows the signature is ignored */
+	siglen = min_t(size_t, siglen, EVP_PKEY_size(dgst->pkey));
+
+	if (len && verify_update(dgst, data, len) < 0)
+		return -EFAULT;
+
+	TRACE("Verify signed buffer of %zu bytes", len);
+	return verify_end(dgst, sig, siglen);
+}
+
 static int openssl_rsa_dgst_init(struct swupdate_cfg *sw, const char *keyfile)
 {
 	struct openssl_digest *dgst;
@@ -259,6 +303,7 @@ static void openssl_dgst(void)
 {
 	libs.dgst_init = openssl_rsa_dgst_init;
 	libs.verify_file = openssl_rsa_verify_file;
+	libs.verify_buf = openssl_rsa_verify_buf;
 #if defined(CONFIG_SIGALG_RAWRSA)
 	(void)register_dgstlib(MODNAME, &libs);
 #endif
@@ -235,7 +235,7 @@ static int install_archive_image(struct img_type *img,
 	char pwd[256] = "\0";
 	struct extract_data tf;
 	pthread_attr_t attr;
-	bool use_mount = (strlen(img->device) && strlen(img->filesystem)) ? true : false;
+	bool use_mount = (strlen(img->device) && img->filesystem) ? true : false;
 	int is_mounted = 0;
 	int exitval = -EFAULT;
 	char *DATADST_DIR = NULL;
@@ -257,10 +257,10 @@ static int install_archive_image(struct img_type *img,
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
 	if (use_mount) {
-		DATADST_DIR = swupdate_temporary_mount(MNT_DATA, img->device, img->filesystem);
+		DATADST_DIR = swupdate_temporary_mount(MNT_DATA, img->device, IMG_STR(img->filesystem));
 		if (!DATADST_DIR) {
 			ERROR("Device %s with filesystem %s cannot be mounted",
-				img->device, img->filesystem);
+				img->device, IMG_STR(img->filesystem));
 			exitval = -EINVAL;
 			goto out;
 		}
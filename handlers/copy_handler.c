@@ -68,7 +68,6 @@ static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, str
 	struct mtd_info_user mtdinfo;
 #endif
 	struct chain_handler_data priv;
-	uint32_t checksum;
 	int pipes[2];
 	unsigned long offset = 0;
 	pthread_t chain_handler_thread_id;
@@ -146,6 +145,7 @@ static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, str
 
 	/* Overwrite some parameters for chained handler */
 	memcpy(&priv.img, img, sizeof(*img));
+	dict_shallow_copy(&priv.img.properties, &img->properties);
 	priv.img.compressed = COMPRESSED_FALSE;
 	memset(priv.img.sha256, 0, SHA256_HASH_LENGTH);
 	priv.img.fdin = pipes[PIPE_READ];
@@ -167,7 +167,6 @@ static int copy_single_file(const char *path, off_t skipbytes, ssize_t size, str
 		.out = &fdout,
 		.nbytes = size,
 		.offs = &offset,
-		.checksum = &checksum,
 	};
 	ret = copyfile(&copy);
 
@@ -220,6 +219,7 @@ static int recurse_directory(const char *fpath, const struct stat *sb,
 		break;
 	case FTW_F:
 		memcpy(&cpyimg, base_img, sizeof(cpyimg));
+		dict_shallow_copy(&cpyimg.properties, &base_img->properties);
 		strlcpy(cpyimg.path, dst, sizeof(cpyimg.path));
 
 		/*
@@ -256,11 +256,11 @@ static int copy_image_file(struct img_type *img, void *data)
 
 	base_img = img;
 #ifdef CONFIG_MTD
-	if(strlen(img->mtdname) ){
+	if (img->mtdname) {
 		int mtdnum = get_mtd_from_name(img->mtdname);
 		if (mtdnum < 0) {
 			ERROR("Wrong MTD name in description: %s",
-			      img->mtdname);
+			      IMG_STR(img->mtdname));
 			return -1;
 		}
 		snprintf(img->device, sizeof(img->device), "/dev/mtdblock%d", mtdnum);
@@ -0,0 +1,313 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Cache of the zchunk index of the images installed by the
+ * delta handler. Indexing the source device is the most
+ * expensive step of a delta update because the whole device
+ * must be read and hashed. The index of the installed image is
+ * built while it is written, and it is used by the next delta
+ * update that takes the device as source.
+ *
+ * The index is stored as a zchunk header without compression,
+ * so the chunk offsets are the offsets on the device once the
+ * length of the header is subtracted. Before
+ * it is used, some chunks are read from the device and their
+ * hashes compared, and the index is dropped if the device
+ * content has changed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <zck.h>
+#include <util.h>
+#include <swupdate_crypto.h>
+#include "delta_cache.h"
+
+/* number of chunks verified before a cached index is used */
+#define CACHE_SAMPLES	8
+
+/*
+ * The cache file is named after the device, symlinks
+ * as /dev/disk/by-* are resolved first.
+ */
+static char *cache_path(const char *dir, const char *dev)
+{
+	char devpath[PATH_MAX];
+	char *fname, *p;
+
+	if (!realpath(dev, devpath)) {
+		WARN("Cannot resolve %s: %s", dev, strerror(errno));
+		return NULL;
+	}
+
+	for (p = devpath; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	if (asprintf(&fname, "%s/%s.zck", dir, devpath + 1) < 0)
+		return NULL;
+
+	return fname;
+}
+
+bool delta_read_chunk(zckChunk *chunk, int fd, off_t start, unsigned char *buf)
+{
+	ssize_t len = zck_get_chunk_size(chunk);
+	char *sha = zck_get_chunk_digest_uncompressed(chunk);
+	unsigned char hash[SHA256_HASH_LENGTH];
+	unsigned char md_value[SHA256_HASH_LENGTH];
+	unsigned int md_len = 0;
+	void *dgst = NULL;
+	bool match = false;
+	ssize_t n, count = 0;
+
+	if (!sha || len < 0 || start < 0)
+		goto out;
+	ascii_to_hash(hash, sha);
+
+	while (count < len) {
+		n = pread(fd, buf + count, len - count, start + count);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			goto out;
+		}
+		count += n;
+	}
+
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst || swupdate_HASH_update(dgst, buf, len) ||
+	    swupdate_HASH_final(dgst, md_value, &md_len))
+		goto out;
+
+	match = md_len == SHA256_HASH_LENGTH && !swupdate_HASH_compare(hash, md_value);
+
+out:
+	if (dgst)
+		swupdate_HASH_cleanup(dgst);
+	free(sha);
+	return match;
+}
+
+/*
+ * The chunk starts of an index read from a file include the
+ * length of its header, hdrlen is subtracted to get the offset
+ * on the device
+ */
+static bool chunk_matches(zckChunk *chunk, ssize_t hdrlen, int fd)
+{
+	unsigned char *buf = malloc(max(zck_get_chunk_size(chunk), (ssize_t)1));
+	bool match;
+
+	if (!buf)
+		return false;
+	match = delta_read_chunk(chunk, fd, zck_get_chunk_start(chunk) - hdrlen, buf);
+	free(buf);
+
+	return match;
+}
+
+/*
+ * Compare the first and the last chunk, and some chunks
+ * in between, with the device.
+ */
+static bool index_matches_device(zckCtx *zck, int fd)
+{
+	zckChunk *chunk;
+	ssize_t nchunks = zck_get_chunk_count(zck);
+	ssize_t hdrlen = zck_get_header_length(zck);
+	ssize_t step, i = 0;
+	bool first = true;
+
+	if (nchunks <= 0 || hdrlen < 0)
+		return false;
+	step = max(nchunks / CACHE_SAMPLES, 1);
+
+	for (chunk = zck_get_first_chunk(zck); chunk;
+	     chunk = zck_get_next_chunk(chunk), i++) {
+		bool last = !zck_get_next_chunk(chunk);
+
+		if (!zck_get_chunk_size(chunk))
+			continue;
+		if (first || last || !(i % step)) {
+			if (!chunk_matches(chunk, hdrlen, fd))
+				return false;
+			first = false;
+		}
+	}
+
+	return true;
+}
+
+zckCtx *delta_cache_load(const char *dir, const char *dev, int fd)
+{
+	char *fname = cache_path(dir, dev);
+	zckCtx *zck = NULL;
+	int cfd;
+
+	if (!fname)
+		return NULL;
+
+	cfd = open(fname, O_RDONLY);
+	if (cfd < 0) {
+		TRACE("No cached index for %s", dev);
+		free(fname);
+		return NULL;
+	}
+
+	zck = zck_create();
+	if (!zck || !zck_init_read(zck, cfd)) {
+		WARN("Cached index %s cannot be read, dropping it", fname);
+		goto stale;
+	}
+
+	if (!index_matches_device(zck, fd)) {
+		INFO("Cached index of %s does not match the device, dropping it", dev);
+		goto stale;
+	}
+
+	INFO("Using cached index %s for %s", fname, dev);
+	close(cfd);
+	free(fname);
+	return zck;
+
+stale:
+	if (zck)
+		zck_free(&zck);
+	close(cfd);
+	unlink(fname);
+	free(fname);
+	return NULL;
+}
+
+void delta_cache_drop(const char *dir, const char *dev)
+{
+	char *fname = cache_path(dir, dev);
+
+	if (!fname)
+		return;
+	if (unlink(fname) && errno != ENOENT)
+		WARN("Cannot remove stale index %s: %s", fname, strerror(errno));
+	free(fname);
+}
+
+bool delta_index_start(struct delta_index *idx, const char *dir, const char *dev)
+{
+	char *cachedir;
+
+	idx->zck = NULL;
+	idx->fd = -1;
+	idx->tmpname = NULL;
+	idx->fname = cache_path(dir, dev);
+	if (!idx->fname)
+		return false;
+
+	/* the device is going to be overwritten */
+	if (unlink(idx->fname) && errno != ENOENT) {
+		WARN("Cannot remove stale index %s: %s", idx->fname, strerror(errno));
+		goto fail;
+	}
+
+	cachedir = strdupa(dir);
+	if (mkpath(cachedir, 0755)) {
+		WARN("Cannot create index cache %s", dir);
+		goto fail;
+	}
+
+	if (asprintf(&idx->tmpname, "%s.tmp", idx->fname) < 0) {
+		idx->tmpname = NULL;
+		goto fail;
+	}
+	idx->fd = open(idx->tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (idx->fd < 0) {
+		WARN("Cannot create %s: %s", idx->tmpname, strerror(errno));
+		goto fail;
+	}
+
+	idx->zck = zck_create();
+	if (!idx->zck) {
+		zck_clear_error(NULL);
+		goto fail;
+	}
+
+	/*
+	 * Chunks are closed by the caller at the same boundaries
+	 * as in the image, the data itself is not stored.
+	 */
+	if (!zck_init_write(idx->zck, idx->fd) ||
+	    !zck_set_ioption(idx->zck, ZCK_UNCOMP_HEADER, 1) ||
+	    !zck_set_ioption(idx->zck, ZCK_COMP_TYPE, ZCK_COMP_NONE) ||
+	    !zck_set_ioption(idx->zck, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256) ||
+	    !zck_set_ioption(idx->zck, ZCK_MANUAL_CHUNK, 1) ||
+	    !zck_set_ioption(idx->zck, ZCK_NO_WRITE, 1)) {
+		WARN("Index cannot be cached: %s", zck_get_error(idx->zck));
+		goto fail;
+	}
+
+	return true;
+
+fail:
+	delta_index_discard(idx);
+	return false;
+}
+
+bool delta_index_write(struct delta_index *idx, const void *buf, size_t len)
+{
+	return zck_write(idx->zck, buf, len) == (ssize_t)len;
+}
+
+bool delta_index_end_chunk(struct delta_index *idx)
+{
+	return zck_end_chunk(idx->zck) >= 0;
+}
+
+bool delta_index_commit(struct delta_index *idx)
+{
+	bool ret = true;
+
+	if (!zck_close(idx->zck)) {
+		WARN("Index cannot be created: %s", zck_get_error(idx->zck));
+		ret = false;
+	} else if (fsync(idx->fd) || rename(idx->tmpname, idx->fname)) {
+		WARN("Index cannot be stored in %s: %s", idx->fname, strerror(errno));
+		ret = false;
+	} else {
+		TRACE("Index stored in %s", idx->fname);
+		free(idx->tmpname);
+		idx->tmpname = NULL;
+	}
+
+	delta_index_discard(idx);
+	return ret;
+}
+
+void delta_index_discard(struct delta_index *idx)
+{
+	if (!idx->fname)
+		return;
+
+	if (idx->zck)
+		zck_free(&idx->zck);
+	if (idx->fd >= 0)
+		close(idx->fd);
+	if (idx->tmpname) {
+		unlink(idx->tmpname);
+		free(idx->tmpname);
+	}
+	free(idx->fname);
+
+	idx->zck = NULL;
+	idx->fd = -1;
+	idx->tmpname = NULL;
+	idx->fname = NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zck.h>
+
+/*
+ * Index of an image being installed. It is built while the
+ * image is written and stored in the cache directory when the
+ * installation succeeds, so that a later delta update using the
+ * device as source does not need to read it completely.
+ */
+struct delta_index {
+	zckCtx *zck;
+	int fd;
+	char *fname;		/* cached index of the device */
+	char *tmpname;		/* index being written */
+};
+
+/* Load the cached index of dev (opened as fd), NULL if missing or stale */
+zckCtx *delta_cache_load(const char *dir, const char *dev, int fd);
+
+/* Drop the cached index of dev */
+void delta_cache_drop(const char *dir, const char *dev);
+
+/*
+ * Read the data of chunk from fd at start into buf, large
+ * enough for the chunk. Return false if it does not match
+ * the hash of the chunk.
+ */
+bool delta_read_chunk(zckChunk *chunk, int fd, off_t start, unsigned char *buf);
+
+/* Drop the cached index of dev and start a new one */
+bool delta_index_start(struct delta_index *idx, const char *dir, const char *dev);
+
+/* Add data of the current chunk */
+bool delta_index_write(struct delta_index *idx, const void *buf, size_t len);
+
+/* Close the current chunk */
+bool delta_index_end_chunk(struct delta_index *idx);
+
+/* Store the index in the cache */
+bool delta_index_commit(struct delta_index *idx);
+
+/* Drop the index, it is a no-op if the index was not started */
+void delta_index_discard(struct delta_index *idx);
@@ -18,6 +18,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -26,7 +27,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <util.h>
+#include <bsdqueue.h>
 #include <pctl.h>
 #include <zlib.h>
 #include <channel.h>
@@ -38,6 +41,16 @@
 #include "server_utils.h"
 #include "parselib.h"
 
+/* upper limit for the parallel downloads */
+#define MAX_DOWNLOAD_WORKERS	16
+
+/*
+ * Answers buffered in KiB. The minimum leaves room for the
+ * oldest transfer even if every worker is waiting.
+ */
+#define MIN_DOWNLOAD_SPOOL	(4 * MAX_DOWNLOAD_WORKERS * \
+				 RANGE_PAYLOAD_SIZE / 1024)
+
 /*
  * Structure to maintain transferate data
  * of the downloader
@@ -45,16 +58,55 @@
 typedef struct {
 	char *targettoken;
 	char *gatewaytoken;
+	int workers;
+	int spool;	/* KiB buffered while the handler is busy */
 } dwl_priv_t;
 
 /*
- * Structure used in curl callbacks
+ * Answer received from the server and not yet sent
+ * to the handler, only answer.len bytes of the payload
+ * are allocated
  */
-typedef struct {
-	unsigned int id;	/* Request id */
-	int writefd;		/* IPC file descriptor */
-	range_answer_t *answer;
+struct dwl_msg {
+	SIMPLEQ_ENTRY(dwl_msg) next;
+	range_answer_t answer;
+};
+SIMPLEQ_HEAD(dwl_msgs, dwl_msg);
+
+/*
+ * Requests are served by a pool of workers, but the answers
+ * are sent back in the same order as the requests. The workers
+ * queue the answers into a spool, and a sender thread writes
+ * the answers of the oldest request to the IPC. The transfers
+ * go on while the handler is busy copying local chunks, until
+ * the spool is full.
+ */
+typedef struct dwl_transfer {
+	range_request_t req;
+	struct dwl_msgs pending;	/* answers not yet sent */
+	bool done;
+	bool canceled;
+	range_answer_t answer;		/* buffer for the callbacks */
+	SIMPLEQ_ENTRY(dwl_transfer) order;
+	SIMPLEQ_ENTRY(dwl_transfer) work;
 } dwl_transfer_t;
+SIMPLEQ_HEAD(dwl_transfers, dwl_transfer);
+
+static struct dwl_transfers dwl_order = SIMPLEQ_HEAD_INITIALIZER(dwl_order);
+static struct dwl_transfers dwl_work = SIMPLEQ_HEAD_INITIALIZER(dwl_work);
+static pthread_mutex_t dwl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dwl_cond = PTHREAD_COND_INITIALIZER;	/* new work */
+static pthread_cond_t dwl_queued = PTHREAD_COND_INITIALIZER;	/* new answer */
+static pthread_cond_t dwl_sent = PTHREAD_COND_INITIALIZER;	/* spool drained */
+static size_t dwl_spooled;
+static size_t dwl_spool_size;
+
+/* Each worker has its own connection */
+typedef struct {
+	pthread_t thread;
+	channel_data_t channel_data;
+	channel_t *channel;
+} dwl_worker_t;
 
 extern channel_op_res_t channel_curl_init(void);
 
@@ -71,6 +123,131 @@ static channel_data_t channel_data_defaults = {
 					.received_headers = NULL
 					};
 
+/*
+ * Queue an answer of a transfer. When the spool is full, the
+ * transfer waits until the handler has read some data. The
+ * oldest transfer can use the whole spool, the others only
+ * half of it: the sender waits for the oldest transfer, and
+ * it must not be blocked by the answers of the next ones.
+ * The answers of a canceled transfer are dropped.
+ */
+static int dwl_send(dwl_transfer_t *dwl, range_answer_t *answer)
+{
+	size_t len = offsetof(struct dwl_msg, answer.data) + answer->len;
+	struct dwl_msg *msg;
+
+	msg = malloc(len);
+	if (!msg) {
+		ERROR("OOM queuing answer of request %u", dwl->req.id);
+		return -ENOMEM;
+	}
+	memcpy(&msg->answer, answer, len - offsetof(struct dwl_msg, answer));
+
+	pthread_mutex_lock(&dwl_lock);
+	while (!dwl->canceled &&
+	       dwl_spooled >= (SIMPLEQ_FIRST(&dwl_order) == dwl ?
+			       dwl_spool_size : dwl_spool_size / 2))
+		pthread_cond_wait(&dwl_sent, &dwl_lock);
+	if (dwl->canceled) {
+		pthread_mutex_unlock(&dwl_lock);
+		free(msg);
+		return -ECANCELED;
+	}
+	SIMPLEQ_INSERT_TAIL(&dwl->pending, msg, next);
+	dwl_spooled += msg->answer.len;
+	pthread_cond_signal(&dwl_queued);
+	pthread_mutex_unlock(&dwl_lock);
+
+	return 0;
+}
+
+/*
+ * Called when a transfer has finished, the transfer is
+ * released by the sender after its last answer.
+ */
+static void dwl_done(dwl_transfer_t *dwl)
+{
+	pthread_mutex_lock(&dwl_lock);
+	dwl->done = true;
+	pthread_cond_signal(&dwl_queued);
+	pthread_mutex_unlock(&dwl_lock);
+}
+
+/*
+ * The handler has given up the requests sent so far, after
+ * a failed installation or to request again chunks that could
+ * not be copied from the source. The transfers not yet started
+ * are dropped, the running ones are aborted by their callbacks.
+ */
+static void dwl_cancel(void)
+{
+	dwl_transfer_t *dwl;
+	struct dwl_msg *msg;
+
+	pthread_mutex_lock(&dwl_lock);
+	SIMPLEQ_FOREACH(dwl, &dwl_order, order) {
+		dwl->canceled = true;
+		while ((msg = SIMPLEQ_FIRST(&dwl->pending))) {
+			SIMPLEQ_REMOVE_HEAD(&dwl->pending, next);
+			dwl_spooled -= msg->answer.len;
+			free(msg);
+		}
+	}
+	while ((dwl = SIMPLEQ_FIRST(&dwl_work))) {
+		SIMPLEQ_REMOVE_HEAD(&dwl_work, work);
+		dwl->done = true;
+	}
+	pthread_cond_broadcast(&dwl_sent);
+	pthread_cond_signal(&dwl_queued);
+	pthread_mutex_unlock(&dwl_lock);
+}
+
+/*
+ * Send the answers of the oldest transfer, then go on
+ * with the next one. The IPC messages have a fixed size.
+ */
+static void *dwl_sender(void __attribute__ ((__unused__)) *data)
+{
+	dwl_transfer_t *head;
+	struct dwl_msg *msg;
+	range_answer_t *answer;
+	size_t len;
+
+	answer = calloc(1, sizeof(*answer));
+	if (!answer) {
+		ERROR("OOM allocating download sender buffer");
+		exit (EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&dwl_lock);
+	for (;;) {
+		head = SIMPLEQ_FIRST(&dwl_order);
+		if (head && !SIMPLEQ_EMPTY(&head->pending)) {
+			msg = SIMPLEQ_FIRST(&head->pending);
+			SIMPLEQ_REMOVE_HEAD(&head->pending, next);
+			pthread_mutex_unlock(&dwl_lock);
+			len = msg->answer.len;
+			memcpy(answer, &msg->answer,
+			       offsetof(range_answer_t, data) + len);
+			free(msg);
+			if (copy_write(&sw_sockfd, answer, sizeof(*answer)) < 0)
+				ERROR("Error sending IPC data !");
+			pthread_mutex_lock(&dwl_lock);
+			dwl_spooled -= len;
+			pthread_cond_broadcast(&dwl_sent);
+		} else if (head && head->done) {
+			SIMPLEQ_REMOVE_HEAD(&dwl_order, order);
+			free(head);
+			/* the next transfer can use the whole spool */
+			pthread_cond_broadcast(&dwl_sent);
+		} else {
+			pthread_cond_wait(&dwl_queued, &dwl_lock);
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * Data callback: takes the buffer, surrounded with IPC meta data
  * and send to the process that reqeusted the download
@@ -94,17 +271,19 @@ static size_t wrdata_callback(char *buffer, size_t size, size_t nmemb, void *dat
 		return 0;
 	}
 	while (nbytes > 0) {
-		range_answer_t *answer = dwl->answer;
-		answer->id = dwl->id;
+		range_answer_t *answer = &dwl->answer;
+		answer->id = dwl->req.id;
 		answer->type = RANGE_DATA;
 		answer->len = min(nbytes, RANGE_PAYLOAD_SIZE);
 		memcpy(answer->data, buffer, answer->len);
 		answer->crc = crc32(0, (unsigned char *)answer->data, answer->len);
-		ret = copy_write(&dwl->writefd, answer, sizeof(range_answer_t));
+		ret = dwl_send(dwl, answer);
 		if (ret < 0) {
-			ERROR("Error sending IPC data !");
+			if (ret != -ECANCELED)
+				ERROR("Error sending IPC data !");
 			return 0;
 		}
+		buffer += answer->len;
 		nbytes -= answer->len;
 	}
 
@@ -125,17 +304,18 @@ static size_t delta_callback_headers(char *buffer, size_t size, size_t nitems, v
 	dwl_transfer_t *dwl = (dwl_transfer_t *)channel_data->user;
 	int ret;
 
-	range_answer_t *answer = dwl->answer;
-	answer->id = dwl->id;
+	range_answer_t *answer = &dwl->answer;
+	answer->id = dwl->req.id;
 	answer->type = RANGE_HEADERS;
 	answer->len = min(size * nitems , RANGE_PAYLOAD_SIZE - 2);
 	memcpy(answer->data, buffer, answer->len);
 	answer->len++;
 	answer->data[answer->len] = '\0';
 
-	ret = write(dwl->writefd, answer, sizeof(range_answer_t));
-	if (ret != sizeof(range_answer_t)) {
-		ERROR("Error sending IPC data !");
+	ret = dwl_send(dwl, answer);
+	if (ret < 0) {
+		if (ret != -ECANCELED)
+			ERROR("Error sending IPC data !");
 		return 0;
 	}
 
@@ -156,10 +336,63 @@ static int delta_downloader_settings(void *elem, void *data)
 	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "gatewaytoken", tmp);
 	if (strlen(tmp))
 		SETSTRING(priv->gatewaytoken, tmp);
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "download-workers", &priv->workers);
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "download-buffer", &priv->spool);
 
 	return 0;
 }
 
+/*
+ * Run the transfers queued by the main loop
+ */
+static void *dwl_worker(void *data)
+{
+	dwl_worker_t *w = (dwl_worker_t *)data;
+	channel_data_t *channel_data = &w->channel_data;
+	channel_op_res_t result;
+	dwl_transfer_t *dwl;
+
+	for (;;) {
+		pthread_mutex_lock(&dwl_lock);
+		while (SIMPLEQ_EMPTY(&dwl_work))
+			pthread_cond_wait(&dwl_cond, &dwl_lock);
+		dwl = SIMPLEQ_FIRST(&dwl_work);
+		SIMPLEQ_REMOVE_HEAD(&dwl_work, work);
+		pthread_mutex_unlock(&dwl_lock);
+
+		channel_data->url = dwl->req.data;
+		channel_data->noipc = true;
+		channel_data->usessl = true;
+		channel_data->method = CHANNEL_GET;
+		channel_data->content_type = "*";
+		channel_data->headers = delta_callback_headers;
+		channel_data->dwlwrdata = wrdata_callback;
+		channel_data->range = &dwl->req.data[dwl->req.urllen + 1];
+		channel_data->user = dwl;
+		channel_data->http_response_code = 0;
+		channel_data->debug = loglevel >= DEBUGLEVEL;
+
+		if (w->channel->open(w->channel, channel_data) == CHANNEL_OK) {
+			result = w->channel->get_file(w->channel, (void *)channel_data);
+		} else {
+			ERROR("Cannot open channel for communication");
+			result = CHANNEL_EINIT;
+		}
+
+		dwl->answer.id = dwl->req.id;
+		dwl->answer.type = (result == CHANNEL_OK) ? RANGE_COMPLETED : RANGE_ERROR;
+		dwl->answer.len = 0;
+		if (dwl_send(dwl, &dwl->answer) == -ENOMEM) {
+			ERROR("Answer cannot be sent back, maybe deadlock !!");
+		}
+
+		(void)w->channel->close(w->channel);
+		dwl_done(dwl);
+	}
+
+	return NULL;
+}
+
 /*
  * Process that is spawned by the handler to download the missing chunks.
  * Downloading should be done in a separate process to not break
@@ -172,14 +405,16 @@ int start_delta_downloader(const char __attribute__ ((__unused__)) *fname,
 	ssize_t ret;
 	range_request_t *req = NULL;
 	swupdate_cfg_handle handle;
-	channel_op_res_t result;
-	range_answer_t *answer;
 	struct dict httpheaders;
-	dwl_transfer_t dwltransfer;
 	dwl_priv_t dwldata;
+	dwl_worker_t *workers;
+	dwl_transfer_t *dwl;
+	pthread_t sender;
+	int i;
 
 	TRACE("Starting Internal process for downloading chunks");
 	memset (&dwldata, 0, sizeof(dwldata));
+	dwldata.spool = DEFAULT_DOWNLOAD_SPOOL;
 
 	if (channel_curl_init() != CHANNEL_OK) {
 		ERROR("Cannot initialize curl");
@@ -191,19 +426,8 @@ int start_delta_downloader(const char __attribute__ ((__unused__)) *fname,
 		exit (EXIT_FAILURE);
 	}
 
-	answer = (range_answer_t *)malloc(sizeof *answer);
-	if (!answer) {
-		ERROR("OOM requesting answer buffers !");
-		exit (EXIT_FAILURE);
-	}
-
 	channel_data_t channel_data = channel_data_defaults;
-	channel_t *channel = channel_new();
-	if (!channel) {
-		ERROR("Cannot get channel for communication");
-		exit (EXIT_FAILURE);
-	}
-	LIST_INIT(&httpheaders);
+	dict_init(&httpheaders);
 	if (dict_insert_value(&httpheaders, "Accept", "*/*")) {
 		ERROR("Database error setting Accept header");
 		exit (EXIT_FAILURE);
@@ -219,50 +443,88 @@ int start_delta_downloader(const char __attribute__ ((__unused__)) *fname,
 	channel_settoken("TargetToken", dwldata.targettoken, &channel_data);
 	channel_settoken("GatewayToken", dwldata.gatewaytoken, &channel_data);
 
-	for (;;) {
-		ret = read(sw_sockfd, req, sizeof(range_request_t));
-		if (ret < 0) {
-			ERROR("reading from sockfd returns error, aborting...");
+	if (dwldata.workers < 1)
+		dwldata.workers = 1;
+	if (dwldata.workers > MAX_DOWNLOAD_WORKERS) {
+		WARN("download-workers limited to %d", MAX_DOWNLOAD_WORKERS);
+		dwldata.workers = MAX_DOWNLOAD_WORKERS;
+	}
+
+	if (dwldata.spool < (int)MIN_DOWNLOAD_SPOOL) {
+		WARN("download-buffer raised to %d KiB", (int)MIN_DOWNLOAD_SPOOL);
+		dwldata.spool = MIN_DOWNLOAD_SPOOL;
+	}
+	dwl_spool_size = (size_t)dwldata.spool * 1024;
+
+	if (pthread_create(&sender, NULL, dwl_sender, NULL)) {
+		ERROR("Cannot start download sender");
+		exit (EXIT_FAILURE);
+	}
+
+	workers = calloc(dwldata.workers, sizeof(*workers));
+	if (!workers) {
+		ERROR("OOM allocating download workers !");
+		exit (EXIT_FAILURE);
+	}
+	/*
+	 * The copies share only the settings read above, that are
+	 * not changed by a transfer. No header dictionaries are
+	 * set, a worker must not look up a dictionary shared with
+	 * the others.
+	 */
+	for (i = 0; i < dwldata.workers; i++) {
+		workers[i].channel_data = channel_data;
+		workers[i].channel_data.headers_to_send = NULL;
+		workers[i].channel_data.received_headers = NULL;
+		workers[i].channel = channel_new();
+		if (!workers[i].channel) {
+			ERROR("Cannot get channel for communication");
+			exit (EXIT_FAILURE);
+		}
+		if (pthread_create(&workers[i].thread, NULL, dwl_worker, &workers[i])) {
+			ERROR("Cannot start download worker");
 			exit (EXIT_FAILURE);
 		}
+	}
+
+	for (;;) {
+		/* several requests can be queued, read exactly one */
+		ret = 0;
+		while (ret < (ssize_t)sizeof(range_request_t)) {
+			ssize_t n = read(sw_sockfd, (char *)req + ret,
+					 sizeof(range_request_t) - ret);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				ERROR("reading from sockfd returns error, aborting...");
+				exit (EXIT_FAILURE);
+			}
+			ret += n;
+		}
+
+		if (req->type == RANGE_CANCEL) {
+			dwl_cancel();
+			continue;
+		}
 
 		if ((req->urllen + req->rangelen) > ret) {
 			ERROR("Malformed data");
 			continue;
 		}
-		dwltransfer.writefd = sw_sockfd;
-		dwltransfer.id = req->id;
-		dwltransfer.answer = answer;
-		channel_data.url = req->data;
-		channel_data.noipc = true;
-		channel_data.usessl = true;
-		channel_data.method = CHANNEL_GET;
-		channel_data.content_type = "*";
-		channel_data.headers = delta_callback_headers;
-		channel_data.dwlwrdata = wrdata_callback;
-		channel_data.range = &req->data[req->urllen + 1];
-		channel_data.user = &dwltransfer;
-
-		if (loglevel >= DEBUGLEVEL) {
-			channel_data_defaults.debug = true;
-		} else
-			channel_data_defaults.debug = false;
-
-		if (channel->open(channel, &channel_data) == CHANNEL_OK) {
-			result = channel->get_file(channel, (void *)&channel_data);
-		} else {
-			ERROR("Cannot open channel for communication");
-			result = CHANNEL_EINIT;
-		}
 
-		answer->id = req->id;
-		answer->type = (result == CHANNEL_OK) ? RANGE_COMPLETED : RANGE_ERROR;
-		answer->len = 0;
-		if (write(sw_sockfd, answer, sizeof(*answer)) != sizeof(*answer)) {
-			ERROR("Answer cannot be sent back, maybe deadlock !!");
+		dwl = calloc(1, sizeof(*dwl));
+		if (!dwl) {
+			ERROR("OOM allocating transfer, aborting...");
+			exit (EXIT_FAILURE);
 		}
+		memcpy(&dwl->req, req, sizeof(*req));
+		SIMPLEQ_INIT(&dwl->pending);
 
-		(void)channel->close(channel);
+		pthread_mutex_lock(&dwl_lock);
+		SIMPLEQ_INSERT_TAIL(&dwl_order, dwl, order);
+		SIMPLEQ_INSERT_TAIL(&dwl_work, dwl, work);
+		pthread_cond_signal(&dwl_cond);
+		pthread_mutex_unlock(&dwl_lock);
 	}
 
 	exit (EXIT_SUCCESS);
@@ -37,13 +37,17 @@
 #include <fs_interface.h>
 #include <sys/mman.h>
 #include "delta_handler.h"
+#include "delta_cache.h"
 #include "multipart_parser.h"
 #include "zchunk_range.h"
 #include "handler_helpers.h"
 #include "swupdate_image.h"
+#include "swupdate.h"
 
 #define DEFAULT_MAX_RANGES	10	/* Apache has default = 200 */
-#define BUFF_SIZE		16384
+#define MIN_REGION_SIZE		(64 * 1024 * 1024)
+#define REGION_OVERLAP		(1024 * 1024)
+#define MAX_DOWNLOAD_WINDOW	16	/* requests sent to the downloader */
 
 const char *handlername = "delta";
 void delta_handler(void);
@@ -86,6 +90,28 @@ struct dwlchunk {
 	bool completed;
 };
 
+/*
+ * The source can be indexed by several threads, each of them
+ * indexes a region of the source with an own zck context. A
+ * region overlaps the next one, so that the chunks across the
+ * boundary are found, too.
+ */
+struct src_region {
+	pthread_t thread;
+	zckCtx *zck;
+	int fd;
+	off_t offset;			/* offset of the region in the source */
+	size_t len;			/* bytes to be indexed, 0 up to the end */
+	off_t hdrlen;			/* header length included in the chunk starts */
+	bool indexed;
+};
+
+/* chunk of the source matching a chunk of the image */
+struct src_chunk {
+	zckChunk *chunk;
+	off_t offset;			/* added to the chunk start */
+};
+
 struct hnd_priv {
 	/* Attributes retrieved from sw-descritpion */
 	char *url;			/* URL to get full ZCK file */
@@ -96,11 +122,17 @@ struct hnd_priv {
 	bool detectsrcsize;		/* if set, try to compute size of filesystem in srcdev */
 	size_t srcsize;			/* Size of source */
 	unsigned long max_ranges;	/* Max allowed ranges (configured via sw-description) */
+	char *cachedir;			/* directory with the cached indexes, if any */
 	/* Data to be transferred to chain handler */
 	struct img_type img;
 	int fdout;
 	int fdsrc;
 	zckCtx *tgt;
+	struct delta_index index;	/* index of the image being installed */
+	struct src_region *regions;	/* indexes of the source */
+	unsigned int nregions;
+	struct src_chunk *srcmap;	/* source of each chunk of the image */
+	size_t nchunks;
 	/* Structures for downloading chunks */
 	bool dwlrunning;
 	range_type_t range_type;	/* Single or multipart */
@@ -109,6 +141,15 @@ struct hnd_priv {
 	dwl_state_t dwlstate;		/* for internal state machine */
 	range_answer_t *answer;			/* data from downloader */
 	uint32_t reqid;			/* Current request id to downloader */
+	uint32_t dwlids[MAX_DOWNLOAD_WINDOW];	/* next requests, oldest first */
+	size_t dwlsizes[MAX_DOWNLOAD_WINDOW];	/* bytes expected for each request */
+	unsigned int dwlpending;	/* number of requests in dwlids */
+	unsigned int window;		/* max requests sent to the downloader */
+	size_t dwlbudget;		/* bytes the downloader can buffer */
+	size_t dwlqueued;		/* bytes of the requests not yet completed */
+	size_t dwlcurrent;		/* bytes of the request being processed */
+	zckChunk *dwlnext;		/* first chunk not yet requested */
+	bool srcstale;			/* a chunk of the source must be downloaded */
 	struct dwlchunk current;	/* Structure to collect data for working chunk */
 	zckChunk *chunk;		/* Current chunk to be processed */
 	size_t rangelen;		/* Value from Content-range header */
@@ -126,6 +167,56 @@ struct hnd_priv {
 
 static bool copy_existing_chunks(zckChunk **dstChunk, struct hnd_priv *priv);
 
+/*
+ * Return the chunk of the source with the same data as chunk,
+ * NULL if the chunk must be downloaded. offset is set to the
+ * position of the data in the source.
+ */
+static zckChunk *get_src_chunk(struct hnd_priv *priv, zckChunk *chunk, size_t *offset)
+{
+	ssize_t n = zck_get_chunk_number(chunk);
+	struct src_chunk *src;
+
+	if (n < 0 || (size_t)n >= priv->nchunks)
+		return NULL;
+	src = &priv->srcmap[n];
+	if (src->chunk && offset)
+		*offset = src->offset + zck_get_chunk_start(src->chunk);
+
+	return src->chunk;
+}
+
+static bool is_src_chunk(zckChunk *chunk, void *data)
+{
+	return get_src_chunk((struct hnd_priv *)data, chunk, NULL) != NULL;
+}
+
+/*
+ * Write callback for the data passed to the chained handler:
+ * the data is added to the index of the installed image, too.
+ */
+static int delta_write(void *out, const void *buf, size_t len)
+{
+	struct hnd_priv *priv = (struct hnd_priv *)out;
+	int ret = copy_write(&priv->fdout, buf, len);
+
+	if (!ret && priv->index.zck &&
+	    !delta_index_write(&priv->index, buf, len)) {
+		WARN("Index of the installed image cannot be created");
+		delta_index_discard(&priv->index);
+	}
+
+	return ret;
+}
+
+static void delta_chunk_written(struct hnd_priv *priv)
+{
+	if (priv->index.zck && !delta_index_end_chunk(&priv->index)) {
+		WARN("Index of the installed image cannot be created");
+		delta_index_discard(&priv->index);
+	}
+}
+
 /*
  * Callbacks for multipart parsing.
  */
@@ -139,6 +230,9 @@ static int network_process_data(multipart_parser* p, const char *at, size_t leng
 	/* Stop if previous error occurred */
 	if (priv->error_in_parser)
 		return -EFAULT;
+	/* the rest of the answer is requested again */
+	if (priv->srcstale)
+		return 0;
 
 	while (nbytes) {
 		size_t to_be_filled = priv->current.chunksize - priv->current.nbytes;
@@ -163,12 +257,15 @@ static int network_process_data(multipart_parser* p, const char *at, size_t leng
 			if (priv->current.chunksize != 0) {
 				struct swupdate_copy copy = {
 					.inbuf = priv->current.buf,
-					.out = &priv->fdout,
+					.callback = delta_write,
+					.out = priv,
 					.nbytes = priv->current.chunksize,
 					.compressed = COMPRESSED_ZSTD,
 					.hash = hash,
 				};
 				ret = copyfile(&copy);
+				if (!ret)
+					delta_chunk_written(priv);
 			} else
 				ret = 0; /* skipping, nothing to be copied */
 			/* Buffer can be discarged */
@@ -217,6 +314,9 @@ static int multipart_data_complete(multipart_parser* p)
 	struct hnd_priv *priv = (struct hnd_priv *)multipart_parser_get_data(p);
 	size_t current_chunk_size;
 
+	if (priv->srcstale)
+		return 0;
+
 	current_chunk_size = zck_get_chunk_comp_size(priv->chunk);
 	priv->current.buf = (unsigned char *)malloc(current_chunk_size);
 	priv->current.nbytes = 0;
@@ -244,7 +344,8 @@ static int multipart_data_end(multipart_parser* p)
 	free(priv->current.buf);
 	priv->current.buf = NULL;
 	priv->content_range_received = true;
-	copy_existing_chunks(&priv->chunk, priv);
+	if (!priv->srcstale && !copy_existing_chunks(&priv->chunk, priv))
+		priv->error_in_parser = true;
 	return 0;
 }
 
@@ -275,7 +376,7 @@ static size_t get_total_size(zckCtx *zck, struct hnd_priv *priv) {
 		if (priv->debugchunks)
 			TRACE("%12lu %s %s %12lu %12lu %12lu %12lu",
 				zck_get_chunk_number(iter),
-				zck_get_chunk_valid(iter) ? "SRC" : "DST",
+				is_src_chunk(iter, priv) ? "SRC" : "DST",
 				zck_get_chunk_digest_uncompressed(iter),
 				zck_get_chunk_start(iter),
 				zck_get_chunk_size(iter),
@@ -283,7 +384,7 @@ static size_t get_total_size(zckCtx *zck, struct hnd_priv *priv) {
 				zck_get_chunk_comp_size(iter));
 
 		pos += zck_get_chunk_size(iter);
-		if (!zck_get_chunk_valid(iter)) {
+		if (!is_src_chunk(iter, priv)) {
 			priv->bytes_to_download += zck_get_chunk_comp_size(iter);
 		} else {
 			priv->bytes_to_be_reused += zck_get_chunk_size(iter);
@@ -339,6 +440,8 @@ static int delta_retrieve_attributes(struct img_type *img, struct hnd_priv *priv
 	if (errno || priv->max_ranges == 0)
 		priv->max_ranges = DEFAULT_MAX_RANGES;
 
+	priv->cachedir = dict_get_value(&img->properties, "index-cache");
+
 	char *srcsize;
 	srcsize = dict_get_value(&img->properties, "source-size");
 	if (srcsize) {
@@ -487,15 +590,16 @@ static void zck_log_toswupdate(const char *function, zck_log_type lt,
 }
 
 /*
- * Create a zck Index from a file
+ * Create a zck Index from a file, starting at offset
  *
  * If maxbytes has been set, it acts as a limit for the input data.
  * If not (i.e. maxbytes==0), all the file/dev available data is used.
  */
-static bool create_zckindex(zckCtx *zck, int fd, size_t maxbytes)
+static bool create_zckindex(zckCtx *zck, int fd, off_t offset, size_t maxbytes)
 {
-	size_t bufsize = BUFF_SIZE;
-	char *buf = malloc(BUFF_SIZE);
+	const size_t maxbufsize = resolve_io_buffer_size(0, fd);
+	size_t bufsize = maxbufsize;
+	char *buf = malloc(maxbufsize);
 	ssize_t n = 0;
 	size_t count = 0;
 	bool rstatus = true;
@@ -504,23 +608,21 @@ static bool create_zckindex(zckCtx *zck, int fd, size_t maxbytes)
 		ERROR("OOM creating temporary buffer");
 		return false;
 	}
-	while ((n = read(fd, buf, bufsize)) > 0) {
+	while ((n = pread(fd, buf, bufsize, offset + count)) > 0) {
 		if (zck_write(zck, buf, n) < 0) {
 			ERROR("ZCK returns %s", zck_get_error(zck));
 			free(buf);
 			return false;
 		}
 
+		count += n;
 		if(maxbytes) {
-			/* Keep count only if maxbytes has been set and it's significant*/
-			count += n;
-
 			/* Stop if limit is reached*/
 			if (count >= maxbytes)
 				break;
 
 			/* Be sure read up to maxbytes limit next time */
-			if (BUFF_SIZE > (maxbytes - count))
+			if (maxbufsize > (maxbytes - count))
 				bufsize = maxbytes - count;
 		}
 	}
@@ -539,26 +641,263 @@ static bool create_zckindex(zckCtx *zck, int fd, size_t maxbytes)
 	return rstatus;
 }
 
+/*
+ * Create a zck context to index the source
+ */
+static zckCtx *create_src_index(int dst_fd)
+{
+	zckCtx *zck = zck_create();
+
+	if (!zck) {
+		ERROR("Cannot create ZCK Source %s",  zck_get_error(NULL));
+		zck_clear_error(NULL);
+		return NULL;
+	}
+
+	/*
+	 * Prepare zck for writing: the ZCK header must be computed from
+	 * the running source, with hashes for the uncompressed data
+	 */
+	if(!zck_init_write(zck, dst_fd)) {
+		ERROR("Cannot initialize ZCK for writing (%s), aborting..",
+			zck_get_error(zck));
+		goto fail;
+	}
+	if (!zck_set_ioption(zck, ZCK_UNCOMP_HEADER, 1)) {
+		ERROR("%s\n", zck_get_error(zck));
+		goto fail;
+	}
+	if (!zck_set_ioption(zck, ZCK_COMP_TYPE, ZCK_COMP_NONE)) {
+		ERROR("Error setting ZCK_COMP_NONE %s\n", zck_get_error(zck));
+		goto fail;
+	}
+	if (!zck_set_ioption(zck, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256)) {
+		ERROR("Error setting HASH Type %s\n", zck_get_error(zck));
+		goto fail;
+	}
+	if (!zck_set_ioption(zck, ZCK_NO_WRITE, 1)) {
+		WARN("ZCK does not support NO Write, use huge amount of RAM %s\n", zck_get_error(zck));
+	}
+
+	return zck;
+
+fail:
+	zck_free(&zck);
+	return NULL;
+}
+
+/*
+ * Split the source in regions, one for each worker. The
+ * source is split only if its size is known and each
+ * region is large enough.
+ */
+static bool split_source(struct hnd_priv *priv, int fd, int dst_fd)
+{
+	struct swupdate_cfg *cfg = get_swupdate_cfg();
+	size_t workers = cfg->delta_index_workers > 0 ? cfg->delta_index_workers : 1;
+	size_t total = priv->srcsize, size;
+	unsigned int i;
+
+	if (workers > 1 && !total) {
+		off_t end = lseek(fd, 0, SEEK_END);
+		if (end > 0)
+			total = end;
+	}
+	if (workers > total / MIN_REGION_SIZE)
+		workers = max(total / MIN_REGION_SIZE, (size_t)1);
+	size = total / workers / REGION_OVERLAP * REGION_OVERLAP;
+
+	priv->regions = calloc(workers, sizeof(*priv->regions));
+	if (!priv->regions) {
+		ERROR("OOM allocating source regions");
+		return false;
+	}
+	priv->nregions = workers;
+
+	for (i = 0; i < workers; i++) {
+		struct src_region *r = &priv->regions[i];
+
+		r->fd = fd;
+		r->offset = (off_t)i * size;
+		if (workers == 1)
+			r->len = priv->srcsize;
+		else if (i == workers - 1)
+			r->len = total - r->offset;
+		else
+			r->len = size + REGION_OVERLAP;
+		r->zck = create_src_index(dst_fd);
+		if (!r->zck)
+			return false;
+	}
+
+	return true;
+}
+
+static void *index_region(void *data)
+{
+	struct src_region *r = (struct src_region *)data;
+
+	(void)posix_fadvise(r->fd, r->offset, r->len, POSIX_FADV_SEQUENTIAL);
+	r->indexed = create_zckindex(r->zck, r->fd, r->offset, r->len);
+	if (r->indexed)
+		zck_generate_hashdb(r->zck);
+
+	return NULL;
+}
+
+/*
+ * Index all regions of the source, each region on its own
+ * thread if the source was split.
+ */
+static void index_source(struct hnd_priv *priv)
+{
+	bool *started;
+	unsigned int i;
+
+	if (priv->nregions == 1) {
+		index_region(&priv->regions[0]);
+		return;
+	}
+
+	TRACE("Indexing %s with %u threads", priv->srcdev, priv->nregions);
+	started = calloc(priv->nregions, sizeof(*started));
+	for (i = 0; i < priv->nregions; i++) {
+		struct src_region *r = &priv->regions[i];
+		int ret = -1;
+
+		if (started)
+			ret = pthread_create(&r->thread, NULL, index_region, r);
+		if (ret) {
+			/* index it here, just slower */
+			index_region(r);
+		} else
+			started[i] = true;
+	}
+	for (i = 0; i < priv->nregions; i++) {
+		if (started && started[i])
+			pthread_join(priv->regions[i].thread, NULL);
+	}
+	free(started);
+}
+
+/*
+ * Look for the chunks of the image in a region of the source.
+ * Chunks found in a previous region are kept.
+ */
+static void match_region(struct hnd_priv *priv, struct src_region *r, zckCtx *tgt)
+{
+	zckChunk *iter;
+
+	zck_find_matching_chunks(r->zck, tgt);
+	for (iter = zck_get_first_chunk(tgt); iter; iter = zck_get_next_chunk(iter)) {
+		ssize_t n = zck_get_chunk_number(iter);
+
+		if (!zck_get_chunk_valid(iter) || n < 0 || (size_t)n >= priv->nchunks ||
+		    priv->srcmap[n].chunk)
+			continue;
+		priv->srcmap[n].chunk = zck_get_src_chunk(iter);
+		priv->srcmap[n].offset = r->offset - r->hdrlen;
+	}
+}
+
+/*
+ * Find the chunks of the image (zckDst) in the source. With
+ * more regions, the header is parsed again for each of them,
+ * because the matching chunks are stored in the target context.
+ */
+static bool match_source(struct hnd_priv *priv, zckCtx *zckDst, int hdr_fd)
+{
+	unsigned int i;
+
+	priv->nchunks = max(zck_get_chunk_count(zckDst), (ssize_t)0);
+	priv->srcmap = calloc(priv->nchunks ? priv->nchunks : 1, sizeof(*priv->srcmap));
+	if (!priv->srcmap) {
+		ERROR("OOM allocating chunk map");
+		return false;
+	}
+
+	for (i = 0; i < priv->nregions; i++) {
+		struct src_region *r = &priv->regions[i];
+		zckCtx *tgt;
+
+		if (!r->indexed) {
+			WARN("ZCK Header form %s cannot be created, fallback to full download",
+				priv->srcdev);
+			continue;
+		}
+		if (priv->nregions == 1) {
+			match_region(priv, r, zckDst);
+			continue;
+		}
+
+		tgt = zck_create();
+		if (!tgt || lseek(hdr_fd, 0, SEEK_SET) < 0 || !zck_init_read(tgt, hdr_fd)) {
+			ERROR("Unable to read ZCK header again : %s", zck_get_error(tgt));
+			if (tgt)
+				zck_free(&tgt);
+			return false;
+		}
+		match_region(priv, r, tgt);
+		zck_free(&tgt);
+	}
+
+	return true;
+}
+
+/*
+ * Bytes sent by the server for a range request, the
+ * headers of each part are estimated
+ */
+#define RANGE_PART_OVERHEAD	256
+
+static size_t range_size(zck_range *range)
+{
+	zck_range_item *item;
+	size_t size = 0;
+
+	for (item = range->first; item; item = item->next)
+		size += item->end - item->start + 1 + RANGE_PART_OVERHEAD;
+
+	return size;
+}
 
 /*
  * Chunks must be retrieved from network, prepare an send
- * a request for the downloader
+ * a request for the downloader for the chunks starting at
+ * chunk. next is set to the first chunk not requested.
+ * If other requests are running, the request is sent only
+ * if the downloader can buffer its answers: a transfer
+ * waiting for the handler stalls the connection, and the
+ * server could drop it.
  */
-static bool trigger_download(struct hnd_priv *priv)
+static bool trigger_download(struct hnd_priv *priv, zckChunk *chunk, zckChunk **next,
+			     bool *sent)
 {
 	range_request_t *req = NULL;
 	zckCtx *tgt = priv->tgt;
-	size_t reqlen;
+	size_t reqlen, size;
 	zck_range *range;
+	zckChunk *after;
 	char *http_range;
 	bool status = true;
 
-
-	priv->boundary[0] = '\0';
-
-	range = zchunk_get_missing_range(tgt, priv->chunk, priv->max_ranges);
+	*sent = false;
+	range = zchunk_get_missing_range(tgt, chunk, priv->max_ranges,
+					 is_src_chunk, priv, &after);
 	if (!range)
 		return false;
+	if (!zchunk_get_range_count(range)) {
+		/* all remaining chunks are in the source */
+		zchunk_range_free(&range);
+		*next = NULL;
+		return true;
+	}
+	size = range_size(range);
+	if (priv->dwlqueued && priv->dwlqueued + size > priv->dwlbudget) {
+		zchunk_range_free(&range);
+		return true;
+	}
+	*next = after;
 	http_range = zchunk_get_range_char(range);
 	TRACE("Range request : %s", http_range);
 
@@ -571,8 +910,10 @@ static bool trigger_download(struct hnd_priv *priv)
 	}
 
 	/* Store request id to compare later */
-	priv->reqid = req->id;
-	priv->range_type = NONE_RANGE;
+	priv->dwlids[priv->dwlpending] = req->id;
+	priv->dwlsizes[priv->dwlpending++] = size;
+	priv->dwlqueued += size;
+	*sent = true;
 
 	if (write(priv->pipetodwl, req, sizeof(*req)) != sizeof(*req)) {
 		ERROR("Cannot write all bytes to pipe");
@@ -580,12 +921,52 @@ static bool trigger_download(struct hnd_priv *priv)
 	}
 
 	free(req);
-	free(range);
+	zchunk_range_free(&range);
 	free(http_range);
 	priv->dwlrunning = true;
 	return status;
 }
 
+/*
+ * Keep up to window requests in flight, so that the
+ * downloader can run them concurrently and while chunks
+ * are copied from the source. Requests are sent in the
+ * order of the chunks, starting after the last requested
+ * chunk, as long as their answers fit in the buffer
+ * of the downloader.
+ */
+static bool send_downloads(struct hnd_priv *priv)
+{
+	bool sent = true;
+
+	while (sent && priv->dwlnext && priv->dwlpending < priv->window) {
+		if (!trigger_download(priv, priv->dwlnext, &priv->dwlnext, &sent))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * The downloader answers the requests in the same order,
+ * the next request to be processed is the oldest one.
+ */
+static bool next_download(struct hnd_priv *priv)
+{
+	if (!send_downloads(priv) || !priv->dwlpending)
+		return false;
+
+	priv->reqid = priv->dwlids[0];
+	priv->dwlcurrent = priv->dwlsizes[0];
+	priv->dwlpending--;
+	memmove(priv->dwlids, &priv->dwlids[1], priv->dwlpending * sizeof(priv->dwlids[0]));
+	memmove(priv->dwlsizes, &priv->dwlsizes[1], priv->dwlpending * sizeof(priv->dwlsizes[0]));
+	priv->range_type = NONE_RANGE;
+	priv->boundary[0] = '\0';
+
+	return true;
+}
+
 /*
  * drop all temporary data collected during download
  */
@@ -595,33 +976,71 @@ static void dwl_cleanup(struct hnd_priv *priv)
 	priv->parser = NULL;
 }
 
-static bool read_and_validate_package(struct hnd_priv *priv)
+/*
+ * Drop the requests sent to the downloader and not yet
+ * processed, the downloader stops their transfers.
+ * Answers already queued are skipped by their id.
+ */
+static void cancel_downloads(struct hnd_priv *priv)
+{
+	range_request_t *req;
+
+	if (!priv->dwlpending && priv->dwlstate == NOTRUNNING)
+		return;
+
+	req = calloc(1, sizeof(*req));
+	if (req)
+		req->type = RANGE_CANCEL;
+	if (!req || write(priv->pipetodwl, req, sizeof(*req)) != sizeof(*req))
+		WARN("Pending chunk requests cannot be canceled");
+	free(req);
+
+	dwl_cleanup(priv);
+	free(priv->current.buf);
+	priv->current.buf = NULL;
+	priv->dwlpending = 0;
+	priv->dwlqueued = 0;
+	priv->dwlcurrent = 0;
+	priv->dwlstate = NOTRUNNING;
+	priv->dwlrunning = false;
+}
+
+/*
+ * Read the next answer to the request id. Answers to other
+ * requests, for example to canceled ones, are skipped.
+ */
+bool delta_read_answer(int fd, uint32_t id, range_answer_t *answer)
 {
-	ssize_t nbytes = sizeof(range_answer_t);
-	range_answer_t *answer;
 	int count = -1;
-	uint32_t crc;
+	size_t nbytes;
+	ssize_t ret;
 
 	do {
 		count++;
 		if (count == 1)
 			DEBUG("id does not match in IPC, skipping..");
 
-		char *buf = (char *)priv->answer;
-		do {
-			ssize_t ret;
-			ret = read(priv->pipetodwl, buf, sizeof(range_answer_t));
-			if (ret < 0)
+		for (nbytes = 0; nbytes < sizeof(*answer); nbytes += ret) {
+			ret = read(fd, (char *)answer + nbytes, sizeof(*answer) - nbytes);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0)
 				return false;
-			buf += ret;
-			nbytes -= ret;
-		} while (nbytes > 0);
-		answer = priv->answer;
+		}
+	} while (answer->id != id);
 
-		if (nbytes < 0)
-			return false;
-	} while (answer->id != priv->reqid);
+	return true;
+}
+
+static bool read_and_validate_package(struct hnd_priv *priv)
+{
+	range_answer_t *answer = priv->answer;
+	uint32_t crc;
 
+	if (!delta_read_answer(priv->pipetodwl, priv->reqid, answer))
+		return false;
 
 	if (answer->type == RANGE_ERROR) {
 	    ERROR("Transfer was unsuccessful, aborting...");
@@ -759,9 +1178,19 @@ static bool copy_network_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 	priv->chunk = *dstChunk;
 	priv->error_in_parser = false;
 	while (1) {
+		/*
+		 * A chunk of the source could not be copied, the
+		 * requests sent after it are replaced by new ones
+		 * starting from the chunk
+		 */
+		if (priv->srcstale) {
+			cancel_downloads(priv);
+			priv->dwlnext = priv->chunk;
+			priv->srcstale = false;
+		}
 		switch (priv->dwlstate) {
 		case NOTRUNNING:
-			if (!trigger_download(priv))
+			if (!next_download(priv))
 				return false;
 			priv->dwlstate = WAITING_FOR_HEADERS;
 			break;
@@ -812,6 +1241,8 @@ static bool copy_network_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 			if (priv->range_type == SINGLE_RANGE)
 				multipart_data_end(priv->parser);
 			dwl_cleanup(priv);
+			priv->dwlqueued -= priv->dwlcurrent;
+			priv->dwlcurrent = 0;
 			priv->dwlstate = NOTRUNNING;
 			*dstChunk = priv->chunk;
 			return !priv->error_in_parser;
@@ -823,59 +1254,62 @@ static bool copy_network_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 
 /*
  * This writes a chunk from an existing copy on the source path
- * The chunk to be copied is retrieved via zck_get_src_chunk()
+ * The chunk to be copied is retrieved via get_src_chunk()
+ * A chunk that does not match its hash anymore, for example
+ * because the cached index of the source is stale, is set as
+ * missing and it must be downloaded.
  */
 static bool copy_existing_chunks(zckChunk **dstChunk, struct hnd_priv *priv)
 {
-	unsigned long offset = 0;
-	uint32_t checksum;
-	int ret;
-	unsigned char hash[SHA256_HASH_LENGTH];
+	unsigned char *buf = NULL, *tmp;
+	size_t bufsize = 0;
+	zckChunk *chunk;
+	size_t start;
+	bool ret = true;
 
-	while (*dstChunk && zck_get_chunk_valid(*dstChunk)) {
-		zckChunk *chunk	= zck_get_src_chunk(*dstChunk);
+	while (*dstChunk && (chunk = get_src_chunk(priv, *dstChunk, &start))) {
 		size_t len = zck_get_chunk_size(chunk);
-		size_t start = zck_get_chunk_start(chunk);
-		char *sha = zck_get_chunk_digest_uncompressed(chunk);
 		if (!len) {
 			*dstChunk = zck_get_next_chunk(*dstChunk);
 			continue;
 		}
-		if (!sha) {
-			ERROR("Cannot get hash for chunk %ld", zck_get_chunk_number(chunk));
-			return false;
-		}
-		if (lseek(priv->fdsrc, start, SEEK_SET) < 0) {
-			ERROR("Seeking source file at %lu", start);
-			free(sha);
-			return false;
+		if (len > bufsize) {
+			tmp = realloc(buf, len);
+			if (!tmp) {
+				ERROR("OOM copying chunk %ld", zck_get_chunk_number(chunk));
+				ret = false;
+				break;
+			}
+			buf = tmp;
+			bufsize = len;
 		}
 
-		ascii_to_hash(hash, sha);
-
 		if (priv->debugchunks)
 			TRACE("Copying chunk %ld from SRC %ld, start %ld size %ld",
 				zck_get_chunk_number(*dstChunk),
 				zck_get_chunk_number(chunk),
 				start,
 				len);
-		struct swupdate_copy copy = {
-			.fdin = priv->fdsrc,
-			.out = &priv->fdout,
-			.nbytes = len,
-			.offs = &offset,
-			.checksum = &checksum,
-			.hash = hash,
-		};
-		ret = copyfile(&copy);
-
-		free(sha);
-		if (ret)
-			return false;
+		if (!delta_read_chunk(chunk, priv->fdsrc, start, buf)) {
+			WARN("Chunk %ld does not match the source at %lu, downloading it",
+				zck_get_chunk_number(*dstChunk), start);
+			priv->srcmap[zck_get_chunk_number(*dstChunk)].chunk = NULL;
+			priv->srcstale = true;
+			if (priv->cachedir)
+				delta_cache_drop(priv->cachedir, priv->srcdev);
+			break;
+		}
+		if (delta_write(priv, buf, len)) {
+			ret = false;
+			break;
+		}
+		delta_chunk_written(priv);
 
 		*dstChunk = zck_get_next_chunk(*dstChunk);
 	}
-	return true;
+
+	free(buf);
+	return ret;
 }
 
 #define PIPE_READ  0
@@ -891,6 +1325,7 @@ static int install_delta(struct img_type *img,
 	int dst_fd = -1, in_fd = -1, mem_fd = -1;
 	zckChunk *iter;
 	zckCtx *zckSrc = NULL, *zckDst = NULL;
+	bool cached = false;
 	char *FIFO = NULL;
 	pthread_t chain_handler_thread_id;
 	int pipes[2];
@@ -927,6 +1362,17 @@ static int install_delta(struct img_type *img,
 	}
 
 
+	int window = get_swupdate_cfg()->delta_download_window;
+	if (window > MAX_DOWNLOAD_WINDOW)
+		window = MAX_DOWNLOAD_WINDOW;
+	priv->window = window > 0 ? window : 1;
+	/*
+	 * The answers of the requests sent in advance can use
+	 * only half of the buffer of the downloader
+	 */
+	int spool = get_swupdate_cfg()->delta_download_buffer;
+	priv->dwlbudget = (size_t)(spool > 0 ? spool : DEFAULT_DOWNLOAD_SPOOL) * 1024 / 2;
+
 	priv->pipetodwl = pctl_getfd_from_type(SOURCE_CHUNKS_DOWNLOADER);
 
 	if (priv->pipetodwl < 0) {
@@ -949,7 +1395,27 @@ static int install_delta(struct img_type *img,
 		goto cleanup;
 	}
 
-	if (priv->detectsrcsize) {
+	in_fd = open(priv->srcdev, O_RDONLY);
+	if(in_fd < 0) {
+		ERROR("Unable to open Source : %s for reading", priv->srcdev);
+		goto cleanup;
+	}
+
+	/*
+	 * Set ZCK log level
+	 */
+	zck_set_log_level(priv->zckloglevel >= 0 ?
+				priv->zckloglevel : map_swupdate_to_zck_loglevel(loglevel));
+	zck_set_log_callback(zck_log_toswupdate);
+
+	/*
+	 * An index of the source stored by a previous update
+	 * saves reading the whole source
+	 */
+	if (priv->cachedir)
+		zckSrc = delta_cache_load(priv->cachedir, priv->srcdev, in_fd);
+
+	if (!zckSrc && priv->detectsrcsize) {
 #if defined(CONFIG_DISKFORMAT)
 		char *filesystem = diskformat_fs_detect(priv->srcdev);
 		if (filesystem) {
@@ -972,30 +1438,32 @@ static int install_delta(struct img_type *img,
 #endif
 	}
 
-	in_fd = open(priv->srcdev, O_RDONLY);
-	if(in_fd < 0) {
-		ERROR("Unable to open Source : %s for reading", priv->srcdev);
-		goto cleanup;
-	}
-
-	/*
-	 * Set ZCK log level
-	 */
-	zck_set_log_level(priv->zckloglevel >= 0 ?
-				priv->zckloglevel : map_swupdate_to_zck_loglevel(loglevel));
-	zck_set_log_callback(zck_log_toswupdate);
-
 	/*
 	 * Initialize zck context for source and destination
-	 * source : device / file of current software
+	 * source : device / file of current software, one
+	 *          context for each region
 	 * dst : final software to be installed
 	 */
-	zckSrc = zck_create();
-	if (!zckSrc) {
-		ERROR("Cannot create ZCK Source %s",  zck_get_error(NULL));
-		zck_clear_error(NULL);
+	if (zckSrc) {
+		priv->regions = calloc(1, sizeof(*priv->regions));
+		if (!priv->regions) {
+			ERROR("OOM allocating source regions");
+			goto cleanup;
+		}
+		priv->nregions = 1;
+		priv->regions[0].zck = zckSrc;
+		/*
+		 * The chunk starts of the cached index include its
+		 * header, the index of a scanned source has none
+		 */
+		priv->regions[0].hdrlen = zck_get_header_length(zckSrc);
+		priv->regions[0].indexed = true;
+		zckSrc = NULL;
+		cached = true;
+	} else if (!split_source(priv, in_fd, dst_fd)) {
 		goto cleanup;
 	}
+
 	zckDst = zck_create();
 	if (!zckDst) {
 		ERROR("Cannot create ZCK Destination %s",  zck_get_error(NULL));
@@ -1003,16 +1471,6 @@ static int install_delta(struct img_type *img,
 		goto cleanup;
 	}
 
-	/*
-	 * Prepare zckSrc for writing: the ZCK header must be computed from
-	 * the running source
-	 */
-	if(!zck_init_write(zckSrc, dst_fd)) {
-		ERROR("Cannot initialize ZCK for writing (%s), aborting..",
-			zck_get_error(zckSrc));
-		goto cleanup;
-	}
-
 	mem_fd = memfd_create("zchunk header", 0);
 	if (mem_fd == -1) {
 		ERROR("Cannot create memory file: %s", strerror(errno));
@@ -1038,34 +1496,23 @@ static int install_delta(struct img_type *img,
 		goto cleanup;
 	}
 
-	TRACE("ZCK Header read successfully from SWU, creating header from %s",
-		priv->srcdev);
 	/*
 	 * Now read completely source and generate the index file
-	 * with hashes for the uncompressed data
+	 * with hashes for the uncompressed data, unless it was cached
 	 */
-	if (!zck_set_ioption(zckSrc, ZCK_UNCOMP_HEADER, 1)) {
-		ERROR("%s\n", zck_get_error(zckSrc));
-		goto cleanup;
-	}
-	if (!zck_set_ioption(zckSrc, ZCK_COMP_TYPE, ZCK_COMP_NONE)) {
-		ERROR("Error setting ZCK_COMP_NONE %s\n", zck_get_error(zckSrc));
-		goto cleanup;
-	}
-	if (!zck_set_ioption(zckSrc, ZCK_HASH_CHUNK_TYPE, ZCK_HASH_SHA256)) {
-		ERROR("Error setting HASH Type %s\n", zck_get_error(zckSrc));
-		goto cleanup;
-	}
-	if (!zck_set_ioption(zckSrc, ZCK_NO_WRITE, 1)) {
-		WARN("ZCK does not support NO Write, use huge amount of RAM %s\n", zck_get_error(zckSrc));
-	}
-
-	if (!create_zckindex(zckSrc, in_fd, priv->srcsize)) {
-		WARN("ZCK Header form %s cannot be created, fallback to full download",
+	if (cached) {
+		TRACE("ZCK Header read successfully from SWU, using cached header of %s",
 			priv->srcdev);
+		zck_generate_hashdb(priv->regions[0].zck);
 	} else {
-		zck_generate_hashdb(zckSrc);
-		zck_find_matching_chunks(zckSrc, zckDst);
+		TRACE("ZCK Header read successfully from SWU, creating header from %s",
+			priv->srcdev);
+		index_source(priv);
+	}
+
+	if (!match_source(priv, zckDst, mem_fd)) {
+		ret = -ENOMEM;
+		goto cleanup;
 	}
 
 	size_t uncompressed_size = get_total_size(zckDst, priv);
@@ -1081,6 +1528,7 @@ static int install_delta(struct img_type *img,
 	struct chain_handler_data *priv_hnd;
 	priv_hnd = &priv->chain_handler_data;
 	memcpy(&priv_hnd->img, img, sizeof(*img));
+	dict_shallow_copy(&priv_hnd->img.properties, &img->properties);
 	priv_hnd->img.compressed = COMPRESSED_FALSE;
 	priv_hnd->img.size = uncompressed_size;
 	memset(priv_hnd->img.sha256, 0, SHA256_HASH_LENGTH);
@@ -1096,15 +1544,25 @@ static int install_delta(struct img_type *img,
 
 	priv->fdout = pipes[PIPE_WRITE];
 
+	/*
+	 * The index of the installed image is stored for the next
+	 * update, if the chained handler writes it to a device
+	 */
+	if (priv->cachedir && strlen(img->device) && !img->seek)
+		delta_index_start(&priv->index, priv->cachedir, img->device);
+
 	ret = 0;
 
 	iter = zck_get_first_chunk(zckDst);
 	bool success;
 	priv->tgt = zckDst;
 	priv->fdsrc = in_fd;
+	priv->dwlnext = iter;
 	while (iter) {
-		if (zck_get_chunk_valid(iter)) {
-			success = copy_existing_chunks(&iter, priv);
+		if (is_src_chunk(iter, priv)) {
+			/* the next missing chunks are downloaded in the meantime */
+			success = send_downloads(priv) &&
+				  copy_existing_chunks(&iter, priv);
 		} else {
 			success = copy_network_chunks(&iter, priv);
 		}
@@ -1127,8 +1585,18 @@ static int install_delta(struct img_type *img,
 	ret = (unsigned long)status;
 	TRACE("Chained handler returned %d", ret);
 
+	if (!ret && priv->index.zck)
+		delta_index_commit(&priv->index);
+
 cleanup:
+	if (ret)
+		cancel_downloads(priv);
+	delta_index_discard(&priv->index);
 	if (zckSrc) zck_free(&zckSrc);
+	for (unsigned int i = 0; i < priv->nregions; i++)
+		if (priv->regions[i].zck) zck_free(&priv->regions[i].zck);
+	free(priv->regions);
+	free(priv->srcmap);
 	if (zckDst) zck_free(&zckDst);
 	if (dst_fd >= 0) close(dst_fd);
 	if (in_fd >= 0) close(in_fd);
@@ -8,15 +8,21 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define RANGE_PAYLOAD_SIZE (32 * 1024)
+
+/* KiB of answers buffered by the downloader */
+#define DEFAULT_DOWNLOAD_SPOOL	8192
+
 typedef enum {
 	RANGE_GET,
 	RANGE_HEADERS,
 	RANGE_DATA,
 	RANGE_COMPLETED,
-	RANGE_ERROR
+	RANGE_ERROR,
+	RANGE_CANCEL	/* drop all requests not yet answered */
 } request_type;
 
 typedef struct {
@@ -35,3 +41,6 @@ typedef struct {
 	uint32_t crc;
 	char data[RANGE_PAYLOAD_SIZE]; /* Payload */
 } range_answer_t;
+
+/* Read the answer to request id from fd, skipping the other ones */
+bool delta_read_answer(int fd, uint32_t id, range_answer_t *answer);
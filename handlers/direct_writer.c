@@ -0,0 +1,361 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
+
+#include "util.h"
+#include "direct_writer.h"
+
+/*
+ * Linux AIO is used through the syscalls,
+ * no need for libaio
+ */
+static int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			struct io_event *events)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+static size_t get_alignment(int fd)
+{
+	struct stat st;
+	int ssz;
+
+	if (fstat(fd, &st))
+		return 4096;
+	if (S_ISBLK(st.st_mode) && !ioctl(fd, BLKSSZGET, &ssz) && ssz > 0)
+		return ssz;
+
+	return max_t(size_t, st.st_blksize, 512);
+}
+
+static unsigned char *slot_buffer(struct direct_writer *w, unsigned int slot)
+{
+	return w->buffers + (size_t)slot * w->chunk;
+}
+
+/*
+ * Collect completed writes, waiting for at least min_nr
+ */
+static int reap(struct direct_writer *w, unsigned int min_nr)
+{
+	struct io_event *events = w->events;
+	struct iocb *iocbs = w->iocbs;
+	int n;
+
+	if (!w->inflight)
+		return 0;
+
+	do {
+		n = io_getevents(w->ctx, min(min_nr, w->inflight), w->inflight,
+				 events);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		ERROR("Waiting for writes failed: %s", strerror(errno));
+		return -errno;
+	}
+
+	for (int i = 0; i < n; i++) {
+		unsigned int slot = events[i].data;
+
+		if (events[i].res != (__s64)iocbs[slot].aio_nbytes) {
+			ERROR("Write at offset %lld failed: %s",
+			      (long long)iocbs[slot].aio_offset,
+			      events[i].res < 0 ?
+				strerror(-events[i].res) : "short write");
+			w->error = -EIO;
+		}
+		w->free_slots[w->nfree++] = slot;
+		w->inflight--;
+	}
+
+	return w->error;
+}
+
+static int write_sync(struct direct_writer *w, const unsigned char *buf,
+		      size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(w->fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			ERROR("cannot write %zu bytes at offset %lld: %s", len,
+			      (long long)offset, ret < 0 ? strerror(errno) : "short write");
+			return -EIO;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue the buffer being filled, the slot is given
+ * back to the free list when the write is completed
+ */
+static int submit(struct direct_writer *w, size_t len)
+{
+	unsigned int slot = w->cur;
+	struct iocb *iocb;
+	int ret;
+
+	w->cur = -1;
+
+	if (!w->ctx) {
+		ret = write_sync(w, slot_buffer(w, slot), len, w->offset);
+		w->free_slots[w->nfree++] = slot;
+		w->offset += len;
+		return ret;
+	}
+
+	iocb = &((struct iocb *)w->iocbs)[slot];
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = slot;
+	iocb->aio_lio_opcode = IOCB_CMD_PWRITE;
+	iocb->aio_fildes = w->fd;
+	iocb->aio_buf = (uintptr_t)slot_buffer(w, slot);
+	iocb->aio_nbytes = len;
+	iocb->aio_offset = w->offset;
+
+	for (;;) {
+		ret = io_submit(w->ctx, 1, &iocb);
+		if (ret == 1)
+			break;
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* queue full, wait for a write to complete and retry */
+		if (ret < 0 && errno == EAGAIN && w->inflight) {
+			ret = reap(w, 1);
+			if (ret)
+				return ret;
+			continue;
+		}
+		ERROR("Submitting write failed: %s", strerror(errno));
+		w->free_slots[w->nfree++] = slot;
+		return -EIO;
+	}
+	w->inflight++;
+	w->offset += len;
+
+	return 0;
+}
+
+int direct_writer_init(struct direct_writer *w, int fd, unsigned int depth,
+		       size_t chunk)
+{
+	size_t memalign;
+
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->cur = -1;
+
+	if (!depth)
+		depth = DIRECT_WRITER_DEPTH;
+	w->depth = min_t(unsigned int, depth, DIRECT_WRITER_MAX_DEPTH);
+
+	w->flags = fcntl(fd, F_GETFL);
+	if (w->flags < 0 || fcntl(fd, F_SETFL, w->flags | O_DIRECT) < 0) {
+		WARN("O_DIRECT not supported on fd %d: %s", fd, strerror(errno));
+		return -EINVAL;
+	}
+	w->direct = true;
+
+	w->align = get_alignment(fd);
+	w->chunk = ROUND_UP(max_t(size_t, chunk, DIRECT_WRITER_MIN_CHUNK), w->align);
+	memalign = max_t(size_t, w->align, sysconf(_SC_PAGESIZE));
+
+	if (posix_memalign((void **)&w->buffers, memalign, w->chunk * w->depth)) {
+		w->buffers = NULL;
+		goto fail;
+	}
+	w->free_slots = calloc(w->depth, sizeof(*w->free_slots));
+	w->iocbs = calloc(w->depth, sizeof(struct iocb));
+	w->events = calloc(w->depth, sizeof(struct io_event));
+	if (!w->free_slots || !w->iocbs || !w->events)
+		goto fail;
+
+	for (unsigned int i = 0; i < w->depth; i++)
+		w->free_slots[w->nfree++] = i;
+
+	if (io_setup(w->depth, (aio_context_t *)&w->ctx) < 0) {
+		TRACE("Linux AIO not available (%s), writing synchronously",
+		      strerror(errno));
+		w->ctx = 0;
+	}
+
+	TRACE("Direct I/O: %u buffers of %zu bytes, alignment %zu",
+	      w->depth, w->chunk, w->align);
+
+	return 0;
+
+fail:
+	ERROR("Direct I/O writer: out of memory");
+	fcntl(fd, F_SETFL, w->flags);
+	free(w->buffers);
+	free(w->free_slots);
+	free(w->iocbs);
+	free(w->events);
+	return -ENOMEM;
+}
+
+/*
+ * copyimage() callback
+ */
+int direct_write(void *out, const void *buf, size_t len)
+{
+	struct direct_writer *w = (struct direct_writer *)out;
+	const unsigned char *data = buf;
+	size_t n;
+	int ret;
+
+	if (w->error)
+		return w->error;
+
+	/*
+	 * copyfile() has already moved the file offset
+	 * to the image offset, if any
+	 */
+	if (!w->started) {
+		w->offset = lseek(w->fd, 0, SEEK_CUR);
+		if (w->offset < 0)
+			w->offset = 0;
+		if (w->offset % w->align) {
+			WARN("Offset %lld not aligned to %zu bytes, O_DIRECT disabled",
+			     (long long)w->offset, w->align);
+			fcntl(w->fd, F_SETFL, w->flags);
+			w->direct = false;
+		}
+		w->started = true;
+	}
+
+	while (len) {
+		if (w->cur < 0) {
+			if (!w->nfree) {
+				ret = reap(w, 1);
+				if (ret)
+					return ret;
+			}
+			w->cur = w->free_slots[--w->nfree];
+			w->fill = 0;
+		}
+
+		n = min(len, w->chunk - w->fill);
+		memcpy(slot_buffer(w, w->cur) + w->fill, data, n);
+		w->fill += n;
+		data += n;
+		len -= n;
+
+		if (w->fill == w->chunk) {
+			ret = submit(w, w->fill);
+			if (ret) {
+				w->error = ret;
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write the last partial buffer, wait for all writes
+ * and flush the device. The writer is released
+ * in any case, the fd is left open.
+ */
+int direct_writer_finish(struct direct_writer *w)
+{
+	unsigned char *tail = NULL;
+	size_t aligned = 0, rest = 0;
+	off_t tail_offset = 0;
+	int ret;
+
+	if (w->cur >= 0 && !w->error) {
+		tail = slot_buffer(w, w->cur);
+		rest = w->fill;
+		if (w->direct) {
+			aligned = rest - rest % w->align;
+			rest -= aligned;
+		} else {
+			aligned = rest;
+			rest = 0;
+		}
+		tail += aligned;
+		tail_offset = w->offset + aligned;
+		if (aligned) {
+			ret = submit(w, aligned);
+			if (ret)
+				w->error = ret;
+		}
+	}
+
+	while (w->inflight) {
+		ret = reap(w, w->inflight);
+		if (ret && !w->error)
+			w->error = ret;
+		if (ret < 0 && ret != -EIO)
+			break;
+	}
+
+	/*
+	 * The tail cannot be written with O_DIRECT
+	 * if its size is not a multiple of the block size
+	 */
+	fcntl(w->fd, F_SETFL, w->flags);
+	if (rest && !w->error)
+		w->error = write_sync(w, tail, rest, tail_offset);
+
+	if (!w->error && fsync(w->fd)) {
+		ERROR("Flushing device failed: %s", strerror(errno));
+		w->error = -EIO;
+	}
+
+	if (w->ctx)
+		io_destroy(w->ctx);
+	free(w->buffers);
+	free(w->free_slots);
+	free(w->iocbs);
+	free(w->events);
+
+	ret = w->error;
+	w->buffers = NULL;
+	w->free_slots = NULL;
+	w->iocbs = NULL;
+	w->events = NULL;
+	w->ctx = 0;
+
+	return ret;
+}
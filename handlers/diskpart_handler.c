@@ -1110,9 +1110,9 @@ static int install_gpt_partition_image(struct img_type *img,
 	/*
 	 * Search partition to update
 	 */
-	pa = diskpart_get_partition_by_name(tb, img->volname);
+	pa = diskpart_get_partition_by_name(tb, IMG_STR(img->volname));
 	if (!pa) {
-		ERROR("Can't find partition %s", img->volname);
+		ERROR("Can't find partition %s", IMG_STR(img->volname));
 		ret = -1;
 		goto handler_exit;
 	}
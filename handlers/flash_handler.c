@@ -650,13 +650,13 @@ static int install_flash_image(struct img_type *img,
 {
 	int ret, mtdnum;
 
-	if (strlen(img->mtdname))
+	if (img->mtdname)
 		mtdnum = get_mtd_from_name(img->mtdname);
 	else
 		mtdnum = get_mtd_from_device(img->device);
 	if (mtdnum < 0) {
 		ERROR("Wrong MTD device in description: %s",
-			strlen(img->mtdname) ? img->mtdname : img->device);
+			img->mtdname ? img->mtdname : img->device);
 		return -EINVAL;
 	}
 
@@ -42,7 +42,7 @@ static int start_lua_script(struct img_type *img, void *data)
 	struct script_handler_data *script_data;
 	lua_State *L;
 	const char* tmp = get_tmpdirscripts();
-	char filename[MAX_IMAGE_FNAME + strlen(tmp) + 2 + strlen(img->type_data)];
+	char filename[MAX_IMAGE_FNAME + strlen(tmp) + 2 + strlen(IMG_STR(img->type_data))];
 
 	if (!data)
 		return -1;
@@ -126,7 +126,7 @@ static int start_lua_script(struct img_type *img, void *data)
 	if (global && !fnname && !load_script)
 		return 0;
 
-	ret = run_lua_script(L, filename, load_script, fnname, img->type_data);
+	ret = run_lua_script(L, filename, load_script, fnname, IMG_STR(img->type_data));
 
 	if (!global)
 		lua_close(L);
@@ -6,6 +6,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -18,6 +19,12 @@
 #include "swupdate_image.h"
 #include "handler.h"
 #include "util.h"
+#ifdef CONFIG_RAW_DIRECT_IO
+#include "direct_writer.h"
+#endif
+#ifdef CONFIG_RAW_SPARSE
+#include "sparse_writer.h"
+#endif
 
 void raw_image_handler(void);
 void raw_file_handler(void);
@@ -107,6 +114,78 @@ blkprotect_out:
 	return ret;
 }
 
+#ifdef CONFIG_RAW_DIRECT_IO
+/*
+ * Write the image bypassing the page cache. If direct I/O
+ * cannot be used on the device, nothing is read and
+ * the image is copied as usual.
+ */
+static int install_raw_image_direct(struct img_type *img, int fdout)
+{
+	struct direct_writer writer;
+	unsigned long depth;
+	const char *value;
+	int ret;
+
+	value = dict_get_value(&img->properties, "io-depth");
+	depth = value ? strtoul(value, NULL, 10) : 0;
+
+	if (direct_writer_init(&writer, fdout, depth,
+			       resolve_io_buffer_size(img->buffer_size, fdout)))
+		return copyimage(&fdout, img, NULL);
+
+	ret = copyimage(&writer, img, direct_write);
+
+	/* always flush and release the writer, keep the first error */
+	if (direct_writer_finish(&writer) && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+#endif
+
+#ifdef CONFIG_RAW_SPARSE
+/*
+ * Write the image without writing its zero blocks,
+ * returns 1 if the image is not sparse
+ */
+static int install_raw_image_sparse(struct img_type *img, int fdout)
+{
+	struct sparse_writer writer;
+	sparse_mode_t mode;
+	bool android;
+	int ret;
+
+	if (sparse_mode_from_string(dict_get_value(&img->properties, "sparse"),
+				    &mode)) {
+		ERROR("Unknown sparse mode %s",
+		      dict_get_value(&img->properties, "sparse"));
+		return -EINVAL;
+	}
+	android = strtobool(dict_get_value(&img->properties, "android-sparse"));
+	if (mode == SPARSE_NONE && !android)
+		return 1;
+
+	if (strtobool(dict_get_value(&img->properties, "direct-io")))
+		WARN("%s: direct-io is ignored for sparse images", img->fname);
+
+	ret = sparse_writer_init(&writer, fdout, mode, android,
+				 resolve_io_buffer_size(img->buffer_size, fdout));
+	if (ret)
+		return ret;
+
+	ret = copyimage(&writer, img, sparse_write);
+
+	/* always release the writer, keep the first error */
+	if (!ret)
+		ret = sparse_writer_finish(&writer);
+	else
+		sparse_writer_finish(&writer);
+
+	return ret;
+}
+#endif
+
 static int install_raw_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
@@ -126,7 +205,17 @@ static int install_raw_image(struct img_type *img,
 #if defined(__FreeBSD__)
 	ret = copyimage(&fdout, img, copy_write_padded);
 #else
-	ret = copyimage(&fdout, img, NULL);
+#ifdef CONFIG_RAW_SPARSE
+	ret = install_raw_image_sparse(img, fdout);
+#else
+	ret = 1;
+#endif
+#ifdef CONFIG_RAW_DIRECT_IO
+	if (ret == 1 && strtobool(dict_get_value(&img->properties, "direct-io")))
+		ret = install_raw_image_direct(img, fdout);
+#endif
+	if (ret == 1)
+		ret = copyimage(&fdout, img, NULL);
 #endif
 
 	if (prot_stat == 1) {
@@ -146,7 +235,7 @@ static int install_raw_file(struct img_type *img,
 	int fdout = -1;
 	int ret = -1;
 	int cleanup_ret = 0;
-	bool use_mount = (strlen(img->device) && strlen(img->filesystem)) ? true : false;
+	bool use_mount = (strlen(img->device) && img->filesystem) ? true : false;
 	char* DATADST_DIR = NULL;
 
 	if (strlen(img->path) == 0) {
@@ -155,10 +244,10 @@ static int install_raw_file(struct img_type *img,
 	}
 
 	if (use_mount) {
-		DATADST_DIR = swupdate_temporary_mount(MNT_DATA, img->device, img->filesystem);
+		DATADST_DIR = swupdate_temporary_mount(MNT_DATA, img->device, IMG_STR(img->filesystem));
 		if (!DATADST_DIR) {
 			ERROR("Device %s with filesystem %s cannot be mounted: %s",
-				img->device, img->filesystem, strerror(errno));
+				img->device, IMG_STR(img->filesystem), strerror(errno));
 			return -1;
 		}
 
@@ -248,7 +337,7 @@ cleanup:
 __attribute__((constructor))
 void raw_image_handler(void)
 {
-	register_handler("raw", install_raw_image,
+	register_parallel_handler("raw", install_raw_image,
 				IMAGE_HANDLER, NULL);
 }
 
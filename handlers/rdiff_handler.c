@@ -228,7 +228,7 @@ static int apply_rdiff_patch(struct img_type *img,
 	    strcmp(img->type, "rdiff_image") == 0 ? IMAGE_HANDLER : FILE_HANDLER;
 
 	char *mountpoint = NULL;
-	bool use_mount = (strlen(img->device) && strlen(img->filesystem)) ? true : false;
+	bool use_mount = (strlen(img->device) && img->filesystem) ? true : false;
 
 	char *base_file_filename = NULL;
 	char *dest_file_filename = NULL;
@@ -281,11 +281,11 @@ static int apply_rdiff_patch(struct img_type *img,
 
 		base_file_filename = img->path;
 		if (use_mount) {
-			mountpoint = swupdate_temporary_mount(MNT_DATA, img->device, img->filesystem);
+			mountpoint = swupdate_temporary_mount(MNT_DATA, img->device, IMG_STR(img->filesystem));
 
 			if (!mountpoint) {
 				ERROR("Device %s with filesystem %s cannot be mounted",
-					  img->device, img->filesystem);
+					  img->device, IMG_STR(img->filesystem));
 				ret = -1;
 				goto cleanup;
 			}
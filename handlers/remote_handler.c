@@ -162,7 +162,7 @@ static int install_remote_image(struct img_type *img,
 	struct RHmsg RHmessage;
 	char bufcmd[80];
 
-	len = strlen(img->type_data) + strlen(get_tmpdir()) + strlen("ipc://") + 4;
+	len = strlen(IMG_STR(img->type_data)) + strlen(get_tmpdir()) + strlen("ipc://") + 4;
 
 	/*
 	 * Allocate maximum string
@@ -173,7 +173,7 @@ static int install_remote_image(struct img_type *img,
 		return -ENOMEM;
 	}
 	snprintf(connect_string, len, "ipc://%s%s", get_tmpdir(),
-			img->type_data);
+			IMG_STR(img->type_data));
 
 	ret = zmq_connect(request, connect_string);
 	if (ret < 0) {
@@ -0,0 +1,620 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+#include "util.h"
+#include "sparse_writer.h"
+
+/*
+ * Android sparse image format, see
+ * system/core/libsparse/sparse_format.h in AOSP
+ */
+#define ANDROID_SPARSE_MAGIC		0xed26ff3a
+#define ANDROID_SPARSE_MAJOR		1
+#define ANDROID_FILE_HDR_SIZE		28
+#define ANDROID_CHUNK_HDR_SIZE		12
+#define ANDROID_CHUNK_RAW		0xCAC1
+#define ANDROID_CHUNK_FILL		0xCAC2
+#define ANDROID_CHUNK_DONT_CARE		0xCAC3
+#define ANDROID_CHUNK_CRC32		0xCAC4
+
+enum {
+	AS_FILE_HEADER,
+	AS_CHUNK_HEADER,
+	AS_RAW,
+	AS_FILL,
+	AS_SKIP,
+	AS_DONE
+};
+
+static const struct {
+	const char *name;
+	sparse_mode_t mode;
+} sparse_modes[] = {
+	{"skip", SPARSE_SKIP},
+	{"discard", SPARSE_DISCARD},
+	{"zeroout", SPARSE_ZEROOUT},
+};
+
+int sparse_mode_from_string(const char *s, sparse_mode_t *mode)
+{
+	if (!s || !strlen(s) || !strcmp(s, "false")) {
+		*mode = SPARSE_NONE;
+		return 0;
+	}
+	/* "true" means the safe choice */
+	if (!strcmp(s, "true")) {
+		*mode = SPARSE_ZEROOUT;
+		return 0;
+	}
+	for (unsigned int i = 0; i < ARRAY_SIZE(sparse_modes); i++) {
+		if (!strcmp(s, sparse_modes[i].name)) {
+			*mode = sparse_modes[i].mode;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * A block is zero if its first byte is zero and it is
+ * equal to itself shifted by one byte: memcmp() is
+ * vectorized by the C library
+ */
+static bool is_zero(const unsigned char *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+static int write_at(struct sparse_writer *w, const unsigned char *buf,
+		    size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(w->fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			ERROR("cannot write %zu bytes at offset %lld: %s", len,
+			      (long long)offset, ret < 0 ? strerror(errno) : "short write");
+			return -EIO;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int flush_data(struct sparse_writer *w)
+{
+	int ret;
+
+	if (!w->dfill)
+		return 0;
+
+	ret = write_at(w, w->data, w->dfill, w->pos - w->dfill);
+	w->written += w->dfill;
+	w->dfill = 0;
+
+	return ret;
+}
+
+static int write_zeroes(struct sparse_writer *w, off_t start, uint64_t len)
+{
+	size_t n;
+	int ret;
+
+	if (!w->zeroes) {
+		w->zeroes = calloc(1, w->chunk);
+		if (!w->zeroes)
+			return -ENOMEM;
+	}
+
+	while (len) {
+		n = min_t(uint64_t, len, w->chunk);
+		ret = write_at(w, w->zeroes, n, start);
+		if (ret)
+			return ret;
+		start += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int fill_zeroes(struct sparse_writer *w, off_t start, uint64_t len)
+{
+	w->skipped -= len;
+	w->written += len;
+
+	return write_zeroes(w, start, len);
+}
+
+/*
+ * BLKDISCARD and BLKZEROOUT require ranges aligned to the logical
+ * block size: only the aligned middle of the run is handed to the
+ * device. Returns 1 if the run does not contain an aligned block.
+ */
+static int discard_range(struct sparse_writer *w, off_t start, uint64_t len,
+			 uint64_t *astart, uint64_t *aend)
+{
+	uint64_t range[2];
+	int lbsize;
+
+	if (!w->lbsize) {
+		if (ioctl(w->fd, BLKSSZGET, &lbsize) || lbsize <= 0)
+			lbsize = 512;
+		w->lbsize = lbsize;
+	}
+
+	*astart = ROUND_UP((uint64_t)start, w->lbsize);
+	*aend = ROUND_DOWN((uint64_t)start + len, w->lbsize);
+	if (*astart >= *aend)
+		return 1;
+
+	range[0] = *astart;
+	range[1] = *aend - *astart;
+
+	return ioctl(w->fd, w->mode == SPARSE_DISCARD ? BLKDISCARD : BLKZEROOUT,
+		     range);
+}
+
+static int flush_zeroes(struct sparse_writer *w)
+{
+	off_t start = w->pos - w->zlen;
+	uint64_t len = w->zlen;
+	uint64_t astart, aend;
+	struct stat st;
+	int ret;
+
+	if (!len)
+		return 0;
+	w->zlen = 0;
+	w->skipped += len;
+
+	if (w->mode == SPARSE_SKIP)
+		return 0;
+
+	if (!w->zero_fallback && !fstat(w->fd, &st)) {
+		if (S_ISBLK(st.st_mode)) {
+			ret = discard_range(w, start, len, &astart, &aend);
+			if (!ret) {
+				/* unaligned head and tail */
+				ret = fill_zeroes(w, start, astart - start);
+				if (!ret)
+					ret = fill_zeroes(w, aend, start + len - aend);
+				return ret;
+			}
+			if (ret > 0)
+				return fill_zeroes(w, start, len);
+		}
+		if (S_ISREG(st.st_mode) &&
+		    !fallocate(w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       start, len))
+			return 0;
+		WARN("Cannot %s %llu bytes at %lld (%s), writing zeroes",
+		     w->mode == SPARSE_DISCARD ? "discard" : "zero out",
+		     (unsigned long long)len, (long long)start, strerror(errno));
+		w->zero_fallback = true;
+	}
+
+	return fill_zeroes(w, start, len);
+}
+
+static int add_data(struct sparse_writer *w, const unsigned char *buf, size_t len)
+{
+	size_t n;
+	int ret;
+
+	ret = flush_zeroes(w);
+	if (ret)
+		return ret;
+
+	while (len) {
+		n = min(len, w->chunk - w->dfill);
+		memcpy(w->data + w->dfill, buf, n);
+		w->dfill += n;
+		w->pos += n;
+		buf += n;
+		len -= n;
+		if (w->dfill == w->chunk) {
+			ret = flush_data(w);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int add_zeroes(struct sparse_writer *w, uint64_t len)
+{
+	int ret = flush_data(w);
+
+	w->zlen += len;
+	w->pos += len;
+
+	return ret;
+}
+
+static int add_block(struct sparse_writer *w, const unsigned char *buf, size_t len)
+{
+	if (w->mode != SPARSE_NONE && is_zero(buf, len))
+		return add_zeroes(w, len);
+
+	return add_data(w, buf, len);
+}
+
+/*
+ * Output of the uncompressed stream, split into blocks
+ */
+static int emit(struct sparse_writer *w, const unsigned char *buf, size_t len)
+{
+	size_t n;
+	int ret;
+
+	if (w->bfill) {
+		n = min(len, SPARSE_BLOCK_SIZE - w->bfill);
+		memcpy(w->block + w->bfill, buf, n);
+		w->bfill += n;
+		buf += n;
+		len -= n;
+		if (w->bfill < SPARSE_BLOCK_SIZE)
+			return 0;
+		w->bfill = 0;
+		ret = add_block(w, w->block, SPARSE_BLOCK_SIZE);
+		if (ret)
+			return ret;
+	}
+
+	while (len >= SPARSE_BLOCK_SIZE) {
+		ret = add_block(w, buf, SPARSE_BLOCK_SIZE);
+		if (ret)
+			return ret;
+		buf += SPARSE_BLOCK_SIZE;
+		len -= SPARSE_BLOCK_SIZE;
+	}
+
+	if (len) {
+		memcpy(w->block, buf, len);
+		w->bfill = len;
+	}
+
+	return 0;
+}
+
+static int emit_pending(struct sparse_writer *w)
+{
+	size_t len = w->bfill;
+
+	if (!len)
+		return 0;
+	w->bfill = 0;
+
+	return add_block(w, w->block, len);
+}
+
+/*
+ * Blocks whose content does not matter are left untouched
+ */
+static int emit_dont_care(struct sparse_writer *w, uint64_t len)
+{
+	int ret;
+
+	ret = emit_pending(w);
+	if (!ret)
+		ret = flush_data(w);
+	if (!ret)
+		ret = flush_zeroes(w);
+	w->pos += len;
+	w->skipped += len;
+
+	return ret;
+}
+
+static int emit_fill(struct sparse_writer *w, uint32_t value, uint64_t len)
+{
+	unsigned char pattern[SPARSE_BLOCK_SIZE];
+	size_t n;
+	int ret;
+
+	for (unsigned int i = 0; i < sizeof(pattern); i += sizeof(value))
+		memcpy(&pattern[i], &value, sizeof(value));
+
+	while (len) {
+		n = min_t(uint64_t, len, sizeof(pattern));
+		ret = emit(w, pattern, n);
+		if (ret)
+			return ret;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void android_next_chunk(struct android_sparse *as)
+{
+	if (as->chunks == as->total_chunks) {
+		as->state = AS_DONE;
+		return;
+	}
+	as->state = AS_CHUNK_HEADER;
+	as->hfill = 0;
+	as->hneed = as->chunk_hdr_sz;
+}
+
+static int android_file_header(struct android_sparse *as)
+{
+	const unsigned char *h = as->hdr;
+	uint32_t magic;
+	uint16_t major, file_hdr_sz, chunk_hdr_sz;
+
+	memcpy(&magic, h, 4);
+	memcpy(&major, h + 4, 2);
+	memcpy(&file_hdr_sz, h + 8, 2);
+	memcpy(&chunk_hdr_sz, h + 10, 2);
+	memcpy(&as->blk_sz, h + 12, 4);
+	memcpy(&as->total_blks, h + 16, 4);
+	memcpy(&as->total_chunks, h + 20, 4);
+
+	if (le32toh(magic) != ANDROID_SPARSE_MAGIC ||
+	    le16toh(major) != ANDROID_SPARSE_MAJOR) {
+		ERROR("Image is not an Android sparse image");
+		return -EINVAL;
+	}
+
+	as->file_hdr_sz = le16toh(file_hdr_sz);
+	as->chunk_hdr_sz = le16toh(chunk_hdr_sz);
+	as->blk_sz = le32toh(as->blk_sz);
+	as->total_blks = le32toh(as->total_blks);
+	as->total_chunks = le32toh(as->total_chunks);
+
+	if (as->file_hdr_sz < ANDROID_FILE_HDR_SIZE ||
+	    as->file_hdr_sz > sizeof(as->hdr) ||
+	    as->chunk_hdr_sz < ANDROID_CHUNK_HDR_SIZE ||
+	    as->chunk_hdr_sz > sizeof(as->hdr) ||
+	    !as->blk_sz || as->blk_sz % 4) {
+		ERROR("Android sparse image: unsupported header");
+		return -EINVAL;
+	}
+
+	/* the header can be longer, collect it entirely */
+	if (as->hneed < as->file_hdr_sz) {
+		as->hneed = as->file_hdr_sz;
+		return 0;
+	}
+
+	TRACE("Android sparse image: %u blocks of %u bytes in %u chunks",
+	      as->total_blks, as->blk_sz, as->total_chunks);
+	android_next_chunk(as);
+
+	return 0;
+}
+
+static int android_chunk_header(struct sparse_writer *w)
+{
+	struct android_sparse *as = &w->as;
+	uint16_t type;
+	uint32_t chunk_sz, total_sz, data_sz;
+	uint64_t len;
+
+	memcpy(&type, as->hdr, 2);
+	memcpy(&chunk_sz, as->hdr + 4, 4);
+	memcpy(&total_sz, as->hdr + 8, 4);
+	type = le16toh(type);
+	chunk_sz = le32toh(chunk_sz);
+	total_sz = le32toh(total_sz);
+
+	if (total_sz < as->chunk_hdr_sz) {
+		ERROR("Android sparse image: corrupted chunk %u", as->chunks);
+		return -EINVAL;
+	}
+	data_sz = total_sz - as->chunk_hdr_sz;
+	len = (uint64_t)chunk_sz * as->blk_sz;
+	as->chunks++;
+
+	switch (type) {
+	case ANDROID_CHUNK_RAW:
+		if (data_sz != len)
+			break;
+		as->state = AS_RAW;
+		as->remaining = len;
+		if (!len)
+			android_next_chunk(as);
+		return 0;
+	case ANDROID_CHUNK_FILL:
+		if (data_sz != sizeof(uint32_t))
+			break;
+		as->state = AS_FILL;
+		as->hfill = 0;
+		as->hneed = sizeof(uint32_t);
+		as->remaining = len;
+		return 0;
+	case ANDROID_CHUNK_DONT_CARE:
+		if (data_sz)
+			break;
+		android_next_chunk(as);
+		return emit_dont_care(w, len);
+	case ANDROID_CHUNK_CRC32:
+		if (data_sz != sizeof(uint32_t))
+			break;
+		as->state = AS_SKIP;
+		as->remaining = data_sz;
+		return 0;
+	default:
+		ERROR("Android sparse image: unknown chunk type 0x%x", type);
+		return -EINVAL;
+	}
+
+	ERROR("Android sparse image: chunk %u has wrong size", as->chunks - 1);
+	return -EINVAL;
+}
+
+/*
+ * Collect a header, returns the bytes consumed
+ */
+static size_t android_collect(struct android_sparse *as,
+			      const unsigned char *buf, size_t len)
+{
+	size_t n = min(len, as->hneed - as->hfill);
+
+	memcpy(as->hdr + as->hfill, buf, n);
+	as->hfill += n;
+
+	return n;
+}
+
+static int android_write(struct sparse_writer *w, const unsigned char *buf,
+			 size_t len)
+{
+	struct android_sparse *as = &w->as;
+	uint32_t value;
+	size_t n;
+	int ret = 0;
+
+	while (len && !ret) {
+		switch (as->state) {
+		case AS_FILE_HEADER:
+		case AS_CHUNK_HEADER:
+		case AS_FILL:
+			n = android_collect(as, buf, len);
+			if (as->hfill < as->hneed)
+				return 0;
+			if (as->state == AS_FILE_HEADER)
+				ret = android_file_header(as);
+			else if (as->state == AS_CHUNK_HEADER)
+				ret = android_chunk_header(w);
+			else {
+				memcpy(&value, as->hdr, sizeof(value));
+				ret = emit_fill(w, value, as->remaining);
+				android_next_chunk(as);
+			}
+			break;
+		case AS_RAW:
+			n = min_t(uint64_t, len, as->remaining);
+			ret = emit(w, buf, n);
+			as->remaining -= n;
+			if (!as->remaining)
+				android_next_chunk(as);
+			break;
+		case AS_SKIP:
+			n = min_t(uint64_t, len, as->remaining);
+			as->remaining -= n;
+			if (!as->remaining)
+				android_next_chunk(as);
+			break;
+		default:
+			/* trailing data after the last chunk */
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return ret;
+}
+
+int sparse_writer_init(struct sparse_writer *w, int fd, sparse_mode_t mode,
+		       bool android, size_t chunk)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->mode = mode;
+	w->android = android;
+	w->chunk = ROUND_UP(max_t(size_t, chunk, SPARSE_BLOCK_SIZE), SPARSE_BLOCK_SIZE);
+	w->data = malloc(w->chunk);
+	if (!w->data) {
+		ERROR("Sparse writer: out of memory");
+		return -ENOMEM;
+	}
+	w->as.state = AS_FILE_HEADER;
+	w->as.hneed = ANDROID_FILE_HDR_SIZE;
+
+	return 0;
+}
+
+/*
+ * copyimage() callback
+ */
+int sparse_write(void *out, const void *buf, size_t len)
+{
+	struct sparse_writer *w = (struct sparse_writer *)out;
+
+	/*
+	 * copyfile() has already moved the file offset
+	 * to the image offset, if any
+	 */
+	if (!w->started) {
+		w->pos = lseek(w->fd, 0, SEEK_CUR);
+		if (w->pos < 0)
+			w->pos = 0;
+		w->started = true;
+	}
+
+	if (w->android)
+		return android_write(w, buf, len);
+
+	return emit(w, buf, len);
+}
+
+/*
+ * Write what is still pending, the writer is released
+ * in any case, the fd is left open.
+ */
+int sparse_writer_finish(struct sparse_writer *w)
+{
+	struct stat st;
+	int ret;
+
+	if (w->android && w->as.state != AS_DONE) {
+		ERROR("Android sparse image is truncated (%u of %u chunks)",
+		      w->as.chunks, w->as.total_chunks);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = emit_pending(w);
+	if (!ret)
+		ret = flush_data(w);
+	if (!ret)
+		ret = flush_zeroes(w);
+
+	/* a regular file must get its whole size also if it ends with holes */
+	if (!ret && !fstat(w->fd, &st) && S_ISREG(st.st_mode) && st.st_size < w->pos &&
+	    ftruncate(w->fd, w->pos)) {
+		ERROR("Cannot extend file to %lld bytes: %s", (long long)w->pos,
+		      strerror(errno));
+		ret = -EIO;
+	}
+
+	if (!ret)
+		TRACE("Sparse write: %llu bytes written, %llu bytes skipped",
+		      (unsigned long long)w->written,
+		      (unsigned long long)w->skipped);
+
+out:
+	free(w->data);
+	free(w->zeroes);
+	w->data = NULL;
+	w->zeroes = NULL;
+
+	return ret;
+}
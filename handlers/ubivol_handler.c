@@ -216,7 +216,7 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 
 	if (bytes > vol->rsvd_bytes) {
 		ERROR("\"%s\" (size %lld) will not fit volume \"%s\" (size %lld)",
-		       img->fname, bytes, img->volname, vol->rsvd_bytes);
+		       img->fname, bytes, IMG_STR(img->volname), vol->rsvd_bytes);
 		return -1;
 	}
 
@@ -276,7 +276,7 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 	}
 
 	snprintf(sbuf, sizeof(sbuf), "Installing image %s into volume %s(%s)",
-		img->fname, node, img->volname);
+		img->fname, node, IMG_STR(img->volname));
 	notify(RUN, RECOVERY_NO_ERROR, INFOLEVEL, sbuf);
 
 	TRACE("Updating UBI : %s %lld",
@@ -316,7 +316,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 	struct flash_description *flash = get_flash_info();
 
 	/* determine the requested volume type */
-	if (!strcmp(cfg->type_data, "static"))
+	if (!strcmp(IMG_STR(cfg->type_data), "static"))
 		req_vol_type = UBI_STATIC_VOLUME;
 	else
 		req_vol_type = UBI_DYNAMIC_VOLUME;
@@ -345,7 +345,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 	for(ubivol = mtd_info->ubi_partitions.lh_first;
 		ubivol != NULL;
 		ubivol = ubivol->next.le_next) {
-		if (strcmp(ubivol->vol_info.name, cfg->volname) == 0) {
+		if (strcmp(ubivol->vol_info.name, IMG_STR(cfg->volname)) == 0) {
 			break;
 		}
 	}
@@ -397,7 +397,7 @@ static int resize_volume(struct img_type *cfg, long long size)
 		req.vol_id = req_vol_id;
 		req.alignment = 1;
 		req.bytes = size;
-		req.name = cfg->volname;
+		req.name = IMG_STR(cfg->volname);
 		err = ubi_mkvol(nandubi->libubi, node, &req);
 		if (err < 0) {
 			ERROR("cannot create %s UBI volume %s of %lld bytes",
@@ -447,12 +447,12 @@ static int wait_volume(struct img_type *img)
 	char node[64];
 
 	if (strlen(img->device))
-		ubivol = search_volume_local(img->device, img->volname);
+		ubivol = search_volume_local(img->device, IMG_STR(img->volname));
 	else
-		ubivol = search_volume_global(img->volname);
+		ubivol = search_volume_global(IMG_STR(img->volname));
 
 	if (!ubivol) {
-		ERROR("can't found volume %s", img->volname);
+		ERROR("can't found volume %s", IMG_STR(img->volname));
 		return -1;
 	}
 
@@ -489,28 +489,28 @@ static int install_ubivol_image(struct img_type *img,
 
 		ret = resize_volume(img, bytes);
 		if (ret < 0) {
-			ERROR("Can't resize ubi volume %s", img->volname);
+			ERROR("Can't resize ubi volume %s", IMG_STR(img->volname));
 			return -1;
 		}
 
 		ret = wait_volume(img);
 		if (ret < 0) {
-			ERROR("can't found ubi volume %s", img->volname);
+			ERROR("can't found ubi volume %s", IMG_STR(img->volname));
 			return -1;
 		}
 	}
 
 	/* find the volume to be updated */
 	if (strlen(img->device))
-		ubivol = search_volume_local(img->device, img->volname);
+		ubivol = search_volume_local(img->device, IMG_STR(img->volname));
 	else
-		ubivol = search_volume_global(img->volname);
+		ubivol = search_volume_global(IMG_STR(img->volname));
 
 	if (!ubivol) {
 		ERROR("Image %s should be stored in volume "
 			"%s, but no volume found",
 			img->fname,
-				img->volname);
+				IMG_STR(img->volname));
 		return -1;
 	}
 	ret = update_volume(flash->libubi, img,
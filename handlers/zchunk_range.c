@@ -158,7 +158,8 @@ char *zchunk_get_range_char(zck_range *range) {
 	return output;
 }
 
-zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *first, int max_ranges) {
+zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *first, int max_ranges,
+				    zchunk_valid_fn valid, void *data, zckChunk **next) {
 	if (!zck)
 		return NULL;
 	zck_range *range = calloc(1, sizeof(zck_range));
@@ -167,16 +168,21 @@ zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *first, int max_ranges
 		return NULL;
 	}
 
-	for(zckChunk *chk = first ? first : zck_get_first_chunk(zck); chk; chk = zck_get_next_chunk(chk)) {
-		if (zck_get_chunk_valid(chk))
+	zckChunk *chk;
+	for(chk = first ? first : zck_get_first_chunk(zck); chk; chk = zck_get_next_chunk(chk)) {
+		if (valid ? valid(chk, data) : zck_get_chunk_valid(chk))
 			continue;
 		if(!range_add(range, chk)) {
 			zchunk_range_free(&range);
 			return NULL;
 		}
-		if(max_ranges >= 0 && range->count >= max_ranges)
+		if(max_ranges >= 0 && range->count >= max_ranges) {
+			chk = zck_get_next_chunk(chk);
 			break;
+		}
 	}
+	if (next)
+		*next = chk;
 	return range;
 }
 
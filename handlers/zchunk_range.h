@@ -28,8 +28,16 @@ typedef struct zck_range {
 
 /* exported function */
 
-/* Get a Range from a zck context */
-zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *chk, int max_ranges);
+/* Check if a chunk is available without downloading it */
+typedef bool (*zchunk_valid_fn)(zckChunk *chk, void *data);
+
+/*
+ * Get a Range from a zck context, valid replaces the valid
+ * flag of the chunks if it is set. next is set to the first
+ * chunk after the range.
+ */
+zck_range *zchunk_get_missing_range(zckCtx *zck, zckChunk *chk, int max_ranges,
+				    zchunk_valid_fn valid, void *data, zckChunk **next);
 
 /* Return number of ranges */
 int zchunk_get_range_count(zck_range *range);
@@ -29,6 +29,9 @@
 #define CPIO_NEWASCII 070701
 #define CPIO_CRCASCII 070702
 
+/* newc archives carry no checksum, it does not need to be computed */
+#define CPIO_HAS_CHECKSUM(fhdr) ((fhdr)->format == CPIO_CRCASCII)
+
 #define NPAD_BYTES(o) ((4 - (o % 4)) % 4)
 
 struct new_ascii_header
@@ -0,0 +1,53 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DIRECT_WRITER_DEPTH		4
+#define DIRECT_WRITER_MAX_DEPTH		64
+#define DIRECT_WRITER_MIN_CHUNK		(256 * 1024)
+
+/*
+ * Writer bypassing the page cache: data is collected into
+ * aligned buffers that are written with O_DIRECT, keeping up
+ * to depth writes in flight with Linux AIO. Memory is bounded
+ * to depth * chunk bytes and the device is flushed just once
+ * when the writer is finished.
+ *
+ * The writer is passed as output to copyimage() together with
+ * direct_write() as callback. fd must stay the first member,
+ * copyfile() uses it to seek to the offset of the image.
+ */
+struct direct_writer {
+	int fd;
+	int flags;		/* file status flags to be restored */
+	bool direct;		/* O_DIRECT is set */
+	unsigned long ctx;	/* AIO context, 0 if writes are synchronous */
+	size_t align;
+	size_t chunk;
+	unsigned int depth;
+	unsigned char *buffers;
+	unsigned int *free_slots;
+	unsigned int nfree;
+	unsigned int inflight;
+	void *iocbs;
+	void *events;
+	int cur;		/* buffer being filled, -1 if none */
+	size_t fill;
+	off_t offset;		/* device offset of the buffer being filled */
+	bool started;
+	int error;
+};
+
+int direct_writer_init(struct direct_writer *w, int fd, unsigned int depth,
+		       size_t chunk);
+int direct_write(void *out, const void *buf, size_t len);
+int direct_writer_finish(struct direct_writer *w);
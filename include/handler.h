@@ -61,6 +61,9 @@ struct installer_handler{
 	unsigned int mask;	/* Mask (see HANDLER_MASK) */
 	bool	noglobal;	/* true if handler is not global and
 				   should be removed after install */
+	bool	parallel;	/* true if handler can run concurrently
+				   on different devices */
+	struct installer_handler *hash_next;	/* next in the same hash slot */
 };
 
 struct script_handler_data {
@@ -76,6 +79,8 @@ int register_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data);
 int register_session_handler(const char *desc,
 		handler installer, HANDLER_MASK mask, void *data);
+int register_parallel_handler(const char *desc,
+		handler installer, HANDLER_MASK mask, void *data);
 int unregister_handler(const char *desc);
 void unregister_session_handlers(void);
 
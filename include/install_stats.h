@@ -0,0 +1,62 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Stages of the installation of an artifact.
+ * Time spent in a stage does not include the time
+ * spent in the upstream stages.
+ */
+typedef enum {
+	STATS_READ,		/* read from the SWU */
+	STATS_HASH,		/* checksum and hash */
+	STATS_DECRYPT,
+	STATS_DECOMPRESS,
+	STATS_WAIT,		/* threaded pipeline waiting for data */
+	STATS_WRITE,		/* handler callback */
+	STATS_INSTALL,		/* whole handler, including the stages above */
+	STATS_STAGES
+} stats_stage_t;
+
+struct stage_stats {
+	uint64_t bytes;		/* bytes produced by the stage */
+	uint64_t wall_ns;
+	uint64_t cpu_ns;	/* CPU time of the thread running the stage */
+};
+
+struct install_stats {
+	bool valid;
+	struct stage_stats stage[STATS_STAGES];
+};
+
+/*
+ * Measure a stage: the timer is started by stats_begin()
+ * and the result is added to the stage by stats_end().
+ * Timers can be nested, the time of the inner one is
+ * not accounted to the outer one.
+ */
+struct stats_timer {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t nested_wall_ns;
+	uint64_t nested_cpu_ns;
+};
+
+void stats_begin(struct stats_timer *t);
+void stats_end(struct stats_timer *t, struct install_stats *stats,
+	       stats_stage_t stage, uint64_t bytes);
+
+void install_stats_enable(bool enable);
+bool install_stats_enabled(void);
+
+struct imglist;
+void install_stats_report(struct imglist *list);
+int install_stats_get(unsigned int index, char *buf, size_t len);
@@ -24,6 +24,7 @@ extern "C" {
  */
 
 #define IPC_MAGIC		0x14052001
+#define IPC_MAGIC_COMPACT	0x14052002
 
 typedef enum {
 	REQ_INSTALL,
@@ -42,6 +43,8 @@ typedef enum {
 	SET_SWUPDATE_VARS,
 	GET_SWUPDATE_VARS,
 	SET_DELTA_URL,
+	GET_INSTALL_STATS,
+	REQ_INSTALL_FD,		/* SWU is passed as fd with SCM_RIGHTS */
 } msgtype;
 
 /*
@@ -133,6 +136,11 @@ typedef union {
 		char filename[256];
 		char url[1024];
 	} dwl_url;
+	struct {
+		unsigned int index;	/* image requested */
+		unsigned int count;	/* images in the last install */
+		char	buf[2048];	/* statistics as JSON */
+	} stats;
 } msgdata;
 	
 typedef struct {
@@ -141,9 +149,24 @@ typedef struct {
 	msgdata data;
 } ipc_message;
 
+/*
+ * Compact framing: the header is followed by len bytes,
+ * that are the beginning of msgdata. The bytes that are not
+ * sent are zero, a GET_STATUS request is just the header.
+ * A message starting with IPC_MAGIC is a whole ipc_message,
+ * both framings are accepted by SWUpdate and the answer
+ * uses the same framing as the request.
+ */
+typedef struct {
+	int magic;	/* IPC_MAGIC_COMPACT */
+	int type;
+	unsigned int len;	/* bytes of msgdata following the header */
+} ipc_header;
+
 char *get_ctrl_socket(void);
 int ipc_inst_start(void);
 int ipc_inst_start_ext(void *priv, ssize_t size);
+int ipc_inst_start_fd(int fd, void *priv, ssize_t size);
 int ipc_send_data(int connfd, char *buf, int size);
 void ipc_end(int connfd);
 int ipc_get_status(ipc_message *msg);
@@ -152,6 +175,8 @@ int ipc_notify_connect(void);
 int ipc_notify_receive(int *connfd, ipc_message *msg);
 int ipc_postupdate(ipc_message *msg);
 int ipc_send_cmd(ipc_message *msg);
+int ipc_message_send(int connfd, const ipc_message *msg, bool compact);
+int ipc_message_recv(int connfd, ipc_message *msg, bool *compact);
 
 typedef int (*writedata)(char **buf, int *size);
 typedef int (*getstatus)(ipc_message *msg);
@@ -162,6 +187,9 @@ int swupdate_image_write(char *buf, int size);
 int swupdate_async_start(writedata wr_func, getstatus status_func,
 				terminated end_func,
 				void *priv, ssize_t size);
+int swupdate_async_start_fd(int fd, getstatus status_func,
+				terminated end_func,
+				void *priv, ssize_t size);
 int swupdate_set_aes(char *key, char *ivt);
 int swupdate_set_version_range(const char *minversion,
 				const char *maxversion,
@@ -171,6 +199,7 @@ int swupdate_set_version_range_type(const char *updatetype,
 				const char *maxversion,
 				const char *currentversion);
 int swupdate_dwl_url (const char *artifact_name, const char *url);
+int swupdate_get_install_stats(unsigned int index, char *buf, size_t len);
 
 #ifdef __cplusplus
 }   // extern "C"
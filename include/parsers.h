@@ -15,11 +15,25 @@
 #define SW_DESCRIPTION_FILENAME	CONFIG_SWDESCRIPTION
 #endif
 
+#include <stddef.h>
+
 struct swupdate_cfg;
 
-typedef int (*parser_fn)(struct swupdate_cfg *swcfg, const char *filename, char **error);
+/*
+ * sw-description and its signature as extracted from the SWU,
+ * they are kept in memory. data is NUL terminated.
+ */
+struct swdesc_buf {
+	char *data;
+	size_t len;
+	unsigned char *sig;
+	size_t siglen;
+};
+
+typedef int (*parser_fn)(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
 
-int parse(struct swupdate_cfg *swcfg, const char *filename);
-int parse_cfg(struct swupdate_cfg *swcfg, const char *filename, char **error);
-int parse_json(struct swupdate_cfg *swcfg, const char *filename, char **error);
-int parse_external(struct swupdate_cfg *swcfg, const char *filename, char **error);
+int parse(struct swupdate_cfg *swcfg, const struct swdesc_buf *desc);
+int parse_cfg(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
+int parse_json(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
+int parse_external(struct swupdate_cfg *swcfg, const char *buf, size_t len, char **error);
+int write_sw_description(const char *buf, size_t len, char **filename);
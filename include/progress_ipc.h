@@ -21,6 +21,7 @@ typedef enum progress_cause {
 	CAUSE_NONE,
 	CAUSE_REBOOT_MODE,
 	CAUSE_DRY_RUN_MODE,
+	CAUSE_INSTALL_STATS,
 } progress_cause_t;
 
 extern char* SOCKET_PROGRESS_PATH;
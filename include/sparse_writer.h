@@ -0,0 +1,72 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* granularity of the zero detection */
+#define SPARSE_BLOCK_SIZE	4096
+
+typedef enum {
+	SPARSE_NONE,		/* zero blocks are written */
+	SPARSE_SKIP,		/* zero blocks are skipped, target already clean */
+	SPARSE_DISCARD,		/* zero blocks are discarded */
+	SPARSE_ZEROOUT,		/* zero blocks are zeroed by the device */
+} sparse_mode_t;
+
+struct android_sparse {
+	int state;
+	unsigned char hdr[64];	/* header being collected */
+	size_t hfill;
+	size_t hneed;
+	uint32_t file_hdr_sz;
+	uint32_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t chunks;	/* chunks already parsed */
+	uint64_t remaining;	/* bytes left in the current chunk */
+};
+
+/*
+ * Writer for images with large zero areas: all-zero blocks
+ * are not written but handled according to the mode. The
+ * input can be an Android sparse image, that is expanded
+ * on the fly.
+ *
+ * The writer is passed as output to copyimage() together with
+ * sparse_write() as callback. fd must stay the first member,
+ * copyfile() uses it to seek to the offset of the image.
+ */
+struct sparse_writer {
+	int fd;
+	sparse_mode_t mode;
+	bool android;
+	bool started;
+	bool zero_fallback;	/* device cannot discard / zero out */
+	unsigned int lbsize;	/* logical block size of the device */
+	off_t pos;		/* device offset of the next byte */
+	unsigned char *data;	/* data not yet written */
+	size_t dfill;
+	size_t chunk;
+	uint64_t zlen;		/* zero range not yet handled */
+	unsigned char block[SPARSE_BLOCK_SIZE];	/* incomplete block */
+	size_t bfill;
+	unsigned char *zeroes;
+	uint64_t written;
+	uint64_t skipped;
+	struct android_sparse as;
+};
+
+int sparse_mode_from_string(const char *s, sparse_mode_t *mode);
+int sparse_writer_init(struct sparse_writer *w, int fd, sparse_mode_t mode,
+		       bool android, size_t chunk);
+int sparse_write(void *out, const void *buf, size_t len);
+int sparse_writer_finish(struct sparse_writer *w);
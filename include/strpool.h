@@ -0,0 +1,15 @@
+/*
+ * SPDX-FileCopyrightText: 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#pragma once
+
+/*
+ * Pool of interned strings: equal strings are stored once,
+ * in large blocks. The strings live until strpool_release(),
+ * that frees all of them at the end of an update.
+ */
+const char *strpool_intern(const char *s);
+void strpool_release(void);
@@ -114,6 +114,12 @@ struct swupdate_cfg {
 	char gpg_home_directory[SWUPDATE_GENERAL_STRING_SIZE];
 	char gpgme_protocol[SWUPDATE_GENERAL_STRING_SIZE];
 	int swdesc_max_size;
+	bool threaded_pipeline;
+	int install_workers;
+	int delta_index_workers;
+	int delta_download_window;
+	int delta_download_buffer;
+	bool verify_skipped_checksum;
 	/*
 	 * Select which provider is used in case of multiple
 	 * crypto libraries
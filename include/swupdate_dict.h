@@ -18,12 +18,26 @@ LIST_HEAD(dict_list, dict_list_elem);
 
 struct dict_entry {
 	char *key;
+	unsigned int hash;
 	struct dict_list list;
 	LIST_ENTRY(dict_entry) next;
 };
 
-LIST_HEAD(dict, dict_entry);
+struct dict_index;
 
+/*
+ * The entries are a list, LIST_FOREACH() and LIST_EMPTY()
+ * can be used on a dictionary. Large dictionaries get a
+ * hash index for the lookup. A dictionary must be zeroed
+ * or initialized with dict_init(), not with LIST_INIT().
+ */
+struct dict {
+	struct dict_entry *lh_first;	/* first element */
+	struct dict_index *index;
+};
+
+void dict_init(struct dict *dictionary);
+void dict_shallow_copy(struct dict *dst, const struct dict *src);
 char *dict_entry_get_key(struct dict_entry *entry);
 char *dict_entry_get_value(struct dict_entry *entry);
 
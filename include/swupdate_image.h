@@ -14,6 +14,7 @@
 #include "swupdate_dict.h"
 #include "lua_util.h"
 #include "swupdate_aes.h"
+#include "install_stats.h"
 
 typedef enum {
 	FLASH,
@@ -40,22 +41,30 @@ struct sw_version {
 
 LIST_HEAD(swver, sw_version);
 
+struct installer_handler;
+
 struct img_type {
 	struct sw_version id;		/* This is used to compare versions */
 	char type[SWUPDATE_GENERAL_STRING_SIZE]; /* Handler name */
 	char fname[MAX_IMAGE_FNAME];	/* Filename in CPIO archive */
-	char volname[MAX_VOLNAME];	/* Useful for UBI	*/
 	char device[MAX_VOLNAME];	/* device associated with image if any */
 	char path[MAX_IMAGE_FNAME];	/* Path where image must be installed */
-	char mtdname[MAX_IMAGE_FNAME];	/* MTD device where image must be installed */
-	char type_data[SWUPDATE_GENERAL_STRING_SIZE];	/* Data for handler */
-	char extract_file[MAX_IMAGE_FNAME];
-	char filesystem[MAX_IMAGE_FNAME];
-	char lua_fcn_pre[SWUPDATE_GENERAL_STRING_SIZE];	/* If present, call before installing */
-	char lua_fcn_post[SWUPDATE_GENERAL_STRING_SIZE];	/* If present, call after successful install */
+	/*
+	 * Strings that most images do not set are interned,
+	 * NULL if not set: read them with IMG_STR() and set
+	 * them with img_set_string()
+	 */
+	const char *volname;		/* Useful for UBI	*/
+	const char *mtdname;		/* MTD device where image must be installed */
+	const char *type_data;		/* Data for handler */
+	const char *extract_file;
+	const char *filesystem;
+	const char *lua_fcn_pre;	/* If present, call before installing */
+	const char *lua_fcn_post;	/* If present, call after successful install */
 	unsigned long long seek;
 	skip_t skip;
 	int provided;
+	bool cpio_crc;	/* crc cpio entry, the checksum is computed */
 	int compressed;
 	bool preserve_attributes; /* whether to preserve attributes in archives */
 	bool is_encrypted;
@@ -63,9 +72,16 @@ struct img_type {
 	char ivt_ascii[33];
 	char aes_ascii[65]; /* AES_256_KEY_LEN*2+1 */
 	bool install_directly;
+	bool threaded_pipeline; /* decouple read, decrypt, decompress and write */
+	size_t buffer_size;	/* I/O buffer size, 0 for global setting */
+	const char *install_after;	/* wait for this image */
+	bool install_sequential; /* do not install concurrently to other images */
 	int is_script;
 	int is_partitioner;
+	struct installer_handler *hnd;	/* cached by find_handler() */
+	unsigned long hnd_gen;
 	struct dict properties;
+	struct install_stats stats;
 
 	/*
 	 * Pointers to global structures
@@ -85,3 +101,7 @@ struct img_type {
 };
 
 LIST_HEAD(imglist, img_type);
+
+#define IMG_STR(s)	((s) ? (s) : "")
+
+int img_set_string(const char **field, const char *value);
@@ -41,6 +41,7 @@
 struct img_type;
 struct imglist;
 struct hw_type;
+struct install_stats;
 
 extern int loglevel;
 extern int exit_code;
@@ -67,6 +68,15 @@ enum compression_type {
   COMPRESSED_LZ4,
 };
 
+/*
+ * Size of the buffers used when streaming an artifact.
+ * IO_BUFFER_SIZE_AUTO selects the size according to the output device.
+ */
+#define IO_BUFFER_SIZE_DEFAULT	(16 * 1024)
+#define IO_BUFFER_SIZE_MIN	512
+#define IO_BUFFER_SIZE_MAX	(8 * 1024 * 1024)
+#define IO_BUFFER_SIZE_AUTO	((size_t)-1)
+
 typedef int (*writeimage) (void *out, const void *buf, size_t len);
 
 struct swupdate_copy {
@@ -96,6 +106,12 @@ struct swupdate_copy {
 	const char *imgivt;
 	const char *imgaes;
 	cipher_t cipher;
+	/* run each step of the pipeline on its own thread */
+	bool threaded;
+	/* size of the buffers, 0 to use the global setting */
+	size_t buffer_size;
+	/* per stage statistics, NULL if not collected */
+	struct install_stats *stats;
 };
 
 /*
@@ -133,6 +149,7 @@ typedef void (*notifier) (RECOVERY_STATUS status, int error, int level, const ch
 void notify(RECOVERY_STATUS status, int error, int level, const char *msg);
 void notify_init(void);
 void notifier_set_color(int level, char *col);
+void notifier_set_async(bool enable);
 
 #define __FILENAME__ (__builtin_strrchr(__FILE__, '/') ? __builtin_strrchr(__FILE__, '/') + 1 : __FILE__)
 #define swupdate_notify(status, format, level, arg...) do { \
@@ -191,6 +208,13 @@ static void _name(struct img_type *img, const char *value) \
 	strlcpy(img->_field, value, sizeof(img->_field)); \
 }
 
+#define DEFINE_IMG_STRPOOL_SETTER(_name, _field) \
+static void _name(struct img_type *img, const char *value) \
+{ \
+	if (img_set_string(&img->_field, value)) \
+		ERROR("Cannot set %s: out of memory", #_field); \
+}
+
 #define DEFINE_IMG_BOOL_SETTER(_name, _field) \
 static void _name(struct img_type *img, bool val) \
 { \
@@ -283,7 +307,11 @@ int openfileoutput(const char *filename);
 int mkpath(char *dir, mode_t mode);
 int swupdate_file_setnonblock(int fd, bool block);
 
+/* notifier can skip debug output if events are queued */
+#define NOTIFY_LOSSY	(1 << 0)
+
 int register_notifier(notifier client);
+int register_notifier_ext(notifier client, unsigned int flags);
 int syslog_init(void);
 
 char **splitargs(char *args, int *argc);
@@ -338,6 +366,12 @@ int size_delimiter_match(const char *size);
 unsigned long long ustrtoull(const char *cp, char **endptr, unsigned int base);
 int read_file_into_buf(const char *filename, unsigned char **buffer, size_t *len);
 
+/* I/O buffer size */
+int buffer_size_from_string(const char *s, size_t *size);
+void set_io_buffer_size(size_t size);
+size_t get_io_buffer_size(void);
+size_t resolve_io_buffer_size(size_t size, int fd);
+
 const char* get_tmpdir(void);
 const char* get_tmpdirscripts(void);
 
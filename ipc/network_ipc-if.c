@@ -20,6 +20,7 @@ static pthread_t async_thread_id;
 
 struct async_lib {
 	int connfd;
+	int progressfd;
 	int status;
 	writedata	wr;
 	getstatus	get;
@@ -175,11 +176,17 @@ static void *swupdate_async_thread(void *data)
 	}
 	/* Start listening to progress events, before sending
 	 * the image so that we don't miss the result event.
+	 * If the SWU was passed as fd, the install is already
+	 * running and the connection was done before.
 	 */
-	progressfd = progress_ipc_connect(0 /* no reconnect */);
+	progressfd = rq->progressfd;
+	rq->progressfd = -1;
+	if (progressfd < 0)
+		progressfd = progress_ipc_connect(0 /* no reconnect */);
 	if (progressfd < 0) {
 		fprintf(stderr, "progress_ipc_connect failed\n");
-		ipc_end(rq->connfd);
+		if (rq->connfd >= 0)
+			ipc_end(rq->connfd);
 		goto out;
 	}
 
@@ -216,7 +223,8 @@ static void *swupdate_async_thread(void *data)
 		}
 	} while(size > 0);
 
-	ipc_end(rq->connfd);
+	if (rq->connfd >= 0)
+		ipc_end(rq->connfd);
 
 	/*
 	 * Everything sent, wait for completion of the installation
@@ -304,6 +312,7 @@ int swupdate_async_start(writedata wr_func, getstatus status_func,
 	rq->wr = wr_func;
 	rq->get = status_func;
 	rq->end = end_func;
+	rq->progressfd = -1;
 
 	connfd = ipc_inst_start_ext(priv, size);
 
@@ -317,6 +326,56 @@ int swupdate_async_start(writedata wr_func, getstatus status_func,
 	return running != ASYNC_THREAD_INIT;
 }
 
+/*
+ * Same as swupdate_async_start(), but SWUpdate reads
+ * the SWU directly from fd instead of getting it
+ * through the socket. fd can be closed by the caller
+ * when the function returns.
+ */
+int swupdate_async_start_fd(int fd, getstatus status_func,
+				terminated end_func, void *priv, ssize_t size)
+{
+	struct async_lib *rq;
+	int ret;
+
+	switch (running) {
+	case ASYNC_THREAD_INIT:
+		break;
+	case ASYNC_THREAD_DONE:
+		pthread_join(async_thread_id, NULL);
+		running = ASYNC_THREAD_INIT;
+		break;
+	default:
+		return -EBUSY;
+	}
+
+	rq = get_request();
+
+	rq->wr = NULL;
+	rq->get = status_func;
+	rq->end = end_func;
+	rq->connfd = -1;
+
+	/*
+	 * The install starts as soon as the request is accepted,
+	 * connect before to not miss the result
+	 */
+	rq->progressfd = progress_ipc_connect(0 /* no reconnect */);
+	if (rq->progressfd < 0)
+		return -ECONNREFUSED;
+
+	ret = ipc_inst_start_fd(fd, priv, size);
+	if (ret < 0) {
+		close(rq->progressfd);
+		rq->progressfd = -1;
+		return ret;
+	}
+
+	start_ipc_thread(swupdate_async_thread, rq);
+
+	return running != ASYNC_THREAD_INIT;
+}
+
 int swupdate_image_write(char *buf, int size)
 {
 	struct async_lib *rq;
@@ -423,6 +482,33 @@ int swupdate_dwl_url (const char *artifact_name, const char *url)
 	return ipc_send_cmd(&msg);
 }
 
+/*
+ * Get the statistics of the index-th image of the last install
+ * as JSON string, returns the number of images or a negative
+ * value if index is out of range
+ */
+int swupdate_get_install_stats(unsigned int index, char *buf, size_t len)
+{
+	ipc_message msg;
+
+	if (!buf || !len)
+		return -EINVAL;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = GET_INSTALL_STATS;
+	msg.data.stats.index = index;
+
+	if (ipc_send_cmd(&msg) || msg.type != ACK)
+		return -1;
+
+	msg.data.stats.buf[sizeof(msg.data.stats.buf) - 1] = '\0';
+	strncpy(buf, msg.data.stats.buf, len - 1);
+	buf[len - 1] = '\0';
+
+	return msg.data.stats.count;
+}
+
 void swupdate_prepare_req(struct swupdate_request *req) {
 	if (!req)
 		return;
@@ -65,18 +65,265 @@ static int prepare_ipc(void) {
 	return connfd;
 }
 
-int ipc_postupdate(ipc_message *msg) {
-	int connfd = prepare_ipc();
-	if (connfd < 0)
-		return -1;
+/*
+ * Set when a compact answer has been received, so SWUpdate
+ * knows the compact framing. A connection closed without
+ * answer does not tell anything: an older SWUpdate does it
+ * with a compact request, but also a busy one. Shared by
+ * the threads of the client, so it is accessed atomically.
+ */
+static bool ipc_compact_daemon;
+
+static bool ipc_compact_known(void)
+{
+	return __atomic_load_n(&ipc_compact_daemon, __ATOMIC_RELAXED);
+}
+
+static void ipc_compact_confirmed(bool compact)
+{
+	if (compact)
+		__atomic_store_n(&ipc_compact_daemon, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Requests without side effects: they are sent compact and,
+ * if the connection is closed without answer, once more with
+ * the fixed framing. Any other request is sent compact only
+ * if SWUpdate is known to support it and it is never repeated.
+ */
+static bool ipc_idempotent(int type)
+{
+	switch (type) {
+	case GET_STATUS:
+	case GET_UPDATE_STATE:
+	case GET_HW_REVISION:
+	case GET_SWUPDATE_VARS:
+	case GET_INSTALL_STATS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Bytes of msgdata to be sent: the trailing zeroes
+ * are not sent, the receiver fills them again
+ */
+static size_t ipc_payload_len(const ipc_message *msg)
+{
+	const unsigned char *p = (const unsigned char *)&msg->data;
+	size_t len = sizeof(msg->data);
+
+	while (len && !p[len - 1])
+		len--;
 
+	return len;
+}
+
+static int send_message(int connfd, const ipc_message *msg, bool compact,
+			int fd)
+{
+	ipc_header hdr;
+	struct iovec iov[2];
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct iovec *cur = iov;
+	int iovcnt;
+	ssize_t n;
+
+	if (compact) {
+		hdr.magic = IPC_MAGIC_COMPACT;
+		hdr.type = msg->type;
+		hdr.len = ipc_payload_len(msg);
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *)&msg->data;
+		iov[1].iov_len = hdr.len;
+		iovcnt = 2;
+	} else {
+		iov[0].iov_base = (void *)msg;
+		iov[0].iov_len = sizeof(*msg);
+		iovcnt = 1;
+	}
+
+	while (iovcnt) {
+		memset(&msgh, 0, sizeof(msgh));
+		msgh.msg_iov = cur;
+		msgh.msg_iovlen = iovcnt;
+		/* the fd goes with the first bytes */
+		if (fd >= 0) {
+			memset(&control, 0, sizeof(control));
+			msgh.msg_control = control.buf;
+			msgh.msg_controllen = sizeof(control.buf);
+			cmsg = CMSG_FIRSTHDR(&msgh);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+		n = sendmsg(connfd, &msgh, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		fd = -1;
+		while (iovcnt && (size_t)n >= cur->iov_len) {
+			n -= cur->iov_len;
+			cur++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			cur->iov_base = (char *)cur->iov_base + n;
+			cur->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send a message, with compact set only the used part
+ * of msgdata is sent after an ipc_header
+ */
+int ipc_message_send(int connfd, const ipc_message *msg, bool compact)
+{
+	return send_message(connfd, msg, compact, -1);
+}
+
+static ssize_t read_all(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < count) {
+		n = read(fd, (char *)buf + done, count - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (!n)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+
+/*
+ * Read a message in any of the framings, a compact
+ * message is expanded to a whole ipc_message.
+ * Returns -ECONNRESET if the peer closes the connection
+ * without sending anything.
+ */
+int ipc_message_recv(int connfd, ipc_message *msg, bool *compact)
+{
+	ipc_header hdr;
+	ssize_t n;
+
+	n = read_all(connfd, msg, sizeof(hdr));
+	if (!n)
+		return -ECONNRESET;
+	if (n != sizeof(hdr))
+		return -EIO;
+
+	switch (msg->magic) {
+	case IPC_MAGIC:
+		n = sizeof(*msg) - sizeof(hdr);
+		if (read_all(connfd, (char *)msg + sizeof(hdr), n) != n)
+			return -EIO;
+		if (compact)
+			*compact = false;
+		break;
+	case IPC_MAGIC_COMPACT:
+		memcpy(&hdr, msg, sizeof(hdr));
+		if (hdr.len > sizeof(msg->data))
+			return -EIO;
+		memset(&msg->data, 0, sizeof(msg->data));
+		if (read_all(connfd, &msg->data, hdr.len) != (ssize_t)hdr.len)
+			return -EIO;
+		msg->magic = IPC_MAGIC;
+		if (compact)
+			*compact = true;
+		break;
+	default:
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a request and wait for the answer, a request without
+ * side effects is sent again with the fixed framing to an
+ * older SWUpdate
+ */
+static int ipc_request(ipc_message *msg, unsigned int timeout_ms)
+{
+	fd_set fds;
+	struct timeval tv;
+	bool retry = ipc_idempotent(msg->type);
+	bool compact = retry || ipc_compact_known();
+	bool answer_compact;
+	ipc_message request = *msg;
+	int connfd;
+	int ret;
+
+	for (;;) {
+		connfd = prepare_ipc();
+		if (connfd < 0)
+			return -1;
+
+		if (ipc_message_send(connfd, msg, compact)) {
+			close(connfd);
+			return -1;
+		}
+
+		if (timeout_ms) {
+			FD_ZERO(&fds);
+			FD_SET(connfd, &fds);
+
+			tv.tv_sec = 0;
+			tv.tv_usec = timeout_ms * 1000;
+			if ((select(connfd + 1, &fds, NULL, NULL, &tv) <= 0) ||
+				!FD_ISSET(connfd, &fds)) {
+				close(connfd);
+				/*
+				 * Invalid the message
+				 * Caller should check it
+				 */
+				msg->magic = 0;
+				return -ETIMEDOUT;
+			}
+		}
+
+		ret = ipc_message_recv(connfd, msg, &answer_compact);
+		close(connfd);
+		if (ret == -ECONNRESET && compact && retry) {
+			/* just once, the next request tries again */
+			*msg = request;
+			compact = false;
+			retry = false;
+			continue;
+		}
+		if (!ret)
+			ipc_compact_confirmed(answer_compact);
+
+		return ret ? -1 : 0;
+	}
+}
+
+int ipc_postupdate(ipc_message *msg) {
 	char* tmpbuf = NULL;
 	if (msg->data.procmsg.len > 0) {
 		if ((tmpbuf = strndupa(msg->data.procmsg.buf,
 				msg->data.procmsg.len > sizeof(msg->data.procmsg.buf)
 				    ? sizeof(msg->data.procmsg.buf)
 				    : msg->data.procmsg.len)) == NULL) {
-			close(connfd);
 			return -1;
 		}
 	}
@@ -90,58 +337,21 @@ int ipc_postupdate(ipc_message *msg) {
 	msg->magic = IPC_MAGIC;
 	msg->type = POST_UPDATE;
 
-	int result = write(connfd, msg, sizeof(*msg)) != sizeof(*msg) ||
-		read(connfd, msg, sizeof(*msg)) != sizeof(*msg);
-
-	close(connfd);
-	return -result;
+	return ipc_request(msg, 0);
 }
 
-static int __ipc_get_status(int connfd, ipc_message *msg, unsigned int timeout_ms)
+static int __ipc_get_status(ipc_message *msg, unsigned int timeout_ms)
 {
-	fd_set fds;
-	struct timeval tv;
-
 	memset(msg, 0, sizeof(*msg));
 	msg->magic = IPC_MAGIC;
 	msg->type = GET_STATUS;
 
-	if (write(connfd, msg, sizeof(*msg)) != sizeof(*msg))
-		return -1;
-
-	if (timeout_ms) {
-		FD_ZERO(&fds);
-		FD_SET(connfd, &fds);
-
-		/*
-		 * Invalid the message
-		 * Caller should check it
-		 */
-		msg->magic = 0;
-
-		tv.tv_sec = 0;
-		tv.tv_usec = timeout_ms * 1000;
-		if ((select(connfd + 1, &fds, NULL, NULL, &tv) <= 0) ||
-			!FD_ISSET(connfd, &fds))
-			return -ETIMEDOUT;
-	}
-
-	return -(read(connfd, msg, sizeof(*msg)) != sizeof(*msg));
+	return ipc_request(msg, timeout_ms);
 }
 
 int ipc_get_status(ipc_message *msg)
 {
-	int ret;
-	int connfd;
-
-	connfd = prepare_ipc();
-	if (connfd < 0)
-		return -1;
-
-	ret = __ipc_get_status(connfd, msg, 0);
-	close(connfd);
-
-	return ret;
+	return __ipc_get_status(msg, 0);
 }
 
 /*
@@ -152,14 +362,8 @@ int ipc_get_status(ipc_message *msg)
 int ipc_get_status_timeout(ipc_message *msg, unsigned int timeout_ms)
 {
 	int ret;
-	int connfd;
-
-	connfd = prepare_ipc();
-	if (connfd < 0)
-		return -1;
 
-	ret = __ipc_get_status(connfd, msg, timeout_ms);
-	close(connfd);
+	ret = __ipc_get_status(msg, timeout_ms);
 
 	/* Not very nice, but necessary in order to keep the API consistent. */
 	if (timeout_ms && ret == -ETIMEDOUT)
@@ -249,10 +453,9 @@ int ipc_notify_receive(int *connfd, ipc_message *msg)
 	return ret;
 }
 
-int ipc_inst_start_ext(void *priv, ssize_t size)
+static int prepare_inst_request(ipc_message *msg, int type, void *priv,
+				ssize_t size)
 {
-	int connfd;
-	ipc_message msg;
 	struct swupdate_request *req;
 	struct swupdate_request localreq;
 
@@ -275,29 +478,81 @@ int ipc_inst_start_ext(void *priv, ssize_t size)
 		swupdate_prepare_req(&localreq);
 		req = &localreq;
 	}
-	connfd = prepare_ipc();
-	if (connfd < 0)
-		return -1;
 
-	memset(&msg, 0, sizeof(msg));
+	memset(msg, 0, sizeof(*msg));
 
 	/*
 	 * Command is request to install
 	 */
-	msg.magic = IPC_MAGIC;
-	msg.type = REQ_INSTALL;
+	msg->magic = IPC_MAGIC;
+	msg->type = type;
 
-	msg.data.instmsg.req = *req;
-	if (write(connfd, &msg, sizeof(msg)) != sizeof(msg) ||
-		read(connfd, &msg, sizeof(msg)) != sizeof(msg) ||
-		msg.type != ACK)
-		goto cleanup;
+	msg->data.instmsg.req = *req;
+
+	return 0;
+}
+
+/*
+ * Send an install request and wait for the ACK, the
+ * connection is returned to stream the SWU if fd < 0.
+ * An install request is never repeated.
+ */
+static int ipc_inst_request(ipc_message *msg, int fd)
+{
+	ipc_message answer;
+	bool compact;
+	int connfd;
+	int ret;
+
+	connfd = prepare_ipc();
+	if (connfd < 0)
+		return -1;
+
+	if (send_message(connfd, msg, ipc_compact_known(), fd)) {
+		close(connfd);
+		return -1;
+	}
+
+	ret = ipc_message_recv(connfd, &answer, &compact);
+	if (ret || answer.type != ACK) {
+		close(connfd);
+		return -1;
+	}
+	ipc_compact_confirmed(compact);
 
 	return connfd;
+}
+
+int ipc_inst_start_ext(void *priv, ssize_t size)
+{
+	ipc_message msg;
+
+	if (prepare_inst_request(&msg, REQ_INSTALL, priv, size))
+		return -EINVAL;
+
+	return ipc_inst_request(&msg, -1);
+}
+
+/*
+ * Request an install reading the SWU from fd: the fd is
+ * passed to SWUpdate with the request, the SWU is not
+ * streamed through the socket and it can be seeked if
+ * fd is a file. The caller can close fd after the call.
+ */
+int ipc_inst_start_fd(int fd, void *priv, ssize_t size)
+{
+	int connfd;
+	ipc_message msg;
+
+	if (fd < 0 || prepare_inst_request(&msg, REQ_INSTALL_FD, priv, size))
+		return -EINVAL;
+
+	connfd = ipc_inst_request(&msg, fd);
+	if (connfd < 0)
+		return -1;
 
-cleanup:
 	close(connfd);
-	return -1;
+	return 0;
 }
 
 /*
@@ -336,7 +591,6 @@ void ipc_end(int connfd)
 
 int ipc_wait_for_complete(getstatus callback)
 {
-	int fd;
 	RECOVERY_STATUS status = IDLE;
 	ipc_message message;
 	int ret;
@@ -344,11 +598,7 @@ int ipc_wait_for_complete(getstatus callback)
 	message.data.status.last_result = FAILURE;
 
 	do {
-		fd = prepare_ipc();
-		if (fd < 0)
-			break;
-		ret = __ipc_get_status(fd, &message, 0);
-		close(fd);
+		ret = __ipc_get_status(&message, 0);
 
 		if (ret < 0) {
 			message.data.status.last_result = FAILURE;
@@ -370,17 +620,8 @@ int ipc_wait_for_complete(getstatus callback)
 
 int ipc_send_cmd(ipc_message *msg)
 {
-	int connfd = prepare_ipc();
-	if (connfd < 0)
-		return -1;
-
 	/* TODO: Check source type */
 	msg->magic = IPC_MAGIC;
 
-	int ret = write(connfd, msg, sizeof(*msg)) != sizeof(*msg) ||
-		read(connfd, msg, sizeof(*msg))  != sizeof(*msg);
-
-	close(connfd);
-
-	return -ret;
+	return ipc_request(msg, 0);
 }
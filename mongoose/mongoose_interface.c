@@ -42,6 +42,8 @@
 
 #define MG_PORT "8080"
 #define MG_ROOT "."
+/* send buffer of the IPC, it holds up to a whole receive buffer */
+#define MG_IPC_BUFFER_SIZE ((int) MG_MAX_RECV_SIZE)
 
 struct mongoose_options {
 	char *root;
@@ -63,6 +65,7 @@ struct file_upload_state {
 	uint8_t percent;
 	struct mg_timer *timer;
 	uint64_t last_io_time;
+	struct mg_connection *ipc_watch; /* wakes up the loop when IPC is writable */
 };
 
 struct parent_connection_info {
@@ -73,6 +76,7 @@ struct parent_connection_info {
 static struct parent_connection_info conn_info = {0};
 static bool run_postupdate;
 static unsigned int watchdog_conn = 0;
+static int ipc_buffer_size;
 static struct mg_http_serve_opts s_http_server_opts;
 const char *global_auth_domain;
 const char *global_auth_file;
@@ -560,6 +564,108 @@ void mongoose_upload_ok_reply(struct mg_connection *nc,
 	nc->is_draining = 1;
 }
 
+static void ipc_set_buffer_size(int fd)
+{
+	int size = ipc_buffer_size;
+	socklen_t len = sizeof(size);
+
+	if (size <= 0)
+		return;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) ||
+	    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len)) {
+		WARN("IPC buffer size cannot be set: %s", strerror(errno));
+		return;
+	}
+	/* Linux doubles the value and limits it to net.core.wmem_max */
+	if (size < ipc_buffer_size)
+		TRACE("IPC buffer limited to %d bytes by the system", size);
+}
+
+/*
+ * Set the epoll mask of a connection: EPOLLIN is dropped while
+ * it is paused, EPOLLOUT is kept as long as there is data to send.
+ */
+static void set_conn_mask(struct mg_connection *nc)
+{
+#if MG_ENABLE_EPOLL
+	struct epoll_event ev = {EPOLLERR | EPOLLHUP, {nc}};
+
+	if (!nc->is_full)
+		ev.events |= EPOLLIN;
+	if (nc->send.len > 0)
+		ev.events |= EPOLLOUT;
+	epoll_ctl(nc->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) nc->fd, &ev);
+#else
+	(void) nc;
+#endif
+}
+
+/*
+ * Stop / restart reading from a connection. mongoose just
+ * skips the reads of a full connection, but with epoll the
+ * pending data would wake up the loop continuously.
+ */
+static void set_conn_paused(struct mg_connection *nc, bool paused)
+{
+	if (nc->is_full == paused)
+		return;
+	nc->is_full = paused;
+	set_conn_mask(nc);
+}
+
+#if MG_ENABLE_EPOLL
+static void ipc_watch_handler(struct mg_connection *c, int ev,
+			      void __attribute__ ((__unused__)) *ev_data)
+{
+	struct file_upload_state *fus = (struct file_upload_state *) c->fn_data;
+
+	if (ev == MG_EV_CLOSE && fus)
+		fus->ipc_watch = NULL;
+}
+
+/*
+ * The IPC is full: a connection wrapping a copy of its fd is
+ * added to the poll set of mongoose, just to wake up the loop
+ * once when the IPC can be written again. It never reads nor
+ * writes, the upload is resumed by the MG_EV_POLL that follows.
+ */
+static void ipc_wait_writable(struct file_upload_state *fus)
+{
+	struct mg_connection *w = fus->ipc_watch;
+	int fd;
+
+	if (!w) {
+		fd = dup(fus->fd);
+		if (fd < 0)
+			return;
+		w = mg_wrapfd(fus->c->mgr, fd, ipc_watch_handler, fus);
+		if (!w) {
+			close(fd);
+			return;
+		}
+		w->is_full = 1;
+		fus->ipc_watch = w;
+	}
+
+	struct epoll_event ev = {EPOLLOUT | EPOLLONESHOT, {w}};
+	epoll_ctl(w->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) w->fd, &ev);
+}
+
+static void ipc_watch_release(struct file_upload_state *fus)
+{
+	if (fus->ipc_watch) {
+		fus->ipc_watch->fn_data = NULL;
+		fus->ipc_watch->is_closing = 1;
+		fus->ipc_watch = NULL;
+	}
+}
+#else
+/* the upload is resumed at the next MG_EV_POLL */
+static void ipc_wait_writable(struct file_upload_state __attribute__ ((__unused__)) *fus) {}
+static void ipc_watch_release(struct file_upload_state __attribute__ ((__unused__)) *fus) {}
+#endif
+
 static void upload_handler(struct mg_connection *nc, int ev, void *ev_data)
 {
 	struct mg_http_multipart *mp;
@@ -601,6 +707,7 @@ static void upload_handler(struct mg_connection *nc, int ev, void *ev_data)
 			if (swupdate_file_setnonblock(fus->fd, true)) {
 				WARN("IPC cannot be set in non-blocking, fallback to block mode");
 			}
+			ipc_set_buffer_size(fus->fd);
 
 			mp->user_data = fus;
 
@@ -622,26 +729,31 @@ static void upload_handler(struct mg_connection *nc, int ev, void *ev_data)
 				break;
 
 			written = write(fus->fd, (char *) mp->part.body.buf, mp->part.body.len);
+			if (written < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					written = 0;
+				} else {
+					if ((mp->part.body.len + fus->len) != mp->len &&
+					    !fus->error_report) {
+						ERROR("Writing to IPC fails due to %s", strerror(errno));
+						fus->error_report = true;
+						nc->is_draining = 1;
+					}
+					/*
+					 * Simply consumes the data to unblock the sender
+					 */
+					written = (ssize_t) mp->part.body.len;
+				}
+			}
+
 			/*
-			 * IPC seems to block, wait for a while
+			 * IPC is full: the rest is kept and passed again
+			 * when the installer has read enough, meanwhile
+			 * no more data is read from the connection
 			 */
 			if (written != mp->part.body.len) {
-				if (written < 0) {
-					if (errno != EAGAIN && errno != EWOULDBLOCK) {
-						if ((mp->part.body.len + fus->len) == mp->len) {
-							/*
-							 * Simply consumes the data to unblock the sender
-							 */
-							written = (ssize_t) mp->part.body.len;
-						} else if (!fus->error_report) {
-							ERROR("Writing to IPC fails due to %s", strerror(errno));
-							fus->error_report = true;
-							nc->is_draining = 1;
-						}
-					} else
-						written = 0;
-				}
-				usleep(100);
+				set_conn_paused(nc, true);
+				ipc_wait_writable(fus);
 			}
 
 			mp->num_data_consumed = written;
@@ -663,6 +775,7 @@ static void upload_handler(struct mg_connection *nc, int ev, void *ev_data)
 			if (!fus)
 				break;
 
+			ipc_watch_release(fus);
 			ipc_end(fus->fd);
 
 			mongoose_upload_ok_reply(nc, &mp->part.filename, fus->len);
@@ -720,12 +833,30 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
 				}
 			}
 		}
+	} else if (nc->data[0] == 'M' && ev == MG_EV_WRITE) {
+		/*
+		 * mongoose re-arms EPOLLIN once the send buffer is
+		 * flushed, restore the mask of a paused connection
+		 */
+		if (nc->is_full)
+			set_conn_mask(nc);
 	} else if (nc->data[0] == 'M' && (ev == MG_EV_READ || ev == MG_EV_POLL || ev == MG_EV_CLOSE)) {
 		if (nc->recv.len >= MG_MAX_RECV_SIZE && ev == MG_EV_READ)
-			nc->is_full = true;
+			set_conn_paused(nc, true);
 		multipart_upload_handler(nc, ev, ev_data);
-		if (nc->recv.len < MG_MAX_RECV_SIZE && ev == MG_EV_POLL)
-			nc->is_full = false;
+		/* reading is resumed when the upload handler takes data again */
+		if (nc->recv.len < MG_MAX_RECV_SIZE && ev == MG_EV_POLL &&
+		    !multipart_data_pending(nc))
+			set_conn_paused(nc, false);
+		/*
+		 * mongoose adds EPOLLIN back before each wait while there
+		 * is data to send: drop it again. The wait itself can then
+		 * return early only until the reply queued at the end or on
+		 * a failure of the upload is written, no data is sent while
+		 * the upload is paused.
+		 */
+		else if (nc->is_full && ev == MG_EV_POLL)
+			set_conn_mask(nc);
 #if MG_TLS
 	} else if (ev == MG_EV_ACCEPT && ssl) {
 		mg_tls_init(nc, &tls_opts);
@@ -799,6 +930,8 @@ static int mongoose_settings(void *elem, void  __attribute__ ((__unused__)) *dat
 
 	GET_FIELD_INT(LIBCFG_PARSER, elem, "timeout", (int *)&watchdog_conn);
 
+	GET_FIELD_INT(LIBCFG_PARSER, elem, "ipc-buffer-size", &ipc_buffer_size);
+
 	return 0;
 }
 
@@ -815,6 +948,7 @@ static struct option long_options[] = {
 	{"timeout", required_argument, NULL, 't'},
 	{"auth-domain", required_argument, NULL, '0'},
 	{"global-auth-file", required_argument, NULL, '1'},
+	{"ipc-buffer-size", required_argument, NULL, '2'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -833,8 +967,26 @@ void mongoose_print_help(void)
 		"\t  -r, --document-root <path>     : path to document root directory (default: %s)\n"
 		"\t  -t, --timeout                  : timeout to check if connection is lost (default: check disabled)\n"
 		"\t  --auth-domain                  : set authentication domain if any (default: none)\n"
-		"\t  --global-auth-file             : set authentication file if any (default: none)\n",
-		MG_PORT, MG_ROOT);
+		"\t  --global-auth-file             : set authentication file if any (default: none)\n"
+		"\t  --ipc-buffer-size <bytes>      : send buffer to the installer (default: %d)\n",
+		MG_PORT, MG_ROOT, MG_IPC_BUFFER_SIZE);
+}
+
+/*
+ * The IPC buffer size accepts the K / M suffixes and must fit
+ * in the int passed to setsockopt()
+ */
+static int parse_ipc_buffer_size(const char *arg)
+{
+	unsigned long long size = ustrtoull(arg, NULL, 10);
+
+	if (errno || !size || size > INT_MAX) {
+		ERROR("Wrong IPC buffer size: %s", arg);
+		return -EINVAL;
+	}
+	ipc_buffer_size = (int)size;
+
+	return 0;
 }
 
 int start_mongoose(const char *cfgfname, int argc, char *argv[])
@@ -864,6 +1016,8 @@ int start_mongoose(const char *cfgfname, int argc, char *argv[])
 	 */
 	watchdog_conn = 0;
 
+	ipc_buffer_size = MG_IPC_BUFFER_SIZE;
+
 	if (cfgfname) {
 		swupdate_cfg_handle handle;
 		swupdate_cfg_init(&handle);
@@ -871,6 +1025,10 @@ int start_mongoose(const char *cfgfname, int argc, char *argv[])
 			read_module_settings(&handle, "webserver", mongoose_settings, &opts);
 		}
 		swupdate_cfg_destroy(&handle);
+		if (ipc_buffer_size <= 0) {
+			ERROR("ipc-buffer-size must be a positive number of bytes");
+			return -EINVAL;
+		}
 	}
 
 	optind = 1;
@@ -885,6 +1043,10 @@ int start_mongoose(const char *cfgfname, int argc, char *argv[])
 			free(opts.global_auth_file);
 			opts.global_auth_file = strdup(optarg);
 			break;
+		case '2':
+			if (parse_ipc_buffer_size(optarg))
+				return -EINVAL;
+			break;
 		case 'l':
 			opts.listing = true;
 			break;
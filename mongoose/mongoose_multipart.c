@@ -317,6 +317,17 @@ static void mg_http_multipart_continue(struct mg_connection *c) {
 	}
 }
 
+/*
+ * The handler did not consume all data and it
+ * will be called again with the remainder
+ */
+bool multipart_data_pending(struct mg_connection *c)
+{
+	struct mg_http_multipart_stream *mp_stream = c->pfn_data;
+
+	return mp_stream != NULL && mp_stream->data_avail;
+}
+
 void multipart_upload_handler(struct mg_connection *c, int ev, void *ev_data)
 {
 	struct mg_http_message *hm = (struct mg_http_message *) ev_data;
@@ -44,3 +44,4 @@ struct mg_http_multipart {
 };
 
 void multipart_upload_handler(struct mg_connection *nc, int ev, void *ev_data);
+bool multipart_data_pending(struct mg_connection *nc);
@@ -38,9 +38,9 @@ struct stream_handler_entry {
 DEFINE_IMG_STRLCPY_SETTER(sw_set_type, type)
 DEFINE_IMG_STRLCPY_SETTER(sw_set_name, id.name)
 DEFINE_IMG_STRLCPY_SETTER(sw_set_version, id.version)
-DEFINE_IMG_STRLCPY_SETTER(sw_set_mtdname, mtdname)
-DEFINE_IMG_STRLCPY_SETTER(sw_set_filesystem, filesystem)
-DEFINE_IMG_STRLCPY_SETTER(sw_set_volume, volname)
+DEFINE_IMG_STRPOOL_SETTER(sw_set_mtdname, mtdname)
+DEFINE_IMG_STRPOOL_SETTER(sw_set_filesystem, filesystem)
+DEFINE_IMG_STRPOOL_SETTER(sw_set_volume, volname)
 DEFINE_IMG_STRLCPY_SETTER(sw_set_device, device)
 DEFINE_IMG_STRLCPY_SETTER(sw_set_path, path)
 
@@ -141,10 +141,11 @@ static void sw_append_stream(struct img_type *img, const char *key,
 	}
 }
 
-int parse_external(struct swupdate_cfg *software, const char *filename,
+int parse_external(struct swupdate_cfg *software, const char *buf, size_t len,
 		   char __attribute__((__unused__)) **error)
 {
 	int ret;
+	char *filename;
 	unsigned int nstreams;
 	struct img_type *image;
 	struct hw_type hardware = {0};
@@ -172,10 +173,17 @@ int parse_external(struct swupdate_cfg *software, const char *filename,
 	    return 1;
 	}
 
+	/* the external parser reads sw-description from a file */
+	if (write_sw_description(buf, len, &filename)) {
+		lua_close(L);
+		return 1;
+	}
+
 	lua_getglobal(L, "xmlparser");
 
 	/* passing arguments */
 	lua_pushstring(L, filename);
+	free(filename);
 	lua_pushstring(L, hardware.boardname);
 	lua_pushstring(L, hardware.revision);
 
@@ -239,7 +247,8 @@ int parse_external(struct swupdate_cfg *software, const char *filename,
 #else
 
 int parse_external(struct swupdate_cfg __attribute__((__unused__)) *software,
-		   const char __attribute__((__unused__)) *filename,
+		   const char __attribute__((__unused__)) *buf,
+		   size_t __attribute__((__unused__)) len,
 		   char __attribute__((__unused__)) **error)
 {
 	return -1;
@@ -277,6 +277,20 @@ static void add_properties_cb(const char *name, const char *value, void *data)
 		ERROR("Property not stored, skipping...");
 }
 
+/*
+ * Like GET_FIELD_STRING() for the interned strings of an image
+ */
+static void get_field_img_string(parsertype p, void *elem, const char *name,
+				 const char **dest)
+{
+	char value[SWUPDATE_GENERAL_STRING_SIZE];
+
+	value[0] = '\0';
+	GET_FIELD_STRING(p, elem, name, value);
+	if (value[0] && img_set_string(dest, value))
+		ERROR("Cannot set %s: out of memory", name);
+}
+
 static void add_properties(parsertype p, void *node, struct img_type *image)
 {
 	void *properties;
@@ -476,12 +490,12 @@ static int parse_common_attributes(parsertype p, void *elem, struct img_type *im
 	GET_FIELD_STRING(p, elem, "version", image->id.version);
 	GET_FIELD_STRING(p, elem, "filename", image->fname);
 	GET_FIELD_STRING(p, elem, "path", image->path);
-	GET_FIELD_STRING(p, elem, "volume", image->volname);
+	get_field_img_string(p, elem, "volume", &image->volname);
 	GET_FIELD_STRING(p, elem, "device", image->device);
-	GET_FIELD_STRING(p, elem, "mtdname", image->mtdname);
-	GET_FIELD_STRING(p, elem, "filesystem", image->filesystem);
+	get_field_img_string(p, elem, "mtdname", &image->mtdname);
+	get_field_img_string(p, elem, "filesystem", &image->filesystem);
 	GET_FIELD_STRING(p, elem, "type", image->type);
-	GET_FIELD_STRING(p, elem, "data", image->type_data);
+	get_field_img_string(p, elem, "data", &image->type_data);
 	GET_FIELD_INT64(p, elem, "size", &image->size);
 	get_hash_value(p, elem, image->sha256);
 
@@ -516,6 +530,34 @@ static int parse_common_attributes(parsertype p, void *elem, struct img_type *im
 		image->compressed = img_compressed ? COMPRESSED_TRUE : COMPRESSED_FALSE;
 	}
 	GET_FIELD_BOOL(p, elem, "installed-directly", &image->install_directly);
+	image->threaded_pipeline = cfg->threaded_pipeline;
+	GET_FIELD_BOOL(p, elem, "threaded-pipeline", &image->threaded_pipeline);
+	get_field_img_string(p, elem, "install-after", &image->install_after);
+	GET_FIELD_BOOL(p, elem, "install-sequential", &image->install_sequential);
+
+	/*
+	 * buffer-size can be set as number or string. As string,
+	 * multiplier suffixes and "auto" are allowed
+	 */
+	if (is_field_numeric(p, elem, "buffer-size")) {
+		long long bufsize = 0;
+
+		GET_FIELD_INT64(p, elem, "buffer-size", &bufsize);
+		if (bufsize < IO_BUFFER_SIZE_MIN || bufsize > IO_BUFFER_SIZE_MAX) {
+			ERROR("buffer-size argument: %lld out of range", bufsize);
+			return -1;
+		}
+		image->buffer_size = bufsize;
+	} else {
+		char bufsize_str[MAX_SEEK_STRING_SIZE] = "";
+
+		GET_FIELD_STRING(p, elem, "buffer-size", bufsize_str);
+		if (strlen(bufsize_str) &&
+		    buffer_size_from_string(bufsize_str, &image->buffer_size) < 0) {
+			ERROR("buffer-size argument: '%s' invalid", bufsize_str);
+			return -1;
+		}
+	}
 	GET_FIELD_BOOL(p, elem, "preserve-attributes", &image->preserve_attributes);
 	GET_FIELD_BOOL(p, elem, "install-if-different", &image->id.install_if_different);
 	GET_FIELD_BOOL(p, elem, "install-if-higher", &image->id.install_if_higher);
@@ -538,8 +580,8 @@ static int parse_common_attributes(parsertype p, void *elem, struct img_type *im
 		image->skip = SKIP_NONE;
 	}
 
-	GET_FIELD_STRING(p, elem, "preinstall", image->lua_fcn_pre);
-	GET_FIELD_STRING(p, elem, "postinstall", image->lua_fcn_post);
+	get_field_img_string(p, elem, "preinstall", &image->lua_fcn_pre);
+	get_field_img_string(p, elem, "postinstall", &image->lua_fcn_post);
 
 	return 0;
 }
@@ -580,7 +622,7 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 			free_image(partition);
 			return -1;
 		}
-		GET_FIELD_STRING(p, elem, "name", partition->volname);
+		get_field_img_string(p, elem, "name", &partition->volname);
 
 		if (!strlen(partition->type))
 			strlcpy(partition->type, "ubipartition", sizeof(partition->type));
@@ -602,7 +644,7 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 			continue;
 		}
 
-		if ((!strlen(partition->volname) && !strcmp(partition->type, "ubipartition")) ||
+		if ((!partition->volname && !strcmp(partition->type, "ubipartition")) ||
 				!strlen(partition->device)) {
 			ERROR("Partition incompleted in description file");
 			free_image(partition);
@@ -610,7 +652,7 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 		}
 
 		TRACE("Partition: %s new size %lld bytes",
-			!strcmp(partition->type, "ubipartition") ? partition->volname : partition->device,
+			!strcmp(partition->type, "ubipartition") ? IMG_STR(partition->volname) : partition->device,
 			partition->partsize);
 
 		LIST_INSERT_HEAD(&swcfg->images, partition, next);
@@ -910,7 +952,7 @@ static int _parse_images(parsertype p, void *cfg, void *setting, const char **no
 
 		/* if the handler is not explicit set, try to find the right one */
 		if (!strlen(image->type)) {
-			if (strlen(image->volname))
+			if (image->volname)
 				strcpy(image->type, "ubivol");
 			else if (strlen(image->device))
 				strcpy(image->type, "raw");
@@ -932,8 +974,8 @@ static int _parse_images(parsertype p, void *cfg, void *setting, const char **no
 			strlen(image->id.name) ? " " : "", image->id.name,
 			strlen(image->id.version) ? " " : "", image->id.version,
 			image->fname,
-			strlen(image->volname) ? "volume" : "device",
-			strlen(image->volname) ? image->volname :
+			image->volname ? "volume" : "device",
+			image->volname ? image->volname :
 			strlen(image->path) ? image->path : image->device,
 			strlen(image->type) ? image->type : "NOT FOUND",
 			image->install_directly ? " (installed from stream)" : "",
@@ -1116,7 +1158,8 @@ static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 	return ret;
 }
 
-int parse_cfg(struct swupdate_cfg *swcfg, const char *filename, char **error)
+int parse_cfg(struct swupdate_cfg *swcfg, const char *buf,
+	      size_t __attribute__ ((__unused__)) len, char **error)
 {
 	config_t cfg;
 	parsertype p = LIBCFG_PARSER;
@@ -1125,10 +1168,10 @@ int parse_cfg(struct swupdate_cfg *swcfg, const char *filename, char **error)
 	memset(&cfg, 0, sizeof(cfg));
 	config_init(&cfg);
 
-	/* Read the file. If there is an error, report it and exit. */
-	DEBUG("Parsing config file %s", filename);
-	if(config_read_file(&cfg, filename) != CONFIG_TRUE) {
-		if (asprintf(error, "%s:%d - %s\n", config_error_file(&cfg),
+	/* Read the buffer. If there is an error, report it and exit. */
+	DEBUG("Parsing %s", SW_DESCRIPTION_FILENAME);
+	if(config_read_string(&cfg, buf) != CONFIG_TRUE) {
+		if (asprintf(error, "%s:%d - %s\n", SW_DESCRIPTION_FILENAME,
 			     config_error_line(&cfg), config_error_text(&cfg)) == ENOMEM_ASPRINTF) {
 			ERROR("OOM when caching error");
 			return -ENOMEM;
@@ -1149,34 +1192,25 @@ int parse_cfg(struct swupdate_cfg *swcfg, const char *filename, char **error)
 
 #define JSON_OBJECT_FREED 1
 
-int parse_json(struct swupdate_cfg *swcfg, const char *filename, char **error)
+int parse_json(struct swupdate_cfg *swcfg, const char *buf,
+	       size_t __attribute__ ((__unused__)) len, char **error)
 {
 	int ret;
-	size_t read_len = 0;
-	char *string = NULL;
 	json_object *cfg;
 	parsertype p = JSON_PARSER;
 
-	DEBUG("Parsing config file %s", filename);
-	ret = read_file_into_buf(filename, (unsigned char **)&string, &read_len);
-	if (ret)
-		return ret;
-
-	cfg = json_tokener_parse(string);
+	DEBUG("Parsing %s", SW_DESCRIPTION_FILENAME);
+	cfg = json_tokener_parse(buf);
 	if (!cfg) {
 		if (asprintf(error, "JSON File corrupted") == ENOMEM_ASPRINTF) {
 			ERROR("OOM when caching error");
-			free(string);
 			return -ENOMEM;
 		}
-		free(string);
 		return -1;
 	}
 
-	if (!get_common_fields(p, cfg, swcfg)) {
-		free(string);
+	if (!get_common_fields(p, cfg, swcfg))
 		return -1;
-	}
 
 	ret = parser(p, cfg, swcfg);
 
@@ -1184,7 +1218,5 @@ int parse_json(struct swupdate_cfg *swcfg, const char *filename, char **error)
 		WARN("Leaking cfg json object");
 	}
 
-	free(string);
-
 	return ret;
 }
@@ -241,7 +241,7 @@ static void *server_progress_thread (void *data)
 	server_op_res_t result;
 	char *logbuffer = NULL;
 
-	LIST_INIT(&fmtevents);
+	dict_init(&fmtevents);
 
 	if (!prog) {
 		ERROR("Fatal Error: thread without data !");
@@ -458,7 +458,7 @@ static server_op_res_t server_get_deployment_info(channel_t *channel, channel_da
 	 */
 	channel_data->url= server_prepare_query(server_general.url, &server_general.configdata);
 
-	LIST_INIT(&server_general.received_httpheaders);
+	dict_init(&server_general.received_httpheaders);
 	channel_data->received_headers = &server_general.received_httpheaders;
 
 	result = map_http_retcode(channel->get(channel, (void *)channel_data));
@@ -616,8 +616,8 @@ static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 {
 	int choice = 0;
 
-	LIST_INIT(&server_general.configdata);
-	LIST_INIT(&server_general.httpheaders_to_send);
+	dict_init(&server_general.configdata);
+	dict_init(&server_general.httpheaders_to_send);
 
 	if (fname) {
 		swupdate_cfg_handle handle;
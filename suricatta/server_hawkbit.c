@@ -1835,8 +1835,8 @@ static server_op_res_t server_start(const char *fname, int argc, char *argv[])
 	mandatory_argument_count = 0;
 
 	pthread_mutex_lock(&ipc_lock);
-	LIST_INIT(&server_hawkbit.configdata);
-	LIST_INIT(&server_hawkbit.httpheaders);
+	dict_init(&server_hawkbit.configdata);
+	dict_init(&server_hawkbit.httpheaders);
 
 	server_hawkbit.initial_report_resend_period = INITIAL_STATUS_REPORT_WAIT_DELAY;
 	if (fname) {
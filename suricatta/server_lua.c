@@ -691,7 +691,7 @@ static int channel_do_operation(lua_State *L, channel_method_t op)
 	channel_set_options(L, &channel_data);
 
 	struct dict header_send;
-	LIST_INIT(&header_send);
+	dict_init(&header_send);
 	/* Set HTTP headers as specified while channel creation. */
 	if (udc->channel_data->headers_to_send) {
 		struct dict_entry *entry;
@@ -708,7 +708,7 @@ static int channel_do_operation(lua_State *L, channel_method_t op)
 
 	/* Setup received HTTP headers dict. */
 	struct dict header_receive;
-	LIST_INIT(&header_receive);
+	dict_init(&header_receive);
 	channel_data.received_headers = &header_receive;
 
 	lua_pop(L, 1);
@@ -1128,7 +1128,7 @@ static void do_install(lua_State *L, int fdout)
 
 	/* Setup received HTTP headers dict. */
 	struct dict received_headers;
-	LIST_INIT(&received_headers);
+	dict_init(&received_headers);
 	channel_data.received_headers = &received_headers;
 
 	/* Perform the operation.... */
@@ -1347,7 +1347,7 @@ static int lua_channel_open(lua_State *L)
 	}
 
 	/* Set global default HTTP header options for channel. */
-	LIST_INIT(channel_data->headers_to_send);
+	dict_init(channel_data->headers_to_send);
 	(void)channel_set_header_options(L, channel_data->headers_to_send,
 					 "headers_to_send");
 
@@ -0,0 +1,490 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Throughput benchmark of copyfile(): every combination of input
+ * (memory or file), compressor, decryption, hash verification,
+ * buffer size and threaded pipeline is run and the result printed
+ * as one JSON object per line:
+ *
+ * {"input": "file", "compression": "zstd", "encrypted": false,
+ *  "hash": true, "buffer_size": 65536, "threaded": true,
+ *  "in_bytes": ..., "out_bytes": ..., "wall_ms": ...,
+ *  "mb_per_s": ..., "cpu_ms_per_mb": ...}
+ *
+ * mb_per_s refers to the output (uncompressed) data, cpu_ms_per_mb
+ * is the CPU time of the whole process, all threads included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <util.h>
+#include <cpiohdr.h>
+#include <swupdate_crypto.h>
+#ifdef CONFIG_GUNZIP
+#include <zlib.h>
+#endif
+#ifdef CONFIG_XZ
+#include <lzma.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4frame.h>
+#endif
+#if defined(CONFIG_ENCRYPTED_IMAGES) && defined(CONFIG_SSL_IMPL_OPENSSL)
+#include <openssl/evp.h>
+#define BENCH_AES
+#endif
+
+#define MB	(1024UL * 1024UL)
+
+/* fixed key / ivt, the benchmark does not care about secrecy */
+#define BENCH_AES_KEY	"69d54287f856d30b51b812fdf714556778fe5c3b87f3a3b3c0cfe0fa4a7ae7b5"
+#define BENCH_AES_IVT	"e6b0a5f8a5c6b3f4d9e1c2a3b4c5d6e7"
+
+struct payload {
+	const char *name;
+	enum compression_type compressed;
+	unsigned char *data;
+	size_t len;
+};
+
+struct payload_set {
+	unsigned char *plain;
+	size_t size;
+	struct payload payload[5];
+	unsigned int count;
+};
+
+static size_t out_bytes;
+
+static int discard(void *out, const void *buf, size_t len)
+{
+	(void)out;
+	(void)buf;
+	out_bytes += len;
+	return 0;
+}
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Firmware-like data: runs of zeroes (erased areas),
+ * repeated text (filesystem metadata) and random bytes
+ * (already compressed files)
+ */
+static unsigned char *generate(size_t size)
+{
+	static const char text[] = "swupdate benchmark /usr/lib/libswupdate.so.0.1 ";
+	unsigned char *buf = malloc(size);
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+	if (!buf)
+		return NULL;
+
+	for (size_t i = 0; i < size; i++) {
+		switch ((i / 4096) % 4) {
+		case 0:
+			buf[i] = 0;
+			break;
+		case 1:
+			buf[i] = text[i % (sizeof(text) - 1)];
+			break;
+		default:
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = x;
+			break;
+		}
+	}
+
+	return buf;
+}
+
+#ifdef CONFIG_GUNZIP
+static unsigned char *compress_zlib(const unsigned char *in, size_t len, size_t *outlen)
+{
+	z_stream strm = {0};
+	size_t bound = compressBound(len) + 64;
+	unsigned char *out = malloc(bound);
+
+	if (!out || deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(out);
+		return NULL;
+	}
+	strm.next_in = (unsigned char *)in;
+	strm.avail_in = len;
+	strm.next_out = out;
+	strm.avail_out = bound;
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&strm);
+		free(out);
+		return NULL;
+	}
+	*outlen = strm.total_out;
+	deflateEnd(&strm);
+
+	return out;
+}
+#endif
+
+#ifdef CONFIG_XZ
+static unsigned char *compress_xz(const unsigned char *in, size_t len, size_t *outlen)
+{
+	size_t bound = lzma_stream_buffer_bound(len);
+	unsigned char *out = malloc(bound);
+
+	*outlen = 0;
+	if (!out || lzma_easy_buffer_encode(LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64,
+					    NULL, in, len, out, outlen, bound) != LZMA_OK) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+#endif
+
+#ifdef CONFIG_ZSTD
+static unsigned char *compress_zstd(const unsigned char *in, size_t len, size_t *outlen)
+{
+	size_t bound = ZSTD_compressBound(len);
+	unsigned char *out = malloc(bound);
+
+	if (!out)
+		return NULL;
+	*outlen = ZSTD_compress(out, bound, in, len, ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(*outlen)) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static unsigned char *compress_lz4(const unsigned char *in, size_t len, size_t *outlen)
+{
+	size_t bound = LZ4F_compressFrameBound(len, NULL);
+	unsigned char *out = malloc(bound);
+
+	if (!out)
+		return NULL;
+	*outlen = LZ4F_compressFrame(out, bound, in, len, NULL);
+	if (LZ4F_isError(*outlen)) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+#endif
+
+#ifdef BENCH_AES
+static unsigned char *encrypt(const unsigned char *in, size_t len, size_t *outlen)
+{
+	unsigned char key[AES_256_KEY_LEN], ivt[AES_BLK_SIZE];
+	unsigned char *out = malloc(len + AES_BLK_SIZE);
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int l1, l2;
+
+	if (!out || !ctx ||
+	    ascii_to_bin(key, sizeof(key), BENCH_AES_KEY) ||
+	    ascii_to_bin(ivt, sizeof(ivt), BENCH_AES_IVT) ||
+	    EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, ivt) != 1 ||
+	    EVP_EncryptUpdate(ctx, out, &l1, in, len) != 1 ||
+	    EVP_EncryptFinal_ex(ctx, out + l1, &l2) != 1) {
+		EVP_CIPHER_CTX_free(ctx);
+		free(out);
+		return NULL;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	*outlen = l1 + l2;
+
+	return out;
+}
+#endif
+
+static void add_payload(struct payload_set *set, const char *name,
+			enum compression_type compressed,
+			unsigned char *data, size_t len)
+{
+	if (!data) {
+		fprintf(stderr, "Cannot prepare %s payload, skipping\n", name);
+		return;
+	}
+	set->payload[set->count].name = name;
+	set->payload[set->count].compressed = compressed;
+	set->payload[set->count].data = data;
+	set->payload[set->count].len = len;
+	set->count++;
+}
+
+static int prepare(struct payload_set *set, size_t size)
+{
+	unsigned char *data __attribute__((__unused__));
+	size_t len __attribute__((__unused__));
+
+	memset(set, 0, sizeof(*set));
+	set->size = size;
+	set->plain = generate(size);
+	if (!set->plain)
+		return -ENOMEM;
+
+	add_payload(set, "none", COMPRESSED_FALSE, set->plain, size);
+#ifdef CONFIG_GUNZIP
+	data = compress_zlib(set->plain, size, &len);
+	add_payload(set, "zlib", COMPRESSED_ZLIB, data, len);
+#endif
+#ifdef CONFIG_XZ
+	data = compress_xz(set->plain, size, &len);
+	add_payload(set, "xz", COMPRESSED_XZ, data, len);
+#endif
+#ifdef CONFIG_ZSTD
+	data = compress_zstd(set->plain, size, &len);
+	add_payload(set, "zstd", COMPRESSED_ZSTD, data, len);
+#endif
+#ifdef CONFIG_LZ4
+	data = compress_lz4(set->plain, size, &len);
+	add_payload(set, "lz4", COMPRESSED_LZ4, data, len);
+#endif
+
+	return 0;
+}
+
+/*
+ * Write the payload to a temporary file, followed
+ * by the cpio padding as in a SWU
+ */
+static int payload_to_file(const unsigned char *data, size_t len)
+{
+	static const char pad[4] = {0};
+	const char *tmpdir = getenv("TMPDIR");
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/bench_copyfileXXXXXX",
+		 tmpdir ? tmpdir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -errno;
+	unlink(path);
+
+	if (copy_write(&fd, data, len) ||
+	    copy_write(&fd, pad, NPAD_BYTES(len))) {
+		close(fd);
+		return -EIO;
+	}
+
+	return fd;
+}
+
+static int run(const struct payload_set *set, const struct payload *p,
+	       bool file, bool encrypted, bool hash, size_t bufsize,
+	       bool threaded, unsigned int iterations)
+{
+	unsigned char sha256[SHA256_HASH_LENGTH];
+	const unsigned char *in = p->data;
+	unsigned char *crypted = NULL;
+	size_t inlen = p->len;
+	uint64_t wall = 0, cpu = 0, start, cpustart;
+	unsigned int md_len = 0;
+	unsigned long offs;
+	int fd = -1, ret = 0;
+	void *dgst;
+
+#ifdef BENCH_AES
+	if (encrypted) {
+		crypted = encrypt(p->data, p->len, &inlen);
+		if (!crypted)
+			return -EFAULT;
+		in = crypted;
+	}
+#endif
+
+	if (hash) {
+		dgst = swupdate_HASH_init(SHA_DEFAULT);
+		if (!dgst || swupdate_HASH_update(dgst, in, inlen) ||
+		    swupdate_HASH_final(dgst, sha256, &md_len)) {
+			swupdate_HASH_cleanup(dgst);
+			ret = -EFAULT;
+			goto out;
+		}
+		swupdate_HASH_cleanup(dgst);
+	}
+
+	if (file) {
+		fd = payload_to_file(in, inlen);
+		if (fd < 0) {
+			ret = fd;
+			goto out;
+		}
+	}
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		struct swupdate_copy copy = {
+			.fdin = fd,
+			.inbuf = file ? NULL : (unsigned char *)in,
+			.callback = discard,
+			.nbytes = inlen,
+			.offs = &offs,
+			.compressed = p->compressed,
+			.hash = hash ? sha256 : NULL,
+			.encrypted = encrypted,
+			.imgaes = BENCH_AES_KEY,
+			.imgivt = BENCH_AES_IVT,
+			.cipher = AES_CBC_256,
+			.threaded = threaded,
+			.buffer_size = bufsize,
+		};
+
+		if (file && lseek(fd, 0, SEEK_SET) < 0) {
+			ret = -errno;
+			goto out;
+		}
+		offs = 0;
+		out_bytes = 0;
+
+		start = clock_ns(CLOCK_MONOTONIC);
+		cpustart = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+		ret = copyfile(&copy);
+		cpu += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpustart;
+		wall += clock_ns(CLOCK_MONOTONIC) - start;
+
+		if (ret || out_bytes != set->size) {
+			fprintf(stderr, "copyfile failed: %s %s ret=%d out=%zu\n",
+				file ? "file" : "memory", p->name, ret, out_bytes);
+			ret = ret ? ret : -EIO;
+			goto out;
+		}
+	}
+
+	fprintf(stdout,
+		"{\"input\": \"%s\", \"compression\": \"%s\", \"encrypted\": %s, "
+		"\"hash\": %s, \"buffer_size\": %zu, \"threaded\": %s, "
+		"\"in_bytes\": %zu, \"out_bytes\": %zu, \"wall_ms\": %.3f, "
+		"\"mb_per_s\": %.2f, \"cpu_ms_per_mb\": %.3f}\n",
+		file ? "file" : "memory", p->name,
+		encrypted ? "true" : "false", hash ? "true" : "false",
+		bufsize, threaded ? "true" : "false",
+		inlen, set->size, wall / 1e6 / iterations,
+		(double)set->size * iterations / MB / (wall / 1e9),
+		cpu / 1e6 / iterations / ((double)set->size / MB));
+	fflush(stdout);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(crypted);
+	return ret;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout,
+		"%s [OPTIONS]\n"
+		"\t-s, --size <MiB>            : uncompressed size of the payload (default 16)\n"
+		"\t-i, --iterations <n>        : runs averaged for each result (default 3)\n"
+		"\t-b, --buffer-sizes <list>   : comma separated buffer sizes (default 4K,16K,64K,256K,1M)\n"
+		"\t-h, --help                  : print this help and exit\n",
+		program);
+}
+
+static struct option long_options[] = {
+	{"size", required_argument, NULL, 's'},
+	{"iterations", required_argument, NULL, 'i'},
+	{"buffer-sizes", required_argument, NULL, 'b'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+	char default_sizes[] = "4K,16K,64K,256K,1M";
+	char *sizes = default_sizes, *tok, *saveptr;
+	size_t bufsizes[16];
+	unsigned int nbufsizes = 0;
+	unsigned int iterations = 3;
+	size_t size = 16 * MB;
+	struct payload_set set;
+	int c, ret = 0;
+
+	/* BENCH_ARGS can contain options of the other benchmarks */
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "s:i:b:h", long_options, NULL)) != EOF) {
+		switch (c) {
+		case 's':
+			size = strtoul(optarg, NULL, 10) * MB;
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			sizes = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			break;
+		}
+	}
+
+	for (tok = strtok_r(sizes, ",", &saveptr); tok && nbufsizes < ARRAY_SIZE(bufsizes);
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (buffer_size_from_string(tok, &bufsizes[nbufsizes])) {
+			fprintf(stderr, "Invalid buffer size %s\n", tok);
+			exit(EXIT_FAILURE);
+		}
+		nbufsizes++;
+	}
+
+	if (!size || !iterations || !nbufsizes) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (prepare(&set, size)) {
+		fprintf(stderr, "Cannot allocate the payload\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned int i = 0; i < set.count; i++)
+	for (int file = 0; file < 2; file++)
+#ifdef BENCH_AES
+	for (int encrypted = 0; encrypted < 2; encrypted++)
+#else
+	for (int encrypted = 0; encrypted < 1; encrypted++)
+#endif
+	for (int hash = 0; hash < 2; hash++)
+	for (unsigned int b = 0; b < nbufsizes; b++)
+	for (int threaded = 0; threaded < 2; threaded++)
+		ret |= run(&set, &set.payload[i], file, encrypted, hash,
+			   bufsizes[b], threaded, iterations);
+
+	for (unsigned int i = 0; i < set.count; i++)
+		if (set.payload[i].data != set.plain)
+			free(set.payload[i].data);
+	free(set.plain);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * Benchmark of struct dict: dictionaries of increasing size are
+ * filled and every key is looked up. "walk" looks up the same keys
+ * walking the list with strcmp(), as dict_get_value() did before
+ * the hash index, and it is the reference for "lookup".
+ * One JSON object per line is printed:
+ *
+ * {"entries": 10000, "op": "lookup", "ops": ..., "ns_per_op": ...}
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <swupdate_dict.h>
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* keys similar to bootloader variables */
+static char **make_keys(unsigned int n, const char *prefix)
+{
+	char **keys = calloc(n, sizeof(*keys));
+
+	if (!keys)
+		return NULL;
+	for (unsigned int i = 0; i < n; i++) {
+		if (asprintf(&keys[i], "%s_var_%u", prefix, i * 2654435761U) < 0)
+			return NULL;
+	}
+
+	return keys;
+}
+
+static char *walk_get_value(struct dict *dictionary, const char *key)
+{
+	struct dict_entry *entry;
+
+	LIST_FOREACH(entry, dictionary, next) {
+		if (strcmp(key, entry->key) == 0)
+			return dict_entry_get_value(entry);
+	}
+
+	return NULL;
+}
+
+static void report(unsigned int entries, const char *op, uint64_t ops,
+		   uint64_t ns)
+{
+	fprintf(stdout, "{\"entries\": %u, \"op\": \"%s\", \"ops\": %llu, "
+		"\"ns_per_op\": %.1f}\n", entries, op, (unsigned long long)ops,
+		(double)ns / ops);
+}
+
+static int run(unsigned int entries, unsigned int iterations)
+{
+	struct dict dictionary;
+	char **keys, **missing;
+	uint64_t start, found = 0;
+
+	keys = make_keys(entries, "bootenv");
+	missing = make_keys(entries, "absent");
+	if (!keys || !missing)
+		return -1;
+
+	dict_init(&dictionary);
+	start = clock_ns();
+	for (unsigned int i = 0; i < entries; i++)
+		if (dict_set_value(&dictionary, keys[i], "value"))
+			return -1;
+	report(entries, "set", entries, clock_ns() - start);
+
+	start = clock_ns();
+	for (unsigned int it = 0; it < iterations; it++)
+		for (unsigned int i = 0; i < entries; i++)
+			found += dict_get_value(&dictionary, keys[i]) != NULL;
+	report(entries, "lookup", (uint64_t)entries * iterations, clock_ns() - start);
+
+	start = clock_ns();
+	for (unsigned int it = 0; it < iterations; it++)
+		for (unsigned int i = 0; i < entries; i++)
+			found += dict_get_value(&dictionary, missing[i]) != NULL;
+	report(entries, "miss", (uint64_t)entries * iterations, clock_ns() - start);
+
+	start = clock_ns();
+	for (unsigned int it = 0; it < iterations; it++)
+		for (unsigned int i = 0; i < entries; i++)
+			found += walk_get_value(&dictionary, keys[i]) != NULL;
+	report(entries, "walk", (uint64_t)entries * iterations, clock_ns() - start);
+
+	start = clock_ns();
+	for (unsigned int i = 0; i < entries; i++)
+		dict_remove(&dictionary, keys[i]);
+	report(entries, "remove", entries, clock_ns() - start);
+
+	dict_drop_db(&dictionary);
+	for (unsigned int i = 0; i < entries; i++) {
+		free(keys[i]);
+		free(missing[i]);
+	}
+	free(keys);
+	free(missing);
+
+	/* every key is found twice, by lookup and by walk */
+	return found == 2ULL * entries * iterations ? 0 : -1;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout,
+		"%s [OPTIONS]\n"
+		"\t-e, --entries <n>           : size of the largest dictionary (default 10000)\n"
+		"\t-i, --iterations <n>        : lookups of each key (default 3)\n"
+		"\t-h, --help                  : print this help and exit\n",
+		program);
+}
+
+static struct option long_options[] = {
+	{"entries", required_argument, NULL, 'e'},
+	{"iterations", required_argument, NULL, 'i'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+	unsigned int entries = 10000;
+	unsigned int iterations = 3;
+	int c, ret = 0;
+
+	/* BENCH_ARGS can contain options of the other benchmarks */
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "e:i:h", long_options, NULL)) != EOF) {
+		switch (c) {
+		case 'e':
+			entries = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			break;
+		}
+	}
+
+	if (!entries || !iterations) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned int n = 10; n < entries; n *= 10)
+		ret |= run(n, iterations);
+	ret |= run(entries, iterations);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
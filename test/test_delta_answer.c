@@ -0,0 +1,94 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "handlers/delta_handler.h"
+
+static int fds[2];
+
+static int answer_setup(void **state)
+{
+	(void)state;
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+}
+
+static int answer_teardown(void **state)
+{
+	(void)state;
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static void send_answer(uint32_t id, request_type type, const char *data)
+{
+	range_answer_t *answer = calloc(1, sizeof(*answer));
+	size_t half = sizeof(*answer) / 2;
+
+	assert_non_null(answer);
+	answer->id = id;
+	answer->type = type;
+	answer->len = strlen(data);
+	memcpy(answer->data, data, answer->len);
+	/* the reader must handle short reads */
+	assert_int_equal(write(fds[1], answer, half), half);
+	assert_int_equal(write(fds[1], (char *)answer + half, sizeof(*answer) - half),
+			 sizeof(*answer) - half);
+	free(answer);
+}
+
+static void test_delta_answer_skips_other_ids(void **state)
+{
+	range_answer_t *answer = calloc(1, sizeof(*answer));
+
+	(void)state;
+	assert_non_null(answer);
+	/* leftover of a canceled request */
+	send_answer(1, RANGE_DATA, "stale");
+	send_answer(1, RANGE_COMPLETED, "");
+	send_answer(2, RANGE_DATA, "fresh");
+
+	assert_true(delta_read_answer(fds[0], 2, answer));
+	assert_int_equal(answer->id, 2);
+	assert_int_equal(answer->type, RANGE_DATA);
+	assert_int_equal(answer->len, strlen("fresh"));
+	assert_memory_equal(answer->data, "fresh", answer->len);
+	free(answer);
+}
+
+static void test_delta_answer_closed(void **state)
+{
+	range_answer_t *answer = calloc(1, sizeof(*answer));
+
+	(void)state;
+	assert_non_null(answer);
+	send_answer(1, RANGE_DATA, "stale");
+	/* a partial answer followed by EOF is an error */
+	assert_int_equal(write(fds[1], answer, 16), 16);
+	shutdown(fds[1], SHUT_WR);
+
+	assert_false(delta_read_answer(fds[0], 2, answer));
+	free(answer);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest answer_tests[] = {
+		cmocka_unit_test_setup_teardown(test_delta_answer_skips_other_ids,
+						answer_setup, answer_teardown),
+		cmocka_unit_test_setup_teardown(test_delta_answer_closed,
+						answer_setup, answer_teardown),
+	};
+	error_count += cmocka_run_group_tests_name("delta_answer", answer_tests,
+						   NULL, NULL);
+	return error_count;
+}
@@ -21,11 +21,13 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <cmocka.h>
 
 #include "swupdate_crypto.h"
 #include "swupdate.h"
+#include "util.h"
 
 #define DATADIR "test/data/"
 
@@ -45,7 +47,60 @@ static void test_verify_pkcs15(void **state)
 	assert_int_equal(error, 0);
 }
 
+/*
+ * Verify the files read into memory, then with one byte changed
+ */
+static void verify_buf(struct swupdate_cfg *config, const char *sigfile)
+{
+	unsigned char *sig, *data;
+	size_t siglen, len;
+	int error;
+
+	error = read_file_into_buf(sigfile, &sig, &siglen);
+	assert_int_equal(error, 0);
+	error = read_file_into_buf(DATADIR "to-be-signed", &data, &len);
+	assert_int_equal(error, 0);
+
+	error = swupdate_verify_buf(config->dgst, sig, siglen, data, len, NULL);
+	assert_int_equal(error, 0);
+
+	data[0] ^= 0x1;
+	error = swupdate_verify_buf(config->dgst, sig, siglen, data, len, NULL);
+	assert_int_not_equal(error, 0);
+
+	free(sig);
+	free(data);
+}
+
+static void test_verify_pkcs15_buf(void **state)
+{
+	int error;
+	struct swupdate_cfg config;
+
+	(void)state;
+
+	config.dgst = NULL;
+	error = swupdate_dgst_init(&config, DATADIR "signing-pubkey.pem");
+	assert_int_equal(error, 0);
+
+	verify_buf(&config, DATADIR "signature");
+}
+
 #if defined(CONFIG_SIGALG_CMS) && defined(CONFIG_SSL_IMPL_OPENSSL)
+static void test_verify_cms_buf(void **state)
+{
+	int error;
+	struct swupdate_cfg config;
+
+	(void)state;
+
+	memset(&config, 0, sizeof(config));
+	error = swupdate_dgst_init(&config, DATADIR "cms-ca.cert.pem");
+	assert_int_equal(error, 0);
+
+	verify_buf(&config, DATADIR "signature.cms");
+}
+
 static void test_verify_cms_without_crl(void **state)
 {
 	int error;
@@ -119,7 +174,9 @@ int main(void)
 	swupdate_crypto_init();
 	static const struct CMUnitTest verify_tests[] = {
 		cmocka_unit_test(test_verify_pkcs15),
+		cmocka_unit_test(test_verify_pkcs15_buf),
 #if defined(CONFIG_SIGALG_CMS) && defined(CONFIG_SSL_IMPL_OPENSSL)
+		cmocka_unit_test(test_verify_cms_buf),
 		cmocka_unit_test(test_verify_cms_without_crl),
 		cmocka_unit_test(test_verify_cms_with_revoked_signer_crl),
 		cmocka_unit_test(test_verify_cms_with_revoked_signer_der_crl),
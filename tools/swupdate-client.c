@@ -148,8 +148,17 @@ static int send_file(const char* filename) {
 		strncpy(req.software_set, software_set, sizeof(req.software_set) - 1);
 		strncpy(req.running_mode, running_mode, sizeof(req.running_mode) - 1);
 	}
-	rc = swupdate_async_start(readimage, printstatus,
-				end, &req, sizeof(req));
+	/*
+	 * A file is passed as fd, SWUpdate reads it directly.
+	 * Fall back to stream it if the request is rejected.
+	 */
+	rc = -EINVAL;
+	if (filename)
+		rc = swupdate_async_start_fd(fd, printstatus,
+					     end, &req, sizeof(req));
+	if (rc < 0)
+		rc = swupdate_async_start(readimage, printstatus,
+					  end, &req, sizeof(req));
 
 	/* return if we've hit an error scenario */
 	if (rc < 0) {
@@ -109,6 +109,14 @@ static void usage_dwlurl(const char *program) {
 		);
 }
 
+static void usage_stats(const char *program) {
+	fprintf(stdout,"\t %s \n", program);
+	fprintf(stdout,
+		"\t\tprint the per-stage statistics of the last install\n"
+		"\t\t(install-stats must be set in the configuration)\n"
+		);
+}
+
 /*
  * Utility functions called by subcommands
  */
@@ -358,6 +366,28 @@ static int sendtohawkbit(cmd_t *cmd, int argc, char *argv[]) {
 	return 0;
 }
 
+static int stats(cmd_t  __attribute__((__unused__)) *cmd,
+		 int  __attribute__((__unused__)) argc,
+		 char  __attribute__((__unused__)) *argv[]) {
+	char buf[2048];
+	unsigned int index = 0;
+	int count;
+
+	do {
+		count = swupdate_get_install_stats(index, buf, sizeof(buf));
+		if (count < 0) {
+			if (!index) {
+				fprintf(stderr, "No statistics available.\n");
+				return 1;
+			}
+			break;
+		}
+		fprintf(stdout, "%s\n", buf);
+	} while (++index < (unsigned int)count);
+
+	return 0;
+}
+
 static int gethawkbitstatus(cmd_t  __attribute__((__unused__)) *cmd,
 			    int  __attribute__((__unused__)) argc,
 			    char  __attribute__((__unused__)) *argv[]) {
@@ -774,6 +804,7 @@ cmd_t commands[] = {
 	{"sysrestart", sysrestart, usage_sysrestart},
 	{"monitor", monitor, usage_monitor},
 	{"dwlurl", dwlurl, usage_dwlurl},
+	{"stats", stats, usage_stats},
 	{NULL, NULL, NULL}
 };
 